@@ -0,0 +1,90 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#ifndef LIBSUNBURN_H
+#define LIBSUNBURN_H
+
+#include <stdint.h>
+
+/**
+ * Context of one device: the USB handle or fake device, the flash geometry,
+ * the options and the log sink. Contexts are independent, different threads
+ * may use different contexts at the same time. One context must only be used
+ * by one thread at a time.
+ */
+typedef struct devinfo devinfo_t;
+
+#define SB_LOG_ERROR		-1	/* Errors, also kept for sb_error() */
+#define SB_LOG_INFO		0	/* Progress messages */
+#define SB_LOG_DEBUG1		1
+#define SB_LOG_DEBUG2		2
+
+/**
+ * Log sink, gets complete messages including the trailing newline
+ * @param arg Argument given to sb_set_log()
+ * @param level One of SB_LOG_
+ * @param msg The message
+ */
+typedef void (*sb_logfn_t)(void *arg, int level, const char *msg);
+
+#define SB_OPT_INITDRAM		0x1	/* Run the DRAM init code in FLASH */
+#define SB_OPT_NOFLASHCONFIG	0x2	/* Don't send the built-in flash config */
+#define SB_OPT_ODIRECT		0x4	/* Write dump files with O_DIRECT */
+
+/* Context */
+devinfo_t *sb_create(void);
+void sb_destroy(devinfo_t *di);
+void sb_set_log(devinfo_t *di, sb_logfn_t fn, void *arg, int level);
+void sb_set_options(devinfo_t *di, int opts);
+int sb_set_hashes(devinfo_t *di, char *list);
+int sb_set_helper(devinfo_t *di, char *fname);
+void sb_set_cache(devinfo_t *di, unsigned long bytes);
+void sb_set_journal(devinfo_t *di, char *path, int resume);
+void sb_finish_journal(devinfo_t *di);
+const char *sb_error(devinfo_t *di);
+
+/* Device */
+int sb_open_usb(devinfo_t *di, int index);
+int sb_open_fake(devinfo_t *di, char *spec);
+int sb_setup(devinfo_t *di);
+void sb_close(devinfo_t *di);
+void sb_geometry(devinfo_t *di, unsigned int *ppb, unsigned int *ps,
+		 unsigned int *tb);
+
+/* Operations on caller provided buffers */
+int sb_ram_read(devinfo_t *di, uint32_t addr, void *buf, uint32_t len);
+int sb_ram_write(devinfo_t *di, uint32_t addr, void *buf, uint32_t len);
+int sb_flash_read(devinfo_t *di, uint32_t addr, void *buf, uint32_t len);
+int sb_flash_write(devinfo_t *di, uint32_t addr, void *buf, uint32_t len);
+int sb_execute(devinfo_t *di, uint32_t addr);
+
+/* Operations on files */
+int sb_ram_dump(devinfo_t *di, uint32_t addr, uint32_t len, char *fname);
+int sb_flash_dump(devinfo_t *di, uint32_t addr, uint32_t len, char *fname);
+int sb_flash_write_file(devinfo_t *di, uint32_t addr, char *fname);
+int sb_ram_write_file(devinfo_t *di, uint32_t addr, char *fname, int verify);
+int sb_bootfile_write_file(devinfo_t *di, uint32_t id, uint32_t pataddr,
+			   uint32_t dataddr, char *fname);
+
+/* Deduplicated backups */
+int sb_backup(devinfo_t *di, char *store);
+int sb_restore(devinfo_t *di, char *store, char *index);
+
+#endif
@@ -31,49 +31,12 @@
 
 #include "sb.h"
 
-int dl = 0;
-int initdram = 0;
-
-/* Flash config data for the Letcool device with Micron 29F32G08 flash */
-char fc_29F32G08[sizeof(nandconf_t)] =
-{
-				0x80, 0x00, 0x80, 0x10, 0x00, 0x10, 0x80, 0x00,
-				0x20, 0x00, 0x20, 0x00, 0x00, 0x20, 0x0D, 0x00,
-				0x00, 0x00, 0x00, 0x00, 0x5d, 0xf0, 0x07, 0x00,
-				0x80, 0x00, 0x05, 0x00, 0x05, 0x00, 0x00, 0x00,
-				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00,
-				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00,
-				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00,
-				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00
-};
-
-void hexdump(unsigned char *data, int length, int base)
-{
-	int i;
-
-	for (i = 0; i < length; i++)
-	{
-		if ((i % 16) == 0)
-		{
-			if ((i / 16) > 0)
-			{
-				base += 16;
-				printf("\n");
-			}
-			printf("%08X: ", base);
-		}
-		printf("%02X ", data[i]);
-	}
-
-	if (i % 15 != 0)
-		printf("\n");
-}
-
 /**
  * Prints information about the NAND config
+ * @param di Device info struct the output belongs to
  * @param nc Pointer to struct nandconf_t containing the info
  */
-void print_nand_info(nandconf_t *nc)
+void print_nand_info(devinfo_t *di, nandconf_t *nc)
 {
 	int ppb = le16toh(nc->pagesperblock);
 	int ps = le16toh(nc->pagesize);
@@ -81,18 +44,18 @@ void print_nand_info(nandconf_t *nc)
 	int tb = le16toh(nc->totalblocks);
 	uint8_t *fid = nc->flashid1;
 	
-	DBG("- NAND Info:\n");
-	DBG("Pages per block:        %d\n", ppb);
-	DBG("Real Pagesize:          %d\n", ps);
-	DBG("Pagesize:               %d\n", pl);
-	DBG("Total number of blocks: %d\n", tb);
-	DBG("ECC mode:               %d\n", nc->eccmode);
-	DBG("Total size :            %u KB\n", tb * ppb * (ps / 1024));
-	DBG("NAND ID:                %02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X\n",
+	DBG(di, "- NAND Info:\n");
+	DBG(di, "Pages per block:        %d\n", ppb);
+	DBG(di, "Real Pagesize:          %d\n", ps);
+	DBG(di, "Pagesize:               %d\n", pl);
+	DBG(di, "Total number of blocks: %d\n", tb);
+	DBG(di, "ECC mode:               %d\n", nc->eccmode);
+	DBG(di, "Total size :            %u KB\n", tb * ppb * (ps / 1024));
+	DBG(di, "NAND ID:                %02X-%02X-%02X-%02X-%02X-%02X-%02X-%02X\n",
 		fid[0], fid[1], fid[2], fid[3], fid[4], fid[5], fid[6], fid[7]);
-	DBG("Hedump:\n");
+	DBG(di, "Hedump:\n");
 	hexdump((unsigned char*)nc, sizeof(nandconf_t), 0);
-	printf("\n");
+	DBG(di, "\n");
 }
 
 /**
@@ -106,24 +69,24 @@ int print_device_infos(devinfo_t *di)
 	nandconf_t nc;
 	char devid[DEVICE_ID_LENGTH];
 
-	DBG("-- Device information --\n");
+	DBG(di, "-- Device information --\n");
 
 	ret = cmd_read_devid(di, devid);
 	if (ret)
 	{
-		DBG("Can't read device ID\n");
+		DBG(di, "Can't read device ID\n");
 		return -1;
 	}
 
-	DBG("- ROMBOOT ID:\n");
+	DBG(di, "- ROMBOOT ID:\n");
 	hexdump((unsigned char*)devid, DEVICE_ID_LENGTH, 0);
 
 	ret = cmd_get_flash_info(di, &nc);
 	if (ret)
 		return -1;
-	print_nand_info(&nc);
+	print_nand_info(di, &nc);
 
-	if (initdram)
+	if (di->initdram)
 	{
 		ret = cmd_init_dram(di);
 		if (ret)
@@ -131,34 +94,76 @@ int print_device_infos(devinfo_t *di)
 		ret = cmd_get_flash_info(di, &nc);
 		if (ret)
 			return -1;
-		DBG("- DRAM Inited\n\n");
-		print_nand_info(&nc);
-		initdram = 0;
+		DBG(di, "- DRAM Inited\n\n");
+		print_nand_info(di, &nc);
+		di->initdram = 0;
 	}	
-	ret = image_show_pats_usb(di);
+	ret = image_show_pats_usb(di, 0, PAT_SEARCH_RANGE_PAGES);
 	if (ret)
 		return -1;
 
 	return 0;
 }
 
+/**
+ * Name of an operation, as used in the progress summary
+ * @param function Option letter of the operation
+ * @returns Name of the operation
+ */
+static char *function_name(char function)
+{
+	switch (function)
+	{
+		case 'l': return "romboot-dump";
+		case 'b': return "bootfiles-dump";
+		case 'r': return "ram-dump";
+		case 'f': return "flash-dump";
+		case 'k': return "flash-checksum";
+		case 'K': return "ram-checksum";
+		case 'F': return "flash-write";
+		case 'S': return "script";
+		case 'B': return "bootfile-write";
+		case 'L': return "bootfile-layout";
+		case 'p': return "pat-scan";
+		case 'T': return "bench";
+		case 'R': return "ram-boot";
+		case 'A': return "backup";
+		case 'X': return "restore";
+		case 'N': return "nbd";
+		case 'M': return "fuse-mount";
+		case 'm': return "ram-monitor";
+		default: return "unknown";
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int ret, opt;
-	char options[] = "ia:r:f:FB:GdDlc";
+	char options[] = "ia:r:f:FbB:LGdDlcoH:k:K:S:U:j:p:E:T:V:R:vA:X:C:N:J:un:m:"
+#ifdef SB_FUSE
+			 "M:"
+#endif
+			 ;
 
-	devinfo_t di;
-	nandconf_t nc;
+	devinfo_t *di;
 
 	char function = 0;
 	char *filename = NULL;
-	unsigned int addr, functarg;
-	int flashconfig = 1;
+	char *jsonfile = NULL;
+	char *fakespec = NULL;
+	char *journal = NULL;
+	char *planfile = NULL;
+	char *monranges = NULL;
+	int addrset = 0;
+	unsigned int addr = 0, functarg;
+	unsigned int patlen = 0, cachemb;
+	int patscan = 0, patfirst = 0, patpages = PAT_SEARCH_RANGE_PAGES;
+	int dl = 0, opts = 0, verify = 0, resume = 0;
 
 	opterr = 0;
-
-	DBG("Sunburn - Sunplus SPMP8000 firmware flashing tool " SB_VERSION
-		"\n\n");
+	di = sb_create();
+	if (di == NULL)
+		return 1;
 
 	while ((opt = getopt(argc, argv, options)) != -1)
 	switch (opt)
@@ -169,10 +174,29 @@ int main(int argc, char **argv)
 		case 'a':
 		case 'f':
 		case 'B':
-			DBGE("Option -%c requires an argument.\n", optopt);
+		case 'H':
+		case 'k':
+		case 'K':
+		case 'S':
+		case 'U':
+		case 'j':
+		case 'p':
+		case 'E':
+		case 'T':
+		case 'V':
+		case 'R':
+		case 'A':
+		case 'X':
+		case 'C':
+		case 'N':
+		case 'M':
+		case 'J':
+		case 'n':
+		case 'm':
+			DBGE(di, "Option -%c requires an argument.\n", optopt);
 			return 1;
 		default:
-			DBGE("Unknown option specified\n");
+			DBGE(di, "Unknown option specified\n");
 			return 1;
 		}
 		break;
@@ -180,54 +204,184 @@ int main(int argc, char **argv)
 		ret = sscanf(optarg, "0x%8X", &addr);
 		if (ret < 1)
 		{
-			DBGE("Invalid address specified\n");
+			DBGE(di, "Invalid address specified\n");
 			return 1;
 		}
+		addrset = 1;
 		break;
 	case 'b':
 	case 'i':
 	case 'F':
+	case 'L':
 	case 'l':
 		function = opt;
 		break;
 	case 'f':
 	case 'r':
 	case 'B':
+	case 'k':
+	case 'K':
+	case 'R':
 		function = opt;
 		ret = sscanf(optarg, "0x%8X", &functarg);
 		if (ret < 1)
 		{
-			DBGE("Invalid parameter\n");
+			DBGE(di, "Invalid parameter\n");
 			return 1;
 		}
 		break;
 	case 'c':
-		flashconfig = 0;
+		opts |= SB_OPT_NOFLASHCONFIG;
 		break;
 	case 'd':
 		if (dl < 3)
 			dl++;
 		break;
 	case 'D':
-		initdram = 1;
+		opts |= SB_OPT_INITDRAM;
+		break;
+	case 'o':
+		opts |= SB_OPT_ODIRECT;
+		break;
+	case 'v':
+		verify = 1;
+		break;
+	case 'u':
+		resume = 1;
+		break;
+	case 'J':
+		journal = optarg;
+		break;
+	case 'n':
+		planfile = optarg;
+		break;
+	case 'm':
+		function = opt;
+		monranges = optarg;
+		break;
+	case 'S':
+	case 'U':
+	case 'T':
+	case 'A':
+	case 'X':
+	case 'N':
+	case 'M':
+		function = opt;
+		filename = optarg;
+		break;
+	case 'j':
+		jsonfile = optarg;
+		break;
+	case 'E':
+		fakespec = optarg;
+		break;
+	case 'V':
+		if (sb_set_helper(di, optarg))
+			return 1;
+		break;
+	case 'C':
+		ret = sscanf(optarg, "%u", &cachemb);
+		if (ret < 1)
+		{
+			DBGE(di, "Invalid cache size\n");
+			return 1;
+		}
+		sb_set_cache(di, cachemb * 1024UL * 1024UL);
+		break;
+	case 'p':
+		ret = sscanf(optarg, "0x%8X", &patlen);
+		if (ret < 1)
+		{
+			DBGE(di, "Invalid parameter\n");
+			return 1;
+		}
+		patscan = 1;
+		break;
+	case 'H':
+		if (sb_set_hashes(di, optarg))
+		{
+			DBGE(di, "Invalid checksum list, use crc32c and/or sha256\n");
+			return 1;
+		}
 		break;
 	default:
 		return 1;
 	}
 
-	if (optind < argc)
+	sb_set_log(di, NULL, NULL, dl);
+	sb_set_options(di, opts);
+
+	if (resume && (journal == NULL))
+	{
+		DBGE(di, "-u needs the journal given with -J\n");
+		return 1;
+	}
+	sb_set_journal(di, journal, resume);
+
+	/* -p alone lists the PATs, with -b it sets the range to dump from */
+	if (patscan && (function == 0))
+		function = 'p';
+
+	if ((optind < argc) && (function != 'S') && (function != 'U') &&
+	    (function != 'T') && (function != 'A') && (function != 'X') &&
+	    (function != 'N') && (function != 'M') && (function != 'L'))
 		filename = argv[optind];
 
+	/* A JSON summary or the RAM monitor records on stdout have it to
+	 * themselves, messages go to stderr */
+	if ((jsonfile && !strcmp(jsonfile, "-")) ||
+	    ((function == 'm') && ((filename == NULL) || !strcmp(filename, "-"))))
+		log_set_file(stderr);
+
+	DBG(di, "Sunburn - Sunplus SPMP8000 firmware flashing tool " SB_VERSION
+		"\n\n");
+
 	if (((function == 'r') || (function == 'f') || (function == 'F') ||
 		(function == 'B') || (function == 'l')) && filename == NULL)
 	{
-		DBGE("No filename specified\n");
+		DBGE(di, "No filename specified\n");
+		return 1;
+	}
+
+	if ((function == 'R') && (optind == argc))
+	{
+		DBGE(di, "No files to upload specified\n");
+		return 1;
+	}
+
+	if ((function == 'L') && (optind == argc))
+	{
+		DBGE(di, "No bootfiles specified\n");
+		return 1;
+	}
+
+	/* Every device of the daemon would write the same journal */
+	if ((function == 'U') && journal)
+	{
+		DBGE(di, "-U can't be used with -J\n");
+		return 1;
+	}
+
+	if (planfile && journal)
+	{
+		DBGE(di, "-n can't be used with -J\n");
+		return 1;
+	}
+
+	/* Planned dumps read erased pages, nothing worth keeping */
+	if (planfile && (function == 'f'))
+		filename = "/dev/null";
+	else if (planfile && (function != 'F') && (function != 'B') &&
+		 (function != 'L') && (function != 'b') && (function != 'k') &&
+		 (function != 'p') && (function != 'X') && (function != 0))
+	{
+		DBGE(di, "-n plans -F, -B, -L, -X, -f, -b, -k and -p only\n");
 		return 1;
 	}
 
 	if (function == 0)
 	{
-		DBG(
+		DBG(di,
 		"Copyright (C) 2011, Zoltan Devai - zdevai@gmail.com - "
 		"http://sunnap.blogspot.com\n"
 		"Credits to Alemaxx and openschemes.com\n\n"
@@ -242,104 +396,267 @@ int main(int argc, char **argv)
 		" -b\t\tDump all bootfiles to BP<patpageno>.bin files\n"
 		" -B <address>\tWrite bootfile to flash with -a PAT address,"
 		" and <adress> data address\n"
+		" -L\t\tAdd the bootfiles given as filenames, choosing their\n"
+		"\t\tPAT and data pages so the fewest blocks get erased.\n"
+		"\t\t-p sets the range to place them in like with -b\n"
+		" -k <length>\tPrint checksums of FLASH from -a address and <length>\n"
+		" -K <length>\tPrint checksums of RAM from -a address and <length>\n"
 		" -l\t\tDump ROM bootloader to file\n"
-		" -D\t\tRun the DRAM init code in FLASH\n\n"
+		" -p <length>\tList PATs in FLASH from -a address and <length>,\n"
+		"\t\t0x0 for the whole device, or in a FLASH dump file\n"
+		"\t\tif one is given. With -b, dump the bootfiles of\n"
+		"\t\tthis range instead of the first 512 pages\n"
+		" -S <script>\tRun the operations listed in <script> (- for stdin)\n"
+		"\t\tin one session, stopping at the first error\n"
+		" -U <socket>\tRun as a daemon keeping all devices open and\n"
+		"\t\tserving requests on the <socket> Unix domain socket\n"
+		" -D\t\tRun the DRAM init code in FLASH\n"
+		" -o\t\tWrite dump files with O_DIRECT\n"
+		" -C <MB>\tCache up to <MB> megabytes of FLASH pages, so pages\n"
+		"\t\tread or written before aren't read again\n"
+		" -H <list>\tWrite crc32c and/or sha256 checksum files for dumps,\n"
+		"\t\tcomma separated\n"
+		" -T <file>\tRun the benchmarks and write the results to <file>,\n"
+		"\t\tas JSON if it ends in .json, CSV otherwise. Flash write\n"
+		"\t\tbenchmarks use the 8 blocks at -a as scratch area and\n"
+		"\t\tonly run if -a is given or the device is a fake one\n"
+		" -E <spec>\tUse a fake device backed by a flash image file,\n"
+		"\t\t<file>[,ppb=n][,ps=n][,tb=n][,lat=us][,mbps=n]\n"
+		"\t\t[,prog=us][,erase=us]\n"
+		" -V <helper>\tVerify flash writes by running the <helper>\n"
+		"\t\tchecksum program in DRAM instead of reading back\n"
+		"\t\tthe pages, needs -D on devices without inited DRAM.\n"
+		"\t\tHelpers with staging buffers also erase and program\n"
+		"\t\tthe blocks on the device\n"
+		" -R <entry>\tBoot from RAM: upload the <addr>:<file> arguments\n"
+		"\t\tto memory and jump to <entry>, needs -D on devices\n"
+		"\t\twithout inited DRAM\n"
+		" -v\t\tVerify files uploaded with -R by their checksum\n"
+		" -m <ranges>\tMonitor RAM: read the comma separated 0xaddr:0xlen\n"
+		"\t\tranges over and over until interrupted and write\n"
+		"\t\tthe words that changed, with timestamps, to the\n"
+		"\t\tfile given or stdout, messages then go to stderr\n"
+		" -A <store>\tBack up the whole FLASH into the <store> directory,\n"
+		"\t\tkeeping each distinct block once. With -V, blocks\n"
+		"\t\tunchanged since the last backup aren't read\n"
+		" -X <store>\tRestore the last backup of the device from <store>,\n"
+		"\t\tor the backup index given as filename, skipping\n"
+		"\t\tblocks that hold the right content already\n"
+		" -N <socket>\tExport the FLASH as an NBD block device on the\n"
+		"\t\t<socket> Unix domain socket until interrupted. Pages\n"
+		"\t\tare read on demand, writes are written back in whole\n"
+		"\t\tblocks on flush\n"
+#ifdef SB_FUSE
+		" -M <dir>\tMount the bootfiles and the whole FLASH as read-only\n"
+		"\t\tfiles on <dir> until unmounted. -p sets the range\n"
+		"\t\tto look for PATs in like with -b\n"
+#endif
+		" -J <file>\tKeep a journal of FLASH writes in <file>, so an\n"
+		"\t\tinterrupted write can be resumed. It's deleted once\n"
+		"\t\tthe operation completes\n"
+		" -u\t\tResume the writes of the -J journal, from the first\n"
+		"\t\tblock that wasn't verified. Give the same operation\n"
+		"\t\tand input as for the interrupted run\n"
+		" -n <profile>\tPlan the operation without changing the FLASH:\n"
+		"\t\terases and programs go to a scratch copy, which\n"
+		"\t\treads the pages it didn't change from the device\n"
+		"\t\t(erased ones for -f). Count the page reads,\n"
+		"\t\tprograms, erases and USB transfers and estimate its\n"
+		"\t\ttime with the latency model in <profile>.\n"
+		"\t\tIf there's no such file, the device is probed with\n"
+		"\t\treads and the model saved to it\n"
+		" -j <file>\tWrite a JSON summary with per-phase durations and\n"
+		"\t\tbyte counts to <file>, - for stdout sends the\n"
+		"\t\tmessages to stderr\n\n"
+		"Dump filenames ending in .zst or .xz get compressed on the fly\n"
+		"-F and -B read from stdin if the filename is -, and decompress\n"
+		"zstd or xz compressed files\n\n"
 		);
+		script_usage();
+		sb_destroy(di);
 		return 1;
 	}
 	
-	ret = usb_spmp8000_init(&di.ud);
-	if (ret)
-		return 1;
+	/* The daemon opens all the devices itself */
+	if (function == 'U')
+	{
+		ret = daemon_run(filename, di);
+		sb_destroy(di);
+		return ret ? 1 : 0;
+	}
 
-	DBG("- SPMP8000 device found\n");
+	/* Dump files are scanned without a device */
+	if ((function == 'p') && filename)
+	{
+		DBG(di, "- Scanning %s for PATs\n", filename);
+		ret = file_pats_scan(di, filename, addr, patlen);
+		sb_destroy(di);
+		return ret ? 1 : 0;
+	}
 
-	/* Need to do this before the others as it may init the DRAM itself */
-	if (function == 'i')
+	if (fakespec)
 	{
-		ret = print_device_infos(&di);
+		ret = sb_open_fake(di, fakespec);
 		if (ret)
-			goto out;
-		goto end;
+			goto fail;
+		DBG(di, "- Using fake device\n");
+	}
+	else
+	{
+		ret = sb_open_usb(di, 0);
+		if (ret)
+			goto fail;
+		DBG(di, "- SPMP8000 device found\n");
 	}
 
-	if (initdram)
+	/* Need to do this before the others as it may init the DRAM itself */
+	if (function == 'i')
 	{
-		ret = cmd_init_dram(&di);
-		DBGE("Can't init DRAM\n");
+		ret = print_device_infos(di);
 		if (ret)
 			goto out;
-		DBG("- DRAM Init called\n");
+		goto end;
 	}
 
-	if (flashconfig)
+	ret = sb_setup(di);
+	if (ret)
+		goto out;
+
+	if (planfile)
 	{
-		ret = cmd_write_flash_config(&di, (nandconf_t *)&fc_29F32G08);
+		ret = plan_start(di, planfile, function == 'f');
 		if (ret)
-		{
-			DBGE("Can't send flash configuration\n");
 			goto out;
-		}
-		DBG("- FLASH config sent\n");
+		DBG(di, "- Planning only, the FLASH is left as it is\n");
 	}
 
-	ret = cmd_get_flash_info(&di, &nc);
-	if (ret)
+	/* Progress of a monitor that runs until interrupted tells nothing */
+	if ((function != 'T') && (function != 'm'))
+		di->prog = progress_create(di, function_name(function));
+
+	if (patscan)
 	{
-		DBGE("Can't read flash config\n");
-		goto out;
+		patfirst = addr / di->ps;
+		patpages = patlen ? (patlen - 1) / di->ps + 1 : 0;
 	}
 
 	switch (function)
 	{
 		case 'l':
-			DBG("- Dumping the romboot code to %s\n", filename);
-			ret = file_ram_dump(&di, ROMBOOT_LOCATION,
+			DBG(di, "- Dumping the romboot code to %s\n", filename);
+			ret = file_ram_dump(di, ROMBOOT_LOCATION,
 					    ROMBOOT_LENGTH, filename);
 			break;
 		case 'b':
-			DBG("- Dumping the bootfiles to BF<pat>.bin files\n");
-			ret = file_bootfiles_dump(&di);
+			DBG(di, "- Dumping the bootfiles to BF<pat>.bin files\n");
+			ret = file_bootfiles_dump(di, patfirst, patpages);
 			break;
 		case 'r':
-			DBG("- Dumping RAM from %08X, length %08X to %s\n",
+			DBG(di, "- Dumping RAM from %08X, length %08X to %s\n",
 			    addr, functarg, filename);
-			ret = file_ram_dump(&di, addr, functarg, filename);
+			ret = file_ram_dump(di, addr, functarg, filename);
 			break;
 		case 'f':
-			DBG("- Dumping FLASH from %08X, length %08X to %s\n",
+			DBG(di, "- Dumping FLASH from %08X, length %08X to %s\n",
 			    addr, functarg, filename);
-			ret = file_flash_dump(&di, addr, functarg, filename);
+			ret = file_flash_dump(di, addr, functarg, filename);
+			break;
+		case 'k':
+			DBG(di, "- Checksumming FLASH from %08X, length %08X\n",
+			    addr, functarg);
+			ret = file_flash_checksum(di, addr, functarg);
+			break;
+		case 'K':
+			DBG(di, "- Checksumming RAM from %08X, length %08X\n",
+			    addr, functarg);
+			ret = file_ram_checksum(di, addr, functarg);
 			break;
 		case 'F':
-			DBG("- Writing %s to flash addr %08X\n", filename,
+			DBG(di, "- Writing %s to flash addr %08X\n", filename,
 			    addr);
-			ret = file_flash_write(&di, addr, filename);
+			ret = file_flash_write(di, addr, filename);
+			break;
+		case 'p':
+			DBG(di, "- Scanning FLASH pages from %08X for PATs\n",
+			    patfirst);
+			ret = image_show_pats_usb(di, patfirst, patpages);
+			break;
+		case 'T':
+			DBG(di, "- Running benchmarks, results to %s\n", filename);
+			ret = bench_run(di, filename, addr,
+					addrset || (di->fake != NULL));
+			break;
+		case 'R':
+			DBG(di, "- Booting from RAM\n");
+			ret = boot_run(di, argv + optind, argc - optind,
+				       functarg, verify);
+			break;
+		case 'A':
+			ret = store_backup(di, filename);
+			break;
+		case 'X':
+			DBG(di, "- Restoring from %s\n", filename);
+			ret = store_restore(di, filename, (optind < argc) ?
+					    argv[optind] : NULL);
+			break;
+		case 'N':
+			ret = nbd_run(di, filename);
+			break;
+		case 'm':
+			ret = mon_run(di, monranges, filename);
+			break;
+#ifdef SB_FUSE
+		case 'M':
+			ret = fs_run(di, filename, patfirst, patpages);
+			break;
+#endif
+		case 'S':
+			DBG(di, "- Running script %s\n", filename);
+			ret = script_run(di, filename);
 			break;
 		case 'B':
-			DBG("- Writing bootfile %s to %08X PAT addr and %08X"
+			DBG(di, "- Writing bootfile %s to %08X PAT addr and %08X"
 			    "PAT addr\n", filename, functarg, addr);
-			ret = file_bootfile_write(&di, 0x1984BABE,
-						  addr / di.ps,
-						  functarg / di.ps, filename);
+			ret = file_bootfile_write(di, BOOTFILE_DEFAULT_ID,
+						  addr / di->ps,
+						  functarg / di->ps, filename);
+			break;
+		case 'L':
+			DBG(di, "- Laying out %d bootfile(s) from page %08X\n",
+			    argc - optind, patfirst);
+			ret = layout_write_bootfiles(di, patfirst, patpages,
+						     argv + optind,
+						     argc - optind);
 			break;
 		default:
-			DBG("Should not happen\n");
+			DBG(di, "Should not happen\n");
 			goto out;
 			break;
 	}
 
+	progress_finish(di->prog);
+	if (jsonfile && di->prog && progress_write_json(di->prog, jsonfile, ret))
+		ret = -1;
+
 	if (ret)
-		DBGE("Operation failed\n");
-	else
-		DBG("Done\n");
+	{
+		DBGE(di, "Operation failed\n");
+		goto out;
+	}
+
+	sb_finish_journal(di);
+	plan_report(di);
+	DBG(di, "Done\n");
 
 end:
-	usb_close(di.ud);
+	progress_free(di->prog);
+	sb_destroy(di);
 	return 0;
 
 out:
-	usb_close(di.ud);
+	progress_free(di->prog);
+fail:
+	sb_destroy(di);
 	return 1;
 
 }
\ No newline at end of file
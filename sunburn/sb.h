@@ -18,19 +18,45 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
  * MA  02110-1301, USA.
  */
-extern int dl;	/**< Debug level */
-void hexdump(unsigned char *data, int length, int base);
+#include "libsunburn.h"
 
 #define SB_VERSION	"v1.0"
 
-#define DBG(format, ...) do { printf(format,  ## __VA_ARGS__); } \
-			 while (0)
-#define DBGE(format, ...) do { printf("- Error: " format,  ## __VA_ARGS__); } \
-			 while (0)
-#define DBG1(format, ...) do { if (dl > 0) printf("-1-:" format, \
-				## __VA_ARGS__); }  while (0)
-#define DBG2(format, ...) do { if (dl > 1) printf("-2-:" format, \
-				## __VA_ARGS__); }  while (0)
+#define SB_ERRLEN	128
+
+/* Messages go to the log sink of the context, or without one to stdout.
+ * Debug messages are buffered per thread and printed by a background
+ * thread there, see sb_log.c. di may be NULL outside of any context. */
+#define SB_DL(di)	((di) ? (di)->dl : 0)
+#define DBG(di, format, ...) log_msg(di, SB_LOG_INFO, format, \
+				     ## __VA_ARGS__)
+#define DBGE(di, format, ...) log_msg(di, SB_LOG_ERROR, format, \
+				      ## __VA_ARGS__)
+#define DBG1(di, format, ...) do { if (SB_DL(di) > 0) log_printf(di, 1, \
+				format, ## __VA_ARGS__); }  while (0)
+#define DBG2(di, format, ...) do { if (SB_DL(di) > 1) log_printf(di, 2, \
+				format, ## __VA_ARGS__); }  while (0)
+
+/* Commands of the romboot USB protocol, also decoded by sb_fake.c */
+#define CMD_USB_SCSI_C2(x)	((x << 8) | 0xC2)
+
+#define CMD_USB_BYPASSBR	CMD_USB_SCSI_C2(0x00)
+#define CMD_USB_RAMWRITE	CMD_USB_SCSI_C2(0x01)
+#define CMD_USB_RAMREAD		CMD_USB_SCSI_C2(0x02)
+
+#define CMD_USB_EXECUTE		CMD_USB_SCSI_C2(0x05)
+#define CMD_USB_BRVERINFO	CMD_USB_SCSI_C2(0x06)
+#define CMD_USB_DRAMINIT	CMD_USB_SCSI_C2(0x07)
+
+#define CMD_USB_FLASHCONFREAD	CMD_USB_SCSI_C2(0x10)
+#define CMD_USB_FLASHBLKERASE	CMD_USB_SCSI_C2(0x11)
+#define CMD_USB_FLASHWRITE	CMD_USB_SCSI_C2(0x12)
+#define CMD_USB_FLASHREAD	CMD_USB_SCSI_C2(0x13)
+
+#define CMD_USB_FLASHCONFSEND	CMD_USB_SCSI_C2(0x20)
+
+#define CMD_USB_FLASHWRITEALT	CMD_USB_SCSI_C2(0x30)
+#define CMD_USB_FLASHREADALT	CMD_USB_SCSI_C2(0x31)
 
 #define SCSI_FLAG_READ		0x80
 #define SCSI_FLAG_WRITE		0x0
@@ -43,6 +69,8 @@ void hexdump(unsigned char *data, int length, int base);
 #define ROMBOOT_LOCATION	0x98000000
 #define ROMBOOT_LENGTH		64*1024
 
+#define BOOTFILE_DEFAULT_ID	0x1984BABE
+
 typedef struct
 {
 	uint32_t patpage;
@@ -52,7 +80,57 @@ typedef struct
 	uint32_t lastpage;
 } bootfile_info_t;
 
+enum progphase {
+	PROG_READ = 0,		/* Flash reads, or the current read phase */
+	PROG_READBACK,
+	PROG_ERASE,
+	PROG_PROGRAM,
+	PROG_VERIFY,
+	PROG_RAMREAD,
+	PROG_RAMWRITE,
+	PROG_NPHASES
+};
+
+/** Progress and phase timing of an operation, see sb_progress.c */
+typedef struct progress progress_t;
+
+/** LRU cache of flash pages, see sb_cache.c */
+typedef struct pcache pcache_t;
+
+/** Scheduling state of a device sharing a USB bus, see sb_sched.c */
+typedef struct schedev schedev_t;
+
+/** Host side journal of flash writes, see sb_journal.c */
+typedef struct journal journal_t;
+
+/** Progress of a block in the write journal */
+enum
+{
+	JOURNAL_ERASED = 1,
+	JOURNAL_PROGRAMMED,
+	JOURNAL_VERIFIED
+};
+
+/** File backed fake device, see sb_fake.c */
+typedef struct fake fake_t;
+
+/** Flash operations done by a fake device */
 typedef struct
+{
+	unsigned long nread;	/**< Pages read over USB */
+	unsigned long nwrite;	/**< Pages programmed */
+	unsigned long nerase;	/**< Blocks erased */
+	unsigned long nhelper;	/**< Helper runs */
+	unsigned long ndevread;	/**< Pages read by the helper or stub */
+} fakestats_t;
+
+/** Reads a flash page of the device a fake device stands in for */
+typedef int (*fake_srcfn_t)(void *arg, uint32_t page, char *buf);
+
+/** Dry run of an operation, see sb_plan.c */
+typedef struct plan plan_t;
+
+struct devinfo
 {
 	unsigned int ppb;	/**< Pages per block */
 	unsigned int rps;	/**< Real page size (with OOB) */
@@ -60,7 +138,80 @@ typedef struct
 	unsigned int bs;	/**< Block size (bytes) */
 	unsigned int tb;	/**< Total num of blocks */
 	usb_dev_handle *ud;	/**< USB device handle */
-} devinfo_t;
+	progress_t *prog;	/**< Progress tracker, NULL if none */
+	fake_t *fake;		/**< Fake device used instead of USB, or NULL */
+	int dl;			/**< Debug level */
+	int initdram;		/**< Run the DRAM init code in setup */
+	int flashconfig;	/**< Send the built-in flash config in setup */
+	int odirect;		/**< Write dump files with O_DIRECT */
+	int hashtypes;		/**< Checksums to write next to dump files */
+	sb_logfn_t logfn;	/**< Log sink, NULL for stdout */
+	void *logarg;		/**< Argument of the log sink */
+	char err[SB_ERRLEN];	/**< Last error message */
+	char *helper;		/**< Checksum helper image, NULL if none */
+	int helperlen;		/**< Length of the helper image */
+	int helperup;		/**< Helper uploaded to the device */
+	unsigned long cachesize;/**< Page cache size in bytes, 0 for none */
+	pcache_t *cache;	/**< Page cache, created by setup */
+	schedev_t *sched;	/**< Bus scheduling, NULL if not shared */
+	char *journalpath;	/**< Write journal file, NULL for none */
+	int resume;		/**< Resume the writes in the journal */
+	journal_t *journal;	/**< Write journal, opened by setup */
+	plan_t *plan;		/**< Dry run, NULL when the device is used */
+};
+
+/*
+ * Checksum helper, a small program uploaded to device RAM that checksums
+ * flash pages on the device, see sb_helper.c
+ * The image is linked to run at HELPER_LOAD_ADDR and starts with a
+ * helper_hdr_t. For every run the host writes a helper_param_t to the
+ * address in the header, EXECUTEs the entry point and, once the helper
+ * returned to the romboot code, reads back the parameters for the status
+ * and the table of CRC32C values. All words are little endian.
+ * Helpers with staging buffers also work as flasher stub: the host streams
+ * whole blocks into one of the two buffers and runs a HELPER_CMD_PROGRAM
+ * command for it. The helper accepts it by copying the parameters, with
+ * status HELPER_STATUS_BUSY, to the job block of that buffer and returns
+ * right away. It erases, programs and verifies the blocks in the background
+ * and sets the status of the job block once it's done. The host meanwhile
+ * fills the other buffer.
+ */
+#define HELPER_LOAD_ADDR	0x00E00000	/* In DRAM, needs DRAM init */
+#define HELPER_MAGIC		0x4B434253	/* "SBCK" */
+#define HELPER_PARAM_MAGIC	0x50434253	/* "SBCP" */
+#define HELPER_VERSION		1
+#define HELPER_CMD_CRC32C	1		/* CRC32C of groups of pages */
+#define HELPER_CMD_PROGRAM	2		/* Erase, program, verify */
+#define HELPER_STATUS_DONE	0x454E4F44	/* "DONE" */
+#define HELPER_STATUS_ERROR	0x20525245	/* "ERR " */
+#define HELPER_STATUS_BUSY	0x59535542	/* "BUSY" */
+#define HELPER_NSTAGES		2
+
+typedef struct
+{
+	uint32_t magic;		/**< HELPER_MAGIC */
+	uint32_t version;	/**< HELPER_VERSION */
+	uint32_t entry;		/**< Entry point, offset from the load address */
+	uint32_t param;		/**< Address of the parameter block */
+	uint32_t table;		/**< Address of the result table */
+	uint32_t tablemax;	/**< Max number of entries in the table */
+	uint32_t jobs;		/**< Parameter blocks of the staging buffers */
+	uint32_t stage;		/**< Staging buffers, back to back */
+	uint32_t stagelen;	/**< Size of a staging buffer, 0 if none */
+} helper_hdr_t;
+
+typedef struct
+{
+	uint32_t magic;		/**< HELPER_PARAM_MAGIC */
+	uint32_t cmd;		/**< HELPER_CMD_ */
+	uint32_t firstpage;	/**< First flash page to checksum */
+	uint32_t npages;	/**< Number of pages to checksum */
+	uint32_t pagesper;	/**< Pages per table entry, 1 or pages per block */
+	uint32_t pagesize;	/**< Bytes of data per page */
+	uint32_t status;	/**< Set by the helper, HELPER_STATUS_ */
+	uint32_t count;		/**< Table entries filled, pages programmed */
+	uint32_t buf;		/**< Staging buffer with the data to program */
+} helper_param_t;
 
 /**
  * Nand config info layout
@@ -87,6 +238,96 @@ typedef struct
 	uint8_t flashid2[16];
 } __attribute__((packed)) nandconf_t;
 
+typedef struct qbuf
+{
+	char *data;	/**< Buffer memory */
+	int len;	/**< Length of valid data in the buffer */
+	struct qbuf *link;	/**< Buffer of another queue passed along */
+} qbuf_t;
+
+/** Bounded buffer queue between two threads, see sb_queue.c */
+typedef struct queue queue_t;
+
+enum comptype {
+	COMP_NONE = 0,
+	COMP_ZSTD,
+	COMP_XZ
+};
+
+#define COMP_MAGIC_LEN	6
+
+/** Streaming compressor writing to a file, see sb_comp.c */
+typedef struct comp comp_t;
+
+/** Streaming decompressor reading from a file, see sb_comp.c */
+typedef struct decomp decomp_t;
+
+#define HASH_CRC32C	0x1
+#define HASH_SHA256	0x2
+
+typedef struct
+{
+	int types;		/**< HASH_ types being calculated */
+	uint32_t crc32c;	/**< CRC32C so far */
+	uint32_t sha256[8];	/**< SHA-256 state */
+	unsigned char buf[64];	/**< Partial SHA-256 block */
+	int buflen;		/**< Length of data in buf */
+	uint64_t len;		/**< Length of data hashed so far */
+} hash_t;
+
+/*
+ * Daemon protocol, see sb_daemon.c
+ * Each request is a daemon_req_t, optionally carrying a file descriptor
+ * as SCM_RIGHTS ancillary data. Request data (len bytes for the write ops)
+ * follows the request on the socket, or is taken from the passed fd. The
+ * reply is a daemon_rsp_t followed by len bytes of data, or the data is
+ * put into the passed fd. Regular files and memfds are mmapped by the
+ * daemon and accessed in place, without copies through the socket.
+ * All fields are in host byte order.
+ */
+#define DAEMON_MAGIC		0x53424431UL	/* "SBD1" */
+#define DAEMON_MAX_INLINE	(16 * 1024 * 1024)
+
+enum daemon_op {
+	DAEMON_OP_INFO = 0,	/**< -> daemon_info_t */
+	DAEMON_OP_RAMREAD,	/**< addr, len -> data */
+	DAEMON_OP_RAMWRITE,	/**< addr, len, data -> */
+	DAEMON_OP_FLASHREAD,	/**< addr = flash offset, len -> data */
+	DAEMON_OP_FLASHWRITE,	/**< addr = flash offset, len, data -> */
+	DAEMON_OP_ERASE,	/**< addr = first page, arg = nr of blocks -> */
+	DAEMON_OP_BOOTFILEINFO,	/**< addr = PAT page -> bootfile_info_t */
+	DAEMON_OP_BOOTFILEREAD,	/**< addr = PAT page -> data, page rounded */
+	DAEMON_OP_BOOTFILEWRITE,/**< addr = PAT page, arg = data page, len,
+				     data -> */
+	DAEMON_OP_LAST
+};
+
+typedef struct
+{
+	uint32_t magic;		/**< DAEMON_MAGIC */
+	uint16_t op;		/**< One of enum daemon_op */
+	uint16_t dev;		/**< Index of the device */
+	uint32_t addr;		/**< Address, offset or page number */
+	uint32_t len;		/**< Length of data */
+	uint32_t arg;		/**< Op specific argument */
+} __attribute__((packed)) daemon_req_t;
+
+typedef struct
+{
+	uint32_t magic;		/**< DAEMON_MAGIC */
+	int32_t status;		/**< 0 if OK, <0 on error */
+	uint32_t len;		/**< Length of reply data */
+} __attribute__((packed)) daemon_rsp_t;
+
+typedef struct
+{
+	uint32_t ndevs;		/**< Number of devices served */
+	uint32_t ppb;		/**< Pages per block */
+	uint32_t ps;		/**< Page size */
+	uint32_t bs;		/**< Block size */
+	uint32_t tb;		/**< Total num of blocks */
+} __attribute__((packed)) daemon_info_t;
+
 typedef struct
 {
 	int fb;		/**< First block */
@@ -110,6 +351,7 @@ inline int cmd_write_flash_page(devinfo_t *di, uint32_t pageno, char *data);
 int cmd_write_flash_pages(devinfo_t *di, uint32_t fp, int num, char *data);
 inline int cmd_erase_block(devinfo_t *di, uint32_t pageno);
 int cmd_erase_blocks(devinfo_t *di, uint32_t firstpage, int numblocks);
+inline int cmd_execute(devinfo_t *di, uint32_t addr);
 inline int cmd_read_devid(devinfo_t *di, char *devid);
 
 /* from fu_image.c */
@@ -121,21 +363,179 @@ int image_get_bootfile_info(int patpage, uint32_t *patbuf, uint32_t pagesize,
 int image_get_bootfile_info_usb(devinfo_t *di, uint32_t patpagenum,
 				bootfile_info_t *binf);
 int image_get_bootfile_usb(devinfo_t *di, uint32_t patpagenum, char* data);
+int image_get_bootfile_pages(devinfo_t *di, uint32_t patpagenum,
+			     uint32_t **pages);
+int image_read_usb(devinfo_t *di, int offset, char *data, int len);
+int image_write_blocks_usb(devinfo_t *di, uint32_t firstpage, int nblocks,
+			   char *data, char *veribuf);
 int image_write_random_usb(devinfo_t *di, int offset, char* data, int len);
+int image_bootfile_maxlen(devinfo_t *di);
+void image_fill_pat(devinfo_t *di, int datapage, char *patbuf,
+		    uint32_t size, uint32_t id);
+int image_write_pat_usb(devinfo_t *di, uint32_t id, int patpage,
+			int datapage, int len);
 int image_write_bootfile_usb(devinfo_t *di, uint32_t id, int patpage,
 			     int datapage, char* data, int len);
-int image_show_pats_usb(devinfo_t *di);
+int image_find_magic(char *buf, int npages, int stride, int *hits);
+int image_check_pat(uint32_t *pat, int ps, uint32_t maxpage);
+int image_scan_pats_usb(devinfo_t *di, int firstpage, int npages,
+			bootfile_info_t **binfs);
+int image_show_pats_usb(devinfo_t *di, int firstpage, int npages);
 
 /* from fu_usb.c */
-int usb_spmp8000_init(usb_dev_handle **udevh);
+int usb_spmp8000_open(devinfo_t *di, int index);
+int usb_bulk_txn(devinfo_t *di, uint32_t cmd, uint32_t addr,
+		 uint32_t len, char *data, uint8_t flag);
 int usb_txn(devinfo_t *di, uint32_t cmd, uint32_t addr, uint32_t len,
 	    char *data, uint8_t flag);
 
 /* from fu_file.c */
+int file_open_mmap(devinfo_t *di, char* fname, int *fd, int *length,
+		   char** data);
 inline int file_ram_dump(devinfo_t *di, int addr, int len, char* fname);
 inline int file_flash_dump(devinfo_t *di, int addr, int len, char* fname);
 int file_bootfile_read(devinfo_t *di, bootfile_info_t *bi, char* fname);
 int file_flash_write(devinfo_t *di, int addr, char* fname);
-int file_bootfiles_dump(devinfo_t *di);
+int file_bootfiles_dump(devinfo_t *di, int firstpage, int npages);
+int file_pats_scan(devinfo_t *di, char *fname, uint64_t offset,
+		   uint64_t len);
 int file_bootfile_write(devinfo_t *di, uint32_t id, int patpage, int datapage,
 			char* fname);
+int file_ram_checksum(devinfo_t *di, int addr, int len);
+int file_flash_checksum(devinfo_t *di, int addr, int len);
+int file_ram_write(devinfo_t *di, int addr, char *fname, int verify);
+
+/* from sb_script.c */
+void script_usage(void);
+int script_run(devinfo_t *di, char *fname);
+
+/* from sb_boot.c */
+int boot_run(devinfo_t *di, char **specs, int nspecs, uint32_t entry,
+	     int verify);
+
+/* from sb_nbd.c */
+int nbd_run(devinfo_t *di, char *sockpath);
+
+/* from sb_monitor.c */
+int mon_run(devinfo_t *di, char *ranges, char *fname);
+
+/* from sb_fuse.c, built with FUSE=1 */
+int fs_run(devinfo_t *di, char *mountpoint, int firstpage, int npages);
+
+/* from sb_layout.c */
+int layout_write_bootfiles(devinfo_t *di, int firstpage, int npages,
+			   char **fnames, int nfiles);
+
+/* from sb_plan.c */
+int plan_start(devinfo_t *di, char *profile, int blank);
+void plan_txn(plan_t *p, uint32_t cmd, uint32_t addr, uint32_t len,
+	      int hasdata);
+void plan_report(devinfo_t *di);
+void plan_end(devinfo_t *di);
+
+/* from sb_daemon.c */
+int daemon_run(char *sockpath, devinfo_t *opts);
+
+/* from sb_journal.c */
+journal_t *journal_open(devinfo_t *di, char *path, int resume);
+void journal_close(journal_t *j, int done);
+int journal_resume(journal_t *j, uint32_t offset, uint32_t len, uint32_t crc,
+		   char **edge, int nb, int *first);
+int journal_begin(journal_t *j, uint32_t offset, uint32_t len, uint32_t crc,
+		  char **edge);
+int journal_block(journal_t *j, int blk, int state);
+int journal_end(journal_t *j);
+
+/* from sb_sched.c */
+int sched_attach(devinfo_t *di);
+void sched_detach(devinfo_t *di);
+void sched_add_work(devinfo_t *di, int64_t bytes);
+uint64_t sched_bytes(devinfo_t *di);
+void sched_begin(devinfo_t *di);
+void sched_end(devinfo_t *di, uint32_t bytes);
+
+/* from sb_queue.c */
+queue_t *queue_create(int nbufs, int bufsize);
+void queue_destroy(queue_t *q);
+qbuf_t *queue_get_free(queue_t *q);
+void queue_put_full(queue_t *q, qbuf_t *b);
+qbuf_t *queue_get_full(queue_t *q);
+void queue_put_free(queue_t *q, qbuf_t *b);
+void queue_close(queue_t *q);
+void queue_abort(queue_t *q);
+
+/* from sb_comp.c */
+enum comptype comp_type_from_name(char *fname);
+comp_t *comp_open(devinfo_t *di, int fd, enum comptype type);
+int comp_write(comp_t *c, char *data, int len);
+int comp_close(comp_t *c, int flush);
+enum comptype comp_type_from_magic(unsigned char *buf, int len);
+decomp_t *decomp_open(devinfo_t *di, int fd, enum comptype type,
+		       char *pre, int prelen);
+int decomp_read(decomp_t *d, char *buf, int len);
+void decomp_close(decomp_t *d);
+
+/* from sb_hash.c */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len);
+void hash_init(hash_t *hs, int types);
+void hash_update(hash_t *hs, const void *data, size_t len);
+void hash_final(hash_t *hs);
+void hash_hex(hash_t *hs, int type, char *str);
+char *hash_name(int type);
+int hash_parse_types(char *str);
+
+/* from sb_progress.c */
+progress_t *progress_create(devinfo_t *di, char *opname);
+void progress_free(progress_t *p);
+void progress_expect(progress_t *p, uint64_t bytes);
+void progress_read_phase(progress_t *p, int phase);
+void progress_add(progress_t *p, int phase, int bytes);
+void progress_finish(progress_t *p);
+int progress_write_json(progress_t *p, char *fname, int status);
+
+/* from sb_log.c */
+void log_set_file(FILE *f);
+double log_now(void);
+void log_msg(devinfo_t *di, int level, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+void log_printf(devinfo_t *di, int level, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+void log_txn(devinfo_t *di, int level, uint32_t cmd, uint32_t addr,
+	     uint32_t len, uint8_t flag, int hasdata);
+void log_sync(void);
+void hexdump(unsigned char *data, int length, int base);
+
+/* from sb_helper.c */
+int helper_load(devinfo_t *di, char *fname);
+int helper_copy(devinfo_t *di, devinfo_t *from);
+void helper_free(devinfo_t *di);
+int helper_crc_pages(devinfo_t *di, uint32_t firstpage, int npages,
+		     int pagesper, uint32_t *crcs);
+int helper_verify_pages(devinfo_t *di, uint32_t firstpage, int npages,
+			char *data);
+int helper_can_program(devinfo_t *di);
+int helper_program_blocks(devinfo_t *di, uint32_t firstpage, int nblocks,
+			  char *data);
+
+/* from sb_cache.c */
+pcache_t *cache_create(devinfo_t *di, unsigned long bytes, int ps);
+void cache_serve(devinfo_t *di);
+void cache_destroy(pcache_t *c);
+int cache_get(pcache_t *c, uint32_t page, char *data);
+void cache_put(pcache_t *c, uint32_t page, char *data);
+void cache_invalidate(pcache_t *c, uint32_t page, int num);
+
+/* from sb_store.c */
+int store_backup(devinfo_t *di, char *store);
+int store_restore(devinfo_t *di, char *store, char *fname);
+
+/* from sb_fake.c */
+int fake_open(devinfo_t *di, char *spec);
+void fake_close(fake_t *f);
+void fake_stats(fake_t *f, fakestats_t *st);
+int fake_txn(fake_t *f, uint32_t cmd, uint32_t addr, uint32_t len,
+	     char *data, uint8_t flag);
+int fake_set_source(fake_t *f, fake_srcfn_t fn, void *arg);
+
+/* from sb_bench.c */
+int bench_run(devinfo_t *di, char *fname, uint32_t scratch, int canwrite);
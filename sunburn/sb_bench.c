@@ -0,0 +1,398 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define BENCH_REPS		5
+#define BENCH_TXNS		64	/* transactions per latency benchmark */
+#define BENCH_RAMREADS		16	/* reads per RAM transfer benchmark */
+#define BENCH_SCRATCH_BLOCKS	8	/* flash blocks the benchmarks write */
+#define BENCH_DUMP_BLOCKS	4
+
+typedef struct
+{
+	uint32_t scratch;	/**< First page of the scratch flash area */
+	char *buf;		/**< Scratch buffer, 2 blocks long */
+	char devid[DEVICE_ID_LENGTH];
+} benchctx_t;
+
+typedef struct
+{
+	char *name;		/**< Name in the results */
+	int write;		/**< Writes the scratch flash area */
+	int arg;		/**< Parameter of the run function */
+	/** Untimed preparation before each repetition, may be NULL */
+	int (*prep)(devinfo_t *di, benchctx_t *bc, int arg);
+	/** One repetition, returns the bytes and operations done */
+	int (*run)(devinfo_t *di, benchctx_t *bc, int arg, uint64_t *bytes,
+		   int *ops);
+} bench_t;
+
+typedef struct
+{
+	const bench_t *b;
+	uint64_t bytes;		/**< Bytes per repetition */
+	int ops;		/**< Operations per repetition */
+	double secs[BENCH_REPS];	/**< Sorted durations */
+	double mean;
+} benchres_t;
+
+static int bench_txn_flashconf(devinfo_t *di, benchctx_t *bc, int arg,
+			       uint64_t *bytes, int *ops)
+{
+	nandconf_t nc;
+	int i;
+
+	for (i = 0; i < BENCH_TXNS; i++)
+		if (cmd_read_flash_config(di, &nc))
+			return -1;
+
+	*bytes = BENCH_TXNS * sizeof(nandconf_t);
+	*ops = BENCH_TXNS;
+	return 0;
+}
+
+static int bench_txn_ramread(devinfo_t *di, benchctx_t *bc, int arg,
+			     uint64_t *bytes, int *ops)
+{
+	int i;
+
+	for (i = 0; i < BENCH_TXNS; i++)
+		if (cmd_read_mem(di, DEVICE_ID_LOCATION, DEVICE_ID_LENGTH,
+				 bc->devid))
+			return -1;
+
+	*bytes = BENCH_TXNS * DEVICE_ID_LENGTH;
+	*ops = BENCH_TXNS;
+	return 0;
+}
+
+/* Writes back the device ID read before, so RAM content doesn't change */
+static int bench_txn_ramwrite(devinfo_t *di, benchctx_t *bc, int arg,
+			      uint64_t *bytes, int *ops)
+{
+	int i;
+
+	for (i = 0; i < BENCH_TXNS; i++)
+		if (cmd_write_mem(di, DEVICE_ID_LOCATION, DEVICE_ID_LENGTH,
+				  bc->devid))
+			return -1;
+
+	*bytes = BENCH_TXNS * DEVICE_ID_LENGTH;
+	*ops = BENCH_TXNS;
+	return 0;
+}
+
+static int bench_txn_flashread(devinfo_t *di, benchctx_t *bc, int arg,
+			       uint64_t *bytes, int *ops)
+{
+	int i;
+
+	for (i = 0; i < BENCH_TXNS; i++)
+		if (cmd_read_flash_page(di, bc->scratch, bc->buf))
+			return -1;
+
+	*bytes = (uint64_t)BENCH_TXNS * di->ps;
+	*ops = BENCH_TXNS;
+	return 0;
+}
+
+static int bench_txn_erase(devinfo_t *di, benchctx_t *bc, int arg,
+			   uint64_t *bytes, int *ops)
+{
+	if (cmd_erase_blocks(di, bc->scratch, BENCH_SCRATCH_BLOCKS))
+		return -1;
+
+	*bytes = 0;
+	*ops = BENCH_SCRATCH_BLOCKS;
+	return 0;
+}
+
+static int bench_prep_erase(devinfo_t *di, benchctx_t *bc, int arg)
+{
+	return cmd_erase_block(di, bc->scratch);
+}
+
+static int bench_ramread(devinfo_t *di, benchctx_t *bc, int arg,
+			 uint64_t *bytes, int *ops)
+{
+	int i;
+
+	for (i = 0; i < BENCH_RAMREADS; i++)
+		if (cmd_read_mem(di, ROMBOOT_LOCATION, arg, bc->buf))
+			return -1;
+
+	*bytes = (uint64_t)BENCH_RAMREADS * arg;
+	*ops = BENCH_RAMREADS;
+	return 0;
+}
+
+static int bench_seq_read(devinfo_t *di, benchctx_t *bc, int arg,
+			  uint64_t *bytes, int *ops)
+{
+	int i, n = di->ppb / arg;
+
+	for (i = 0; i < n; i++)
+		if (cmd_read_flash_pages(di, bc->scratch + i * arg, arg,
+					 bc->buf))
+			return -1;
+
+	*bytes = (uint64_t)n * arg * di->ps;
+	*ops = n;
+	return 0;
+}
+
+static int bench_seq_write(devinfo_t *di, benchctx_t *bc, int arg,
+			   uint64_t *bytes, int *ops)
+{
+	if (cmd_write_flash_pages(di, bc->scratch, di->ppb, bc->buf))
+		return -1;
+
+	*bytes = di->bs;
+	*ops = di->ppb;
+	return 0;
+}
+
+/* arg is the offset into the scratch area, unaligned ones touch 2 blocks */
+static int bench_image_write(devinfo_t *di, benchctx_t *bc, int arg,
+			     uint64_t *bytes, int *ops)
+{
+	if (image_write_random_usb(di, bc->scratch * di->ps + arg, bc->buf,
+				   di->bs))
+		return -1;
+
+	*bytes = di->bs;
+	*ops = 1;
+	return 0;
+}
+
+static int bench_pat_scan(devinfo_t *di, benchctx_t *bc, int arg,
+			  uint64_t *bytes, int *ops)
+{
+	bootfile_info_t *binfs;
+
+	if (image_scan_pats_usb(di, 0, PAT_SEARCH_RANGE_PAGES, &binfs) < 0)
+		return -1;
+	free(binfs);
+
+	*bytes = (uint64_t)PAT_SEARCH_RANGE_PAGES * di->ps;
+	*ops = PAT_SEARCH_RANGE_PAGES;
+	return 0;
+}
+
+static int bench_dump(devinfo_t *di, benchctx_t *bc, int arg,
+		      uint64_t *bytes, int *ops)
+{
+	if (file_flash_dump(di, 0, BENCH_DUMP_BLOCKS * di->bs, "/dev/null"))
+		return -1;
+
+	*bytes = BENCH_DUMP_BLOCKS * di->bs;
+	*ops = BENCH_DUMP_BLOCKS * di->ppb;
+	return 0;
+}
+
+static const bench_t benches[] =
+{
+	{ "txn-flashconf",	0, 0,	NULL,	bench_txn_flashconf },
+	{ "txn-ramread",	0, 0,	NULL,	bench_txn_ramread },
+	{ "txn-ramwrite",	0, 0,	NULL,	bench_txn_ramwrite },
+	{ "txn-flashread",	0, 0,	NULL,	bench_txn_flashread },
+	{ "txn-erase",		1, 0,	NULL,	bench_txn_erase },
+	{ "ramread-512",	0, 512,	NULL,	bench_ramread },
+	{ "ramread-4k",		0, 4096, NULL,	bench_ramread },
+	{ "ramread-64k",	0, 65536, NULL,	bench_ramread },
+	{ "seq-read-1p",	0, 1,	NULL,	bench_seq_read },
+	{ "seq-read-16p",	0, 16,	NULL,	bench_seq_read },
+	{ "seq-write-block",	1, 0,	bench_prep_erase, bench_seq_write },
+	{ "image-write-aligned", 1, 0,	NULL,	bench_image_write },
+	{ "image-write-unaligned", 1, 1000, NULL, bench_image_write },
+	{ "pat-scan",		0, 0,	NULL,	bench_pat_scan },
+	{ "flash-dump",		0, 0,	NULL,	bench_dump },
+};
+
+#define BENCH_COUNT	(sizeof(benches) / sizeof(benches[0]))
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double d = *(const double *)a - *(const double *)b;
+
+	return (d > 0) - (d < 0);
+}
+
+/**
+ * Runs all repetitions of one benchmark
+ * @param di Device info struct of opened and inited device
+ * @param bc Benchmark context
+ * @param res Result to fill
+ * @returns 0 if OK, <0 on error
+ */
+static int bench_one(devinfo_t *di, benchctx_t *bc, benchres_t *res)
+{
+	const bench_t *b = res->b;
+	double start;
+	int i;
+
+	res->mean = 0;
+
+	for (i = 0; i < BENCH_REPS; i++)
+	{
+		if (b->prep && b->prep(di, bc, b->arg))
+			return -1;
+
+		start = log_now();
+		if (b->run(di, bc, b->arg, &res->bytes, &res->ops))
+			return -1;
+		res->secs[i] = log_now() - start;
+		res->mean += res->secs[i] / BENCH_REPS;
+	}
+
+	qsort(res->secs, BENCH_REPS, sizeof(double), bench_cmp);
+	return 0;
+}
+
+/**
+ * Writes the results as JSON if the filename ends in .json, CSV otherwise
+ * @param fname File to write, "-" for stdout
+ * @param di Device info struct of the benchmarked device
+ * @param res Results
+ * @param n Number of results
+ * @returns 0 if OK, <0 on error
+ */
+static int bench_write(char *fname, devinfo_t *di, benchres_t *res, int n)
+{
+	FILE *f;
+	int i, json;
+	double med;
+	size_t len = strlen(fname);
+
+	json = (len > 5) && !strcmp(fname + len - 5, ".json");
+
+	f = strcmp(fname, "-") ? fopen(fname, "w") : stdout;
+	if (f == NULL)
+	{
+		DBGE(di, "Can't open results file %s\n", fname);
+		return -1;
+	}
+
+	if (json)
+		fprintf(f, "{\"device\":\"%s\",\"ps\":%u,\"ppb\":%u,"
+			"\"reps\":%d,\"results\":[", di->fake ? "fake" : "usb",
+			di->ps, di->ppb, BENCH_REPS);
+	else
+		fprintf(f, "name,bytes,ops,min_s,median_s,mean_s,mb_s,"
+			"us_per_op\n");
+
+	for (i = 0; i < n; i++)
+	{
+		med = res[i].secs[BENCH_REPS / 2];
+		fprintf(f, json ? "%s{\"name\":\"%s\",\"bytes\":%llu,"
+			"\"ops\":%d,\"min_s\":%.6f,\"median_s\":%.6f,"
+			"\"mean_s\":%.6f,\"mb_s\":%.3f,\"us_per_op\":%.3f}" :
+			"%s%s,%llu,%d,%.6f,%.6f,%.6f,%.3f,%.3f\n",
+			(json && i) ? "," : "", res[i].b->name,
+			(unsigned long long)res[i].bytes, res[i].ops,
+			res[i].secs[0], med, res[i].mean,
+			(med > 0) ? res[i].bytes / med / 1048576.0 : 0,
+			res[i].ops ? med * 1e6 / res[i].ops : 0);
+	}
+
+	if (json)
+		fprintf(f, "]}\n");
+
+	if (f != stdout)
+		return fclose(f) ? -1 : 0;
+	fflush(f);
+	return 0;
+}
+
+/**
+ * Runs the benchmarks and writes their results
+ * Benchmarks writing flash only run if a scratch area is given, or the
+ * device is a fake one.
+ * @param di Device info struct of opened and inited device
+ * @param fname File to write the results to
+ * @param scratch Flash address of the scratch area
+ * @param canwrite Whether the scratch area may be overwritten
+ * @returns 0 if OK, <0 on error
+ */
+int bench_run(devinfo_t *di, char *fname, uint32_t scratch, int canwrite)
+{
+	benchctx_t bc;
+	benchres_t res[BENCH_COUNT];
+	int i, n = 0, ret = 0;
+
+	bc.scratch = (scratch / di->bs) * di->ppb;
+	if (bc.scratch / di->ppb + BENCH_SCRATCH_BLOCKS > di->tb)
+	{
+		DBGE(di, "Scratch area doesn't fit into the flash\n");
+		return -1;
+	}
+
+	bc.buf = malloc(2 * di->bs);
+	if (bc.buf == NULL)
+	{
+		DBGE(di, "Can't allocate benchmark buffer\n");
+		return -1;
+	}
+	memset(bc.buf, 0x5A, 2 * di->bs);
+
+	if (cmd_read_mem(di, DEVICE_ID_LOCATION, DEVICE_ID_LENGTH, bc.devid))
+	{
+		ret = -1;
+		goto out;
+	}
+
+	if (!canwrite)
+		DBG(di, "- No scratch area given with -a, skipping flash write "
+		    "benchmarks\n");
+
+	for (i = 0; i < BENCH_COUNT; i++)
+	{
+		if (benches[i].write && !canwrite)
+			continue;
+
+		res[n].b = &benches[i];
+		ret = bench_one(di, &bc, &res[n]);
+		if (ret)
+		{
+			DBGE(di, "Benchmark %s failed\n", benches[i].name);
+			goto out;
+		}
+
+		DBG(di, "%-24s %9.3f ms %9.3f MB/s %9.1f us/op\n", benches[i].name,
+		    res[n].secs[BENCH_REPS / 2] * 1000,
+		    res[n].bytes / res[n].secs[BENCH_REPS / 2] / 1048576.0,
+		    res[n].secs[BENCH_REPS / 2] * 1e6 / res[n].ops);
+		n++;
+	}
+
+	ret = bench_write(fname, di, res, n);
+
+out:
+	free(bc.buf);
+	return ret;
+}
@@ -0,0 +1,93 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+/**
+ * Splits an <addr>:<file> argument
+ * @param di Context errors are reported to
+ * @param spec The argument
+ * @param addr Returns the address
+ * @param fname Returns the filename, pointing into spec
+ * @returns 0 if OK, <0 on error
+ */
+static int boot_parse(devinfo_t *di, char *spec, unsigned int *addr,
+		      char **fname)
+{
+	char *end;
+
+	errno = 0;
+	*addr = strtoul(spec, &end, 0);
+	if (errno || (end == spec) || (*end != ':') || (end[1] == 0))
+	{
+		DBGE(di, "Invalid upload, use <addr>:<file>: %s\n", spec);
+		return -1;
+	}
+
+	*fname = end + 1;
+	return 0;
+}
+
+/**
+ * Boots the device from RAM: uploads files to memory and jumps to the
+ * entry point, without touching the flash
+ * All arguments are checked before anything gets uploaded. The image may
+ * never return from EXECUTE, so a missing status after the jump isn't
+ * treated as an error.
+ * @param di Device info struct of opened and inited device
+ * @param specs Files to upload, as <addr>:<file>
+ * @param nspecs Number of files
+ * @param entry Address to jump to
+ * @param verify Read back and compare the checksum of every file if set
+ * @returns 0 if OK, <0 on error
+ */
+int boot_run(devinfo_t *di, char **specs, int nspecs, uint32_t entry,
+	     int verify)
+{
+	unsigned int addr;
+	char *fname;
+	int i;
+
+	for (i = 0; i < nspecs; i++)
+		if (boot_parse(di, specs[i], &addr, &fname))
+			return -1;
+
+	for (i = 0; i < nspecs; i++)
+	{
+		boot_parse(di, specs[i], &addr, &fname);
+		DBG(di, "- Uploading %s to %08X\n", fname, addr);
+		if (file_ram_write(di, addr, fname, verify))
+			return -1;
+	}
+
+	DBG(di, "- Jumping to %08X\n", entry);
+	if (cmd_execute(di, entry))
+		DBG(di, "- No status after the jump, the image is running\n");
+
+	return 0;
+}
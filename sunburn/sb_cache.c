@@ -0,0 +1,315 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define CACHE_NONE		-1
+#define CACHE_SERVE_SIZE	(64 * 1024 * 1024)	/* Unless set with -C */
+
+/** A cached flash page */
+typedef struct
+{
+	uint32_t page;		/**< Number of the page */
+	int prev;		/**< More recently used slot, or CACHE_NONE */
+	int next;		/**< Less recently used slot, or CACHE_NONE */
+	int hnext;		/**< Next slot in the hash chain, or CACHE_NONE */
+} cslot_t;
+
+struct pcache
+{
+	devinfo_t *di;		/**< Context the statistics are printed to */
+	cslot_t *slots;		/**< All slots */
+	char *data;		/**< Page data of the slots, back to back */
+	int *hash;		/**< First slot of each hash chain */
+	int nslots;		/**< Number of slots */
+	int hmask;		/**< Number of hash chains - 1 */
+	int ps;			/**< Page size */
+	int used;		/**< Slots in use, the others are on the free list */
+	int freel;		/**< First free slot, chained through next */
+	int head;		/**< Most recently used slot */
+	int tail;		/**< Least recently used slot, evicted first */
+	unsigned long hits;	/**< Reads served from the cache */
+	unsigned long misses;	/**< Reads that went to the device */
+	unsigned long evicts;	/**< Pages dropped to make room */
+	unsigned long invals;	/**< Pages dropped by writes and erases */
+};
+
+/**
+ * Creates a page cache
+ * @param di Context the statistics are printed to
+ * @param bytes Memory to use for page data
+ * @param ps Page size
+ * @returns Pointer to the cache, NULL on error
+ */
+pcache_t *cache_create(devinfo_t *di, unsigned long bytes, int ps)
+{
+	pcache_t *c;
+	int i, nhash = 1;
+
+	c = calloc(1, sizeof(pcache_t));
+	if (c == NULL)
+		return NULL;
+
+	c->di = di;
+	c->ps = ps;
+	c->nslots = bytes / ps;
+	if (c->nslots < 1)
+		c->nslots = 1;
+	while (nhash < c->nslots)
+		nhash <<= 1;
+	c->hmask = nhash - 1;
+
+	c->slots = calloc(c->nslots, sizeof(cslot_t));
+	c->data = malloc((size_t)c->nslots * ps);
+	c->hash = malloc(nhash * sizeof(int));
+	if ((c->slots == NULL) || (c->data == NULL) || (c->hash == NULL))
+	{
+		cache_destroy(c);
+		return NULL;
+	}
+
+	for (i = 0; i < nhash; i++)
+		c->hash[i] = CACHE_NONE;
+	for (i = 0; i < c->nslots; i++)
+		c->slots[i].next = (i + 1 < c->nslots) ? i + 1 : CACHE_NONE;
+	c->freel = 0;
+	c->head = CACHE_NONE;
+	c->tail = CACHE_NONE;
+
+	DBG1(di, "Page cache: %d pages\n", c->nslots);
+
+	return c;
+}
+
+/**
+ * Gives a device a page cache for serving many small reads, unless it has
+ * one already
+ * Lazy reads of single pages are only cheap with a cache to keep them in.
+ * @param di Device info struct of inited device
+ */
+void cache_serve(devinfo_t *di)
+{
+	if (di->cache == NULL)
+		di->cache = cache_create(di, CACHE_SERVE_SIZE, di->ps);
+}
+
+/**
+ * Prints the statistics and frees a page cache
+ * @param c The cache, may be NULL
+ */
+void cache_destroy(pcache_t *c)
+{
+	if (c == NULL)
+		return;
+
+	if (c->hits || c->misses)
+		DBG(c->di, "- Page cache: %lu hits, %lu misses, %lu evicted, "
+		    "%lu invalidated\n", c->hits, c->misses, c->evicts,
+		    c->invals);
+
+	free(c->slots);
+	free(c->data);
+	free(c->hash);
+	free(c);
+}
+
+/**
+ * Hash chain of a page
+ * @param c The cache
+ * @param page Number of the page
+ * @returns Index into the hash table
+ */
+static int cache_bucket(pcache_t *c, uint32_t page)
+{
+	return (page * 2654435761U) & c->hmask;
+}
+
+/**
+ * Looks up the slot of a page
+ * @param c The cache
+ * @param page Number of the page
+ * @returns The slot, CACHE_NONE if the page isn't cached
+ */
+static int cache_find(pcache_t *c, uint32_t page)
+{
+	int s;
+
+	for (s = c->hash[cache_bucket(c, page)]; s != CACHE_NONE;
+	     s = c->slots[s].hnext)
+		if (c->slots[s].page == page)
+			return s;
+
+	return CACHE_NONE;
+}
+
+/**
+ * Takes a slot out of the LRU list
+ * @param c The cache
+ * @param s The slot
+ */
+static void cache_unlink(pcache_t *c, int s)
+{
+	cslot_t *sl = &c->slots[s];
+
+	if (sl->prev != CACHE_NONE)
+		c->slots[sl->prev].next = sl->next;
+	else
+		c->head = sl->next;
+
+	if (sl->next != CACHE_NONE)
+		c->slots[sl->next].prev = sl->prev;
+	else
+		c->tail = sl->prev;
+}
+
+/**
+ * Puts a slot at the most recently used end of the LRU list
+ * @param c The cache
+ * @param s The slot
+ */
+static void cache_link_head(pcache_t *c, int s)
+{
+	c->slots[s].prev = CACHE_NONE;
+	c->slots[s].next = c->head;
+	if (c->head != CACHE_NONE)
+		c->slots[c->head].prev = s;
+	c->head = s;
+	if (c->tail == CACHE_NONE)
+		c->tail = s;
+}
+
+/**
+ * Drops a slot from its hash chain and the LRU list and frees it
+ * @param c The cache
+ * @param s The slot
+ */
+static void cache_drop(pcache_t *c, int s)
+{
+	int *pp = &c->hash[cache_bucket(c, c->slots[s].page)];
+
+	while (*pp != s)
+		pp = &c->slots[*pp].hnext;
+	*pp = c->slots[s].hnext;
+
+	cache_unlink(c, s);
+	c->slots[s].next = c->freel;
+	c->freel = s;
+	c->used--;
+}
+
+/**
+ * Reads a page from the cache
+ * @param c The cache, may be NULL
+ * @param page Number of the page
+ * @param data Buffer to fill, page size length
+ * @returns 1 if the page was cached, 0 if not
+ */
+int cache_get(pcache_t *c, uint32_t page, char *data)
+{
+	int s;
+
+	if (c == NULL)
+		return 0;
+
+	s = cache_find(c, page);
+	if (s == CACHE_NONE)
+	{
+		c->misses++;
+		return 0;
+	}
+
+	memcpy(data, c->data + (size_t)s * c->ps, c->ps);
+	cache_unlink(c, s);
+	cache_link_head(c, s);
+	c->hits++;
+
+	return 1;
+}
+
+/**
+ * Adds a page to the cache, or updates it, evicting the least recently used
+ * page if the cache is full
+ * The data has to match the flash content: read from the device, or
+ * written and verified.
+ * @param c The cache, may be NULL
+ * @param page Number of the page
+ * @param data Content of the page, page size length
+ */
+void cache_put(pcache_t *c, uint32_t page, char *data)
+{
+	int s, h;
+
+	if (c == NULL)
+		return;
+
+	s = cache_find(c, page);
+	if (s != CACHE_NONE)
+		cache_unlink(c, s);
+	else
+	{
+		if (c->freel == CACHE_NONE)
+		{
+			cache_drop(c, c->tail);
+			c->evicts++;
+		}
+
+		s = c->freel;
+		c->freel = c->slots[s].next;
+		c->used++;
+
+		h = cache_bucket(c, page);
+		c->slots[s].page = page;
+		c->slots[s].hnext = c->hash[h];
+		c->hash[h] = s;
+	}
+
+	memcpy(c->data + (size_t)s * c->ps, data, c->ps);
+	cache_link_head(c, s);
+}
+
+/**
+ * Drops pages from the cache, when they get written or erased
+ * @param c The cache, may be NULL
+ * @param page Number of the first page
+ * @param num Number of pages
+ */
+void cache_invalidate(pcache_t *c, uint32_t page, int num)
+{
+	int s;
+
+	if ((c == NULL) || (c->used == 0))
+		return;
+
+	for (; num > 0; num--, page++)
+	{
+		s = cache_find(c, page);
+		if (s == CACHE_NONE)
+			continue;
+		cache_drop(c, s);
+		c->invals++;
+	}
+}
@@ -26,26 +26,6 @@
 
 #include "sb.h"
 
-#define CMD_USB_SCSI_C2(x)	((x << 8) | 0xC2)
-
-#define CMD_USB_BYPASSBR	CMD_USB_SCSI_C2(0x00)
-#define CMD_USB_RAMWRITE	CMD_USB_SCSI_C2(0x01)
-#define CMD_USB_RAMREAD		CMD_USB_SCSI_C2(0x02)
-
-#define CMD_USB_EXECUTE		CMD_USB_SCSI_C2(0x05)
-#define CMD_USB_BRVERINFO	CMD_USB_SCSI_C2(0x06)
-#define CMD_USB_DRAMINIT	CMD_USB_SCSI_C2(0x07)
-
-#define CMD_USB_FLASHCONFREAD	CMD_USB_SCSI_C2(0x10)
-#define CMD_USB_FLASHBLKERASE	CMD_USB_SCSI_C2(0x11)
-#define CMD_USB_FLASHWRITE	CMD_USB_SCSI_C2(0x12)
-#define CMD_USB_FLASHREAD	CMD_USB_SCSI_C2(0x13)
-
-#define CMD_USB_FLASHCONFSEND	CMD_USB_SCSI_C2(0x20)
-
-#define CMD_USB_FLASHWRITEALT	CMD_USB_SCSI_C2(0x30)
-#define CMD_USB_FLASHREADALT	CMD_USB_SCSI_C2(0x31)
-
 #define FLASHINFO_LENGTH	0x40
 
 /**
@@ -74,7 +54,7 @@ int cmd_get_flash_info(devinfo_t *di, nandconf_t *nc)
 	ret = cmd_read_flash_config(di, nc);
 	if (ret < 0)
 	{
-		DBGE("Unable to get flash info\n");
+		DBGE(di, "Unable to get flash info\n");
 		return ret;
 	}
 	
@@ -122,7 +102,12 @@ inline int cmd_init_dram(devinfo_t *di)
  */
 inline int cmd_read_mem(devinfo_t *di, int addr, int len, char* buf)
 {
-	return usb_txn(di, CMD_USB_RAMREAD, addr, len, buf, SCSI_FLAG_READ);
+	int ret;
+
+	ret = usb_txn(di, CMD_USB_RAMREAD, addr, len, buf, SCSI_FLAG_READ);
+	progress_add(di->prog, PROG_RAMREAD, len);
+
+	return ret;
 }
 
 /**
@@ -135,7 +120,12 @@ inline int cmd_read_mem(devinfo_t *di, int addr, int len, char* buf)
  */
 inline int cmd_write_mem(devinfo_t *di, int addr, int len, char* buf)
 {
-	return usb_txn(di, CMD_USB_RAMWRITE, addr, len, buf, SCSI_FLAG_WRITE);
+	int ret;
+
+	ret = usb_txn(di, CMD_USB_RAMWRITE, addr, len, buf, SCSI_FLAG_WRITE);
+	progress_add(di->prog, PROG_RAMWRITE, len);
+
+	return ret;
 }
 
 /**
@@ -147,8 +137,18 @@ inline int cmd_write_mem(devinfo_t *di, int addr, int len, char* buf)
  */
 inline int cmd_read_flash_page(devinfo_t *di, uint32_t pageno, char *data)
 {
-	return usb_txn(di, CMD_USB_FLASHREAD, pageno, di->ps, data,
-		       SCSI_FLAG_READ);
+	int ret;
+
+	if (cache_get(di->cache, pageno, data))
+		return 0;
+
+	ret = usb_txn(di, CMD_USB_FLASHREAD, pageno, di->ps, data,
+		      SCSI_FLAG_READ);
+	progress_add(di->prog, PROG_READ, di->ps);
+	if (ret == 0)
+		cache_put(di->cache, pageno, data);
+
+	return ret;
 }
 
 /**
@@ -184,8 +184,16 @@ int cmd_read_flash_pages(devinfo_t *di, uint32_t fp, int num, char *data)
  */
 inline int cmd_write_flash_page(devinfo_t *di, uint32_t pageno, char *data)
 {
-	return usb_txn(di, CMD_USB_FLASHWRITE, pageno, di->ps, data,
-		       SCSI_FLAG_WRITE);
+	int ret;
+
+	/* Cached again once it's verified */
+	cache_invalidate(di->cache, pageno, 1);
+
+	ret = usb_txn(di, CMD_USB_FLASHWRITE, pageno, di->ps, data,
+		      SCSI_FLAG_WRITE);
+	progress_add(di->prog, PROG_PROGRAM, di->ps);
+
+	return ret;
 }
 
 /**
@@ -221,8 +229,16 @@ int cmd_write_flash_pages(devinfo_t *di, uint32_t fp, int num, char *data)
  */
 inline int cmd_erase_block(devinfo_t *di, uint32_t pageno)
 {
-	return usb_txn(di, CMD_USB_FLASHBLKERASE, pageno, 0,
-		       NULL, SCSI_FLAG_WRITE);
+	int ret;
+
+	cache_invalidate(di->cache, pageno - pageno % di->ppb, di->ppb);
+
+	ret = usb_txn(di, CMD_USB_FLASHBLKERASE, pageno, 0,
+		      NULL, SCSI_FLAG_WRITE);
+	/* Nothing is transferred, the erase only counts as an operation */
+	progress_add(di->prog, PROG_ERASE, 0);
+
+	return ret;
 }
 
 /**
@@ -246,6 +262,18 @@ int cmd_erase_blocks(devinfo_t *di, uint32_t firstpage, int numblocks)
 	return 0;
 }
 
+/**
+ * Runs code uploaded to device memory, the romboot code carries on serving
+ * USB once it returns
+ * @param di Device info struct of opened and inited device
+ * @param addr Address to jump to
+ * @returns 0 if OK, <0 on error
+ */
+inline int cmd_execute(devinfo_t *di, uint32_t addr)
+{
+	return usb_txn(di, CMD_USB_EXECUTE, addr, 0, NULL, SCSI_FLAG_READ);
+}
+
 /**
  * Reads the device id from memory, filled by the romboot code
  * @param di Device info struct of opened and inited device
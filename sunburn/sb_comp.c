@@ -0,0 +1,488 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lzma.h>
+#include <zstd.h>
+#include <usb.h>
+
+#include "sb.h"
+
+#define COMP_OUTBUF_SIZE	(256 * 1024)
+#define COMP_INBUF_SIZE		(256 * 1024)
+#define COMP_ZSTD_LEVEL		3
+#define COMP_XZ_PRESET		3
+
+struct comp
+{
+	devinfo_t *di;		/**< Context errors are reported to */
+	enum comptype type;
+	int fd;			/**< Output file descriptor */
+	ZSTD_CCtx *zc;		/**< zstd context */
+	lzma_stream xz;		/**< xz stream */
+	char *outbuf;		/**< Compressed data staging buffer */
+};
+
+struct decomp
+{
+	devinfo_t *di;		/**< Context errors are reported to */
+	enum comptype type;
+	int fd;			/**< Input file descriptor */
+	ZSTD_DCtx *zd;		/**< zstd context */
+	lzma_stream xz;		/**< xz stream */
+	char *inbuf;		/**< Compressed data read from the file */
+	int inlen;		/**< Length of data in inbuf */
+	int inpos;		/**< Data in inbuf consumed up to here */
+	int eof;		/**< Input file fully read */
+	int end;		/**< Decompressor returned all data */
+	int midframe;		/**< zstd frame not completed yet */
+};
+
+/**
+ * Figures out the compression to use from the extension of a filename
+ * @param fname Name of the file
+ * @returns COMP_ZSTD for .zst, COMP_XZ for .xz, COMP_NONE otherwise
+ */
+enum comptype comp_type_from_name(char *fname)
+{
+	int len = strlen(fname);
+
+	if ((len > 4) && !strcmp(fname + len - 4, ".zst"))
+		return COMP_ZSTD;
+	if ((len > 3) && !strcmp(fname + len - 3, ".xz"))
+		return COMP_XZ;
+
+	return COMP_NONE;
+}
+
+/**
+ * Detects compressed data from its magic bytes
+ * @param buf Start of the data
+ * @param len Length of buf, COMP_MAGIC_LEN is enough
+ * @returns COMP_ZSTD, COMP_XZ or COMP_NONE
+ */
+enum comptype comp_type_from_magic(unsigned char *buf, int len)
+{
+	static const unsigned char zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+	static const unsigned char xz_magic[] = { 0xFD, '7', 'z', 'X', 'Z', 0 };
+
+	if ((len >= sizeof(zstd_magic)) &&
+	    !memcmp(buf, zstd_magic, sizeof(zstd_magic)))
+		return COMP_ZSTD;
+	if ((len >= sizeof(xz_magic)) &&
+	    !memcmp(buf, xz_magic, sizeof(xz_magic)))
+		return COMP_XZ;
+
+	return COMP_NONE;
+}
+
+/**
+ * Writes a whole buffer to a file descriptor
+ * @param di Context errors are reported to
+ * @param fd File descriptor
+ * @param data Data to write
+ * @param len Length of data
+ * @returns 0 if OK, <0 on error
+ */
+static int comp_write_fd(devinfo_t *di, int fd, char *data, int len)
+{
+	int ret;
+
+	while (len > 0)
+	{
+		ret = write(fd, data, len);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			DBGE(di, "Can't write to output file: %s\n",
+			     strerror(errno));
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Starts a compressed stream written to a file descriptor
+ * zstd and xz both use all CPUs if the libraries are built with threading,
+ * compression running on the caller's thread otherwise.
+ * @param di Context errors are reported to
+ * @param fd File descriptor to write the compressed stream to
+ * @param type Compression to use
+ * @returns Pointer to the compressor, NULL on error
+ */
+comp_t *comp_open(devinfo_t *di, int fd, enum comptype type)
+{
+	comp_t *c;
+	lzma_stream xzinit = LZMA_STREAM_INIT;
+	lzma_mt mt;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	c = calloc(1, sizeof(comp_t));
+	if (c == NULL)
+		goto fail;
+
+	c->di = di;
+	c->type = type;
+	c->fd = fd;
+	c->xz = xzinit;
+	c->outbuf = malloc(COMP_OUTBUF_SIZE);
+	if (c->outbuf == NULL)
+		goto fail;
+
+	if (ncpu < 1)
+		ncpu = 1;
+
+	switch (type)
+	{
+	case COMP_ZSTD:
+		c->zc = ZSTD_createCCtx();
+		if (c->zc == NULL)
+			goto fail;
+		ZSTD_CCtx_setParameter(c->zc, ZSTD_c_compressionLevel,
+				       COMP_ZSTD_LEVEL);
+		/* Fails silently on single-threaded libzstd builds */
+		ZSTD_CCtx_setParameter(c->zc, ZSTD_c_nbWorkers, ncpu);
+		break;
+	case COMP_XZ:
+		memset(&mt, 0, sizeof(mt));
+		mt.threads = ncpu;
+		mt.preset = COMP_XZ_PRESET;
+		mt.check = LZMA_CHECK_CRC64;
+		if (lzma_stream_encoder_mt(&c->xz, &mt) != LZMA_OK)
+			goto fail;
+		break;
+	default:
+		goto fail;
+	}
+
+	return c;
+
+fail:
+	DBGE(di, "Can't set up compressor\n");
+	if (c)
+	{
+		free(c->outbuf);
+		free(c);
+	}
+	return NULL;
+}
+
+/**
+ * Runs the compressor on a chunk of input
+ * @param c The compressor
+ * @param data Input data, NULL to finish the stream
+ * @param len Length of input data
+ * @returns 0 if OK, <0 on error
+ */
+static int comp_run(comp_t *c, char *data, int len)
+{
+	ZSTD_inBuffer zin = { data, len, 0 };
+	ZSTD_outBuffer zout;
+	lzma_ret lret;
+	size_t zret;
+	int finish = (data == NULL);
+
+	if (c->type == COMP_ZSTD)
+	{
+		do
+		{
+			zout.dst = c->outbuf;
+			zout.size = COMP_OUTBUF_SIZE;
+			zout.pos = 0;
+			zret = ZSTD_compressStream2(c->zc, &zout, &zin,
+					finish ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(zret))
+			{
+				DBGE(c->di, "zstd: %s\n",
+				     ZSTD_getErrorName(zret));
+				return -1;
+			}
+			if (comp_write_fd(c->di, c->fd, c->outbuf, zout.pos))
+				return -1;
+		} while (finish ? (zret != 0) : (zin.pos < zin.size));
+
+		return 0;
+	}
+
+	c->xz.next_in = (uint8_t *)data;
+	c->xz.avail_in = len;
+	do
+	{
+		c->xz.next_out = (uint8_t *)c->outbuf;
+		c->xz.avail_out = COMP_OUTBUF_SIZE;
+		lret = lzma_code(&c->xz, finish ? LZMA_FINISH : LZMA_RUN);
+		if ((lret != LZMA_OK) && (lret != LZMA_STREAM_END))
+		{
+			DBGE(c->di, "xz: compression error %d\n", lret);
+			return -1;
+		}
+		if (comp_write_fd(c->di, c->fd, c->outbuf,
+				  COMP_OUTBUF_SIZE - c->xz.avail_out))
+			return -1;
+	} while (finish ? (lret != LZMA_STREAM_END) : (c->xz.avail_in > 0));
+
+	return 0;
+}
+
+/**
+ * Compresses a chunk of data and writes the output to the file
+ * @param c The compressor
+ * @param data Data to compress
+ * @param len Length of data
+ * @returns 0 if OK, <0 on error
+ */
+int comp_write(comp_t *c, char *data, int len)
+{
+	return comp_run(c, data, len);
+}
+
+/**
+ * Finishes the compressed stream and frees the compressor
+ * The file descriptor is left open.
+ * @param c The compressor
+ * @param flush Write out the end of the stream, 0 if aborting
+ * @returns 0 if OK, <0 on error
+ */
+int comp_close(comp_t *c, int flush)
+{
+	int ret = 0;
+
+	if (flush)
+		ret = comp_run(c, NULL, 0);
+
+	if (c->zc)
+		ZSTD_freeCCtx(c->zc);
+	lzma_end(&c->xz);
+	free(c->outbuf);
+	free(c);
+
+	return ret;
+}
+
+/**
+ * Starts decompressing a compressed stream read from a file descriptor
+ * @param di Context errors are reported to
+ * @param fd File descriptor to read the compressed stream from
+ * @param type Compression of the stream
+ * @param pre Data already read from fd, e.g. for detecting the type
+ * @param prelen Length of pre, at most COMP_INBUF_SIZE
+ * @returns Pointer to the decompressor, NULL on error
+ */
+decomp_t *decomp_open(devinfo_t *di, int fd, enum comptype type,
+		       char *pre, int prelen)
+{
+	decomp_t *d;
+	lzma_stream xzinit = LZMA_STREAM_INIT;
+
+	d = calloc(1, sizeof(decomp_t));
+	if (d == NULL)
+		goto fail;
+
+	d->di = di;
+	d->type = type;
+	d->fd = fd;
+	d->xz = xzinit;
+	d->inbuf = malloc(COMP_INBUF_SIZE);
+	if (d->inbuf == NULL)
+		goto fail;
+
+	memcpy(d->inbuf, pre, prelen);
+	d->inlen = prelen;
+
+	switch (type)
+	{
+	case COMP_ZSTD:
+		d->zd = ZSTD_createDCtx();
+		if (d->zd == NULL)
+			goto fail;
+		break;
+	case COMP_XZ:
+		if (lzma_stream_decoder(&d->xz, UINT64_MAX,
+					LZMA_CONCATENATED) != LZMA_OK)
+			goto fail;
+		break;
+	default:
+		goto fail;
+	}
+
+	return d;
+
+fail:
+	DBGE(di, "Can't set up decompressor\n");
+	if (d)
+	{
+		free(d->inbuf);
+		free(d);
+	}
+	return NULL;
+}
+
+/**
+ * Refills the input buffer of a decompressor once it's consumed
+ * @param d The decompressor
+ * @returns 0 if OK, <0 on error
+ */
+static int decomp_fill(decomp_t *d)
+{
+	int ret;
+
+	if ((d->inpos < d->inlen) || d->eof)
+		return 0;
+
+	do
+		ret = read(d->fd, d->inbuf, COMP_INBUF_SIZE);
+	while ((ret < 0) && (errno == EINTR));
+
+	if (ret < 0)
+	{
+		DBGE(d->di, "Can't read input file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	d->inlen = ret;
+	d->inpos = 0;
+	if (ret == 0)
+		d->eof = 1;
+
+	return 0;
+}
+
+/**
+ * Reads decompressed data from a zstd stream
+ * @param d The decompressor
+ * @param buf Buffer to fill
+ * @param len Length of buf
+ * @returns Number of bytes, <0 on error
+ */
+static int decomp_read_zstd(decomp_t *d, char *buf, int len)
+{
+	ZSTD_inBuffer zin;
+	ZSTD_outBuffer zout = { buf, len, 0 };
+	size_t zret;
+
+	while (!d->end && (zout.pos < zout.size))
+	{
+		if (decomp_fill(d))
+			return -1;
+
+		if (d->eof)
+		{
+			if (d->midframe)
+			{
+				DBGE(d->di, "zstd: truncated input\n");
+				return -1;
+			}
+			d->end = 1;
+			break;
+		}
+
+		zin.src = d->inbuf;
+		zin.size = d->inlen;
+		zin.pos = d->inpos;
+		zret = ZSTD_decompressStream(d->zd, &zout, &zin);
+		if (ZSTD_isError(zret))
+		{
+			DBGE(d->di, "zstd: %s\n", ZSTD_getErrorName(zret));
+			return -1;
+		}
+		d->inpos = zin.pos;
+
+		/* 0 is returned when a frame is complete */
+		d->midframe = (zret != 0);
+	}
+
+	return zout.pos;
+}
+
+/**
+ * Reads decompressed data from an xz stream
+ * @param d The decompressor
+ * @param buf Buffer to fill
+ * @param len Length of buf
+ * @returns Number of bytes, <0 on error
+ */
+static int decomp_read_xz(decomp_t *d, char *buf, int len)
+{
+	lzma_ret lret;
+
+	d->xz.next_out = (uint8_t *)buf;
+	d->xz.avail_out = len;
+
+	while (!d->end && (d->xz.avail_out > 0))
+	{
+		if (decomp_fill(d))
+			return -1;
+
+		d->xz.next_in = (uint8_t *)d->inbuf + d->inpos;
+		d->xz.avail_in = d->inlen - d->inpos;
+		lret = lzma_code(&d->xz, d->eof ? LZMA_FINISH : LZMA_RUN);
+		d->inpos = d->inlen - d->xz.avail_in;
+
+		if (lret == LZMA_STREAM_END)
+			d->end = 1;
+		else if (lret != LZMA_OK)
+		{
+			DBGE(d->di, "xz: decompression error %d\n", lret);
+			return -1;
+		}
+	}
+
+	return len - d->xz.avail_out;
+}
+
+/**
+ * Reads decompressed data
+ * @param d The decompressor
+ * @param buf Buffer to fill
+ * @param len Length of buf
+ * @returns Number of bytes, less than len only at the end of the stream,
+ *	    <0 on error
+ */
+int decomp_read(decomp_t *d, char *buf, int len)
+{
+	if (d->type == COMP_ZSTD)
+		return decomp_read_zstd(d, buf, len);
+
+	return decomp_read_xz(d, buf, len);
+}
+
+/**
+ * Frees a decompressor, the file descriptor is left open
+ * @param d The decompressor
+ */
+void decomp_close(decomp_t *d)
+{
+	if (d->zd)
+		ZSTD_freeDCtx(d->zd);
+	lzma_end(&d->xz);
+	free(d->inbuf);
+	free(d);
+}
@@ -0,0 +1,634 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define DAEMON_MAX_DEVS		32
+#define DAEMON_BACKLOG		16
+
+/** A device served by the daemon, clients are served in arrival order */
+typedef struct
+{
+	devinfo_t di;			/**< Opened and inited device */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned long next;		/**< Next ticket to hand out */
+	unsigned long serving;		/**< Ticket allowed to use the device */
+} daemon_dev_t;
+
+/** Data of a request or reply */
+typedef struct
+{
+	char *data;		/**< The data */
+	int len;		/**< Length of data */
+	int mapped;		/**< data is an mmap of the client's fd */
+} daemon_buf_t;
+
+static daemon_dev_t daemon_devs[DAEMON_MAX_DEVS];
+static int daemon_ndevs;
+static devinfo_t *daemon_di;	/**< Options and log of the daemon */
+static volatile sig_atomic_t daemon_stop;
+
+static void daemon_sighandler(int sig)
+{
+	daemon_stop = 1;
+}
+
+/**
+ * Waits until it's the caller's turn to use a device
+ * @param dd The device
+ */
+static void daemon_dev_lock(daemon_dev_t *dd)
+{
+	unsigned long ticket;
+
+	pthread_mutex_lock(&dd->lock);
+	ticket = dd->next++;
+	while (ticket != dd->serving)
+		pthread_cond_wait(&dd->cond, &dd->lock);
+	pthread_mutex_unlock(&dd->lock);
+}
+
+/**
+ * Lets the next waiting client use the device
+ * @param dd The device
+ */
+static void daemon_dev_unlock(daemon_dev_t *dd)
+{
+	pthread_mutex_lock(&dd->lock);
+	dd->serving++;
+	pthread_cond_broadcast(&dd->cond);
+	pthread_mutex_unlock(&dd->lock);
+}
+
+/**
+ * Reads or writes a whole buffer from/to a socket or file
+ * @param fd File descriptor
+ * @param buf Buffer
+ * @param len Length of buffer
+ * @param wr 1 to write, 0 to read
+ * @returns 0 if OK, <0 on error or end of file
+ */
+static int daemon_io(int fd, char *buf, int len, int wr)
+{
+	int ret;
+
+	while (len > 0)
+	{
+		if (wr)
+			ret = write(fd, buf, len);
+		else
+			ret = read(fd, buf, len);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Receives a request and the fd that may come with it
+ * @param sock Client socket
+ * @param req Request to fill
+ * @param fd Returns the passed fd, -1 if none
+ * @returns 0 if OK, <0 on error or if the client is gone
+ */
+static int daemon_recv_req(int sock, daemon_req_t *req, int *fd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	int ret;
+
+	*fd = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = req;
+	iov.iov_len = sizeof(daemon_req_t);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+
+	do
+		ret = recvmsg(sock, &msg, 0);
+	while ((ret < 0) && (errno == EINTR));
+
+	if (ret <= 0)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && (cmsg->cmsg_level == SOL_SOCKET) &&
+	    (cmsg->cmsg_type == SCM_RIGHTS))
+		memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if ((ret < sizeof(daemon_req_t)) &&
+	    daemon_io(sock, (char *)req + ret, sizeof(daemon_req_t) - ret, 0))
+		goto fail;
+
+	if (req->magic != DAEMON_MAGIC)
+	{
+		DBG1(daemon_di, "Daemon: bad request magic %08X\n", req->magic);
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	if (*fd != -1)
+		close(*fd);
+	return -1;
+}
+
+/**
+ * Gets a buffer for request or reply data
+ * If the client passed a regular file or memfd, it's mmapped so the data
+ * goes to/from it in place. The file is extended for replies if needed,
+ * the request fails if it's too short as touching the mapping past its end
+ * would kill the daemon with SIGBUS.
+ * @param b Buffer to set up
+ * @param fd Client's fd or -1
+ * @param len Length of data
+ * @param wr 1 if the buffer is written by the daemon (reply data)
+ * @returns 0 if OK, <0 on error
+ */
+static int daemon_buf_get(daemon_buf_t *b, int fd, int len, int wr)
+{
+	struct stat st;
+
+	memset(b, 0, sizeof(daemon_buf_t));
+	b->len = len;
+
+	if (len == 0)
+		return 0;
+
+	if ((fd != -1) && !fstat(fd, &st) && S_ISREG(st.st_mode))
+	{
+		if (wr && (st.st_size < len) && ftruncate(fd, len))
+		{
+			DBG1(daemon_di, "Daemon: can't resize client file\n");
+			return -1;
+		}
+		if (!wr && (st.st_size < len))
+		{
+			DBG1(daemon_di, "Daemon: client file shorter than %d "
+			     "bytes\n", len);
+			return -1;
+		}
+
+		b->data = mmap(NULL, len, wr ? PROT_READ | PROT_WRITE :
+			       PROT_READ, MAP_SHARED, fd, 0);
+		if (b->data != MAP_FAILED)
+		{
+			b->mapped = 1;
+			return 0;
+		}
+	}
+
+	if ((fd == -1) && (len > DAEMON_MAX_INLINE))
+	{
+		DBG1(daemon_di, "Daemon: %d bytes too long to pass inline\n",
+		     len);
+		return -1;
+	}
+
+	b->data = malloc(len);
+	if (b->data == NULL)
+	{
+		DBGE(daemon_di, "Daemon: can't allocate %d bytes\n", len);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Frees a request or reply data buffer
+ * @param b The buffer
+ */
+static void daemon_buf_put(daemon_buf_t *b)
+{
+	if (b->mapped)
+		munmap(b->data, b->len);
+	else
+		free(b->data);
+	b->data = NULL;
+}
+
+/**
+ * Executes a request on the device
+ * @param dd The device, locked by the caller
+ * @param req The request
+ * @param in Request data
+ * @param out Reply data buffer, set up here
+ * @param fd Client's fd for the reply data, or -1
+ * @returns 0 if OK, <0 on error
+ */
+static int daemon_exec(daemon_dev_t *dd, daemon_req_t *req, daemon_buf_t *in,
+		       daemon_buf_t *out, int fd)
+{
+	devinfo_t *di = &dd->di;
+	bootfile_info_t binf;
+	daemon_info_t info;
+	int ret;
+
+	switch (req->op)
+	{
+	case DAEMON_OP_INFO:
+		info.ndevs = daemon_ndevs;
+		info.ppb = di->ppb;
+		info.ps = di->ps;
+		info.bs = di->bs;
+		info.tb = di->tb;
+		if (daemon_buf_get(out, fd, sizeof(info), 1))
+			return -1;
+		memcpy(out->data, &info, sizeof(info));
+		return 0;
+	case DAEMON_OP_RAMREAD:
+		if (daemon_buf_get(out, fd, req->len, 1))
+			return -1;
+		return cmd_read_mem(di, req->addr, req->len, out->data);
+	case DAEMON_OP_RAMWRITE:
+		return cmd_write_mem(di, req->addr, in->len, in->data);
+	case DAEMON_OP_FLASHREAD:
+		if (daemon_buf_get(out, fd, req->len, 1))
+			return -1;
+		return image_read_usb(di, req->addr, out->data, req->len);
+	case DAEMON_OP_FLASHWRITE:
+		return image_write_random_usb(di, req->addr, in->data,
+					      in->len);
+	case DAEMON_OP_ERASE:
+		if ((req->arg == 0) || (req->addr / di->ppb >= di->tb) ||
+		    (req->arg > di->tb - req->addr / di->ppb))
+			return -1;
+		return cmd_erase_blocks(di, req->addr, req->arg);
+	case DAEMON_OP_BOOTFILEINFO:
+	case DAEMON_OP_BOOTFILEREAD:
+		ret = image_get_bootfile_info_usb(di, req->addr, &binf);
+		if (ret)
+			return -1;
+		if (req->op == DAEMON_OP_BOOTFILEINFO)
+		{
+			if (daemon_buf_get(out, fd, sizeof(binf), 1))
+				return -1;
+			memcpy(out->data, &binf, sizeof(binf));
+			return 0;
+		}
+		/* The PAT comes from the device, don't trust its size */
+		if ((binf.size == 0) || (binf.size > image_bootfile_maxlen(di)))
+			return -1;
+		if (daemon_buf_get(out, fd,
+				   di->ps * (((binf.size - 1) / di->ps) + 1), 1))
+			return -1;
+		return image_get_bootfile_usb(di, req->addr, out->data);
+	case DAEMON_OP_BOOTFILEWRITE:
+		return image_write_bootfile_usb(di, BOOTFILE_DEFAULT_ID,
+						req->addr, req->arg,
+						in->data, in->len);
+	}
+
+	return -1;
+}
+
+/**
+ * Estimates how many bytes a request moves over USB, so the devices with
+ * the most work get the bus first
+ * @param req The request
+ * @returns Number of bytes
+ */
+static int64_t daemon_cost(daemon_req_t *req)
+{
+	switch (req->op)
+	{
+	case DAEMON_OP_RAMREAD:
+	case DAEMON_OP_RAMWRITE:
+	case DAEMON_OP_FLASHREAD:
+		return req->len;
+	case DAEMON_OP_FLASHWRITE:
+	case DAEMON_OP_BOOTFILEWRITE:
+		/* Programmed and read back */
+		return 2 * (int64_t)req->len;
+	}
+
+	return 0;
+}
+
+/**
+ * Handles one request of a client
+ * @param sock Client socket
+ * @param req The request
+ * @param fd The fd passed with the request, or -1
+ * @returns 0 if OK (even if the operation failed), <0 if the connection
+ *	    has to be dropped
+ */
+static int daemon_handle(int sock, daemon_req_t *req, int fd)
+{
+	daemon_buf_t in, out;
+	daemon_rsp_t rsp;
+	daemon_dev_t *dd;
+	uint64_t moved;
+	int64_t cost;
+	int wrop, ret;
+
+	memset(&out, 0, sizeof(out));
+
+	wrop = (req->op == DAEMON_OP_RAMWRITE) ||
+	       (req->op == DAEMON_OP_FLASHWRITE) ||
+	       (req->op == DAEMON_OP_BOOTFILEWRITE);
+
+	/* Take the request data first, so a slow client doesn't hold up
+	 * the device. Data passed in a file isn't on the socket, so the
+	 * connection is still usable if it can't be taken. */
+	if (daemon_buf_get(&in, fd, wrop ? req->len : 0, 0))
+	{
+		if (fd == -1)
+			return -1;
+		rsp.magic = DAEMON_MAGIC;
+		rsp.status = -1;
+		rsp.len = 0;
+		return daemon_io(sock, (char *)&rsp, sizeof(rsp), 1);
+	}
+	if (wrop && !in.mapped &&
+	    daemon_io((fd != -1) ? fd : sock, in.data, in.len, 0))
+	{
+		daemon_buf_put(&in);
+		return -1;
+	}
+
+	DBG1(daemon_di, "Daemon: dev %d op %d addr %08X len %08X arg %08X\n",
+	     req->dev, req->op, req->addr, req->len, req->arg);
+
+	if ((req->dev < daemon_ndevs) && (req->op < DAEMON_OP_LAST))
+	{
+		dd = &daemon_devs[req->dev];
+		cost = daemon_cost(req);
+		sched_add_work(&dd->di, cost);
+
+		daemon_dev_lock(dd);
+		moved = sched_bytes(&dd->di);
+		ret = daemon_exec(dd, req, &in, &out, fd);
+
+		/* Transfers took what they moved off, drop the estimate */
+		sched_add_work(&dd->di, sched_bytes(&dd->di) - moved - cost);
+		daemon_dev_unlock(dd);
+	}
+	else
+		ret = -1;
+
+	daemon_buf_put(&in);
+
+	rsp.magic = DAEMON_MAGIC;
+	rsp.status = ret ? -1 : 0;
+	rsp.len = ret ? 0 : out.len;
+
+	ret = daemon_io(sock, (char *)&rsp, sizeof(rsp), 1);
+	if (!ret && rsp.len && !out.mapped)
+		ret = daemon_io((fd != -1) ? fd : sock, out.data, out.len, 1);
+
+	daemon_buf_put(&out);
+	return ret;
+}
+
+/**
+ * Thread serving one client connection
+ * @param arg The client socket
+ * @returns NULL
+ */
+static void *daemon_client(void *arg)
+{
+	int sock = (intptr_t)arg;
+	daemon_req_t req;
+	int fd, ret;
+
+	DBG1(daemon_di, "Daemon: client connected\n");
+
+	while (!daemon_recv_req(sock, &req, &fd))
+	{
+		ret = daemon_handle(sock, &req, fd);
+		if (fd != -1)
+			close(fd);
+		if (ret)
+			break;
+	}
+
+	DBG1(daemon_di, "Daemon: client disconnected\n");
+	close(sock);
+	return NULL;
+}
+
+/**
+ * Opens and sets up all attached devices, with the options of the daemon
+ * @returns 0 if OK, <0 on error
+ */
+static int daemon_open_devs(void)
+{
+	daemon_dev_t *dd;
+	int ret;
+
+	while (daemon_ndevs < DAEMON_MAX_DEVS)
+	{
+		dd = &daemon_devs[daemon_ndevs];
+		memset(dd, 0, sizeof(daemon_dev_t));
+
+		/* Only the options are shared, the helper is freed by the
+		 * device that finds it doesn't work */
+		dd->di = *daemon_di;
+		dd->di.journalpath = NULL;
+		if (helper_copy(&dd->di, daemon_di))
+			return -1;
+
+		ret = usb_spmp8000_open(&dd->di, daemon_ndevs);
+		if (ret > 0)
+		{
+			helper_free(&dd->di);
+			break;
+		}
+		if (ret < 0)
+		{
+			helper_free(&dd->di);
+			return -1;
+		}
+
+		ret = sb_setup(&dd->di);
+		if (!ret)
+			ret = sched_attach(&dd->di);
+		if (ret)
+		{
+			sb_close(&dd->di);
+			helper_free(&dd->di);
+			return -1;
+		}
+
+		pthread_mutex_init(&dd->lock, NULL);
+		pthread_cond_init(&dd->cond, NULL);
+		daemon_ndevs++;
+	}
+
+	if (daemon_ndevs == 0)
+	{
+		DBGE(daemon_di, "Could not find SPMP8000 device\n");
+		return -1;
+	}
+
+	DBG(daemon_di, "- Serving %d device(s)\n", daemon_ndevs);
+	return 0;
+}
+
+/**
+ * Runs the daemon, keeping all attached devices open and serving requests
+ * on a Unix domain socket until SIGINT or SIGTERM
+ * Every client gets its own thread, requests for the same device are
+ * queued and served in arrival order. Devices on the same USB bus take
+ * turns for their transfers, see sb_sched.c.
+ * @param sockpath Path of the socket to create
+ * @param opts Context with the options and log sink to use for the devices
+ * @returns 0 if OK, <0 on error
+ */
+int daemon_run(char *sockpath, devinfo_t *opts)
+{
+	struct sockaddr_un sa;
+	struct sigaction sact;
+	sigset_t sigs, oldsigs;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int lsock, csock, i, ret = 0;
+
+	daemon_di = opts;
+
+	if (strlen(sockpath) >= sizeof(sa.sun_path))
+	{
+		DBGE(daemon_di, "Socket path too long\n");
+		return -1;
+	}
+
+	if (daemon_open_devs())
+		goto out;
+
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lsock == -1)
+	{
+		DBGE(daemon_di, "Can't create socket: %s\n", strerror(errno));
+		goto out;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, sockpath);
+	unlink(sockpath);
+
+	if (bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(lsock, DAEMON_BACKLOG))
+	{
+		DBGE(daemon_di, "Can't listen on %s: %s\n", sockpath,
+		     strerror(errno));
+		close(lsock);
+		goto out;
+	}
+
+	/* No SA_RESTART, so accept() returns when stopped */
+	memset(&sact, 0, sizeof(sact));
+	sact.sa_handler = daemon_sighandler;
+	sigaction(SIGINT, &sact, NULL);
+	sigaction(SIGTERM, &sact, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Signals are handled by this thread only */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	DBG(daemon_di, "- Listening on %s\n", sockpath);
+
+	while (!daemon_stop)
+	{
+		csock = accept(lsock, NULL, NULL);
+		if (csock == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			DBGE(daemon_di, "Can't accept client: %s\n",
+			     strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+		if (pthread_create(&thread, &attr, daemon_client,
+				   (void *)(intptr_t)csock))
+		{
+			DBGE(daemon_di, "Can't start client thread\n");
+			close(csock);
+		}
+		pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+	}
+
+	DBG(daemon_di, "- Stopping daemon\n");
+
+	pthread_attr_destroy(&attr);
+	close(lsock);
+	unlink(sockpath);
+
+	/* Wait for running operations, then leave the devices locked */
+	for (i = 0; i < daemon_ndevs; i++)
+	{
+		daemon_dev_lock(&daemon_devs[i]);
+		sb_close(&daemon_devs[i].di);
+		helper_free(&daemon_devs[i].di);
+	}
+
+	return ret;
+
+out:
+	for (i = 0; i < daemon_ndevs; i++)
+	{
+		sb_close(&daemon_devs[i].di);
+		helper_free(&daemon_devs[i].di);
+	}
+	return -1;
+}
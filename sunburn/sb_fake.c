@@ -0,0 +1,831 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define FAKE_RAM_CHUNK		0x10000
+#define FAKE_MAX_JOBS		8	/* Queued flasher stub jobs */
+#define FAKE_DEVID		"SBFAKE01"
+
+typedef struct fakeram
+{
+	uint32_t addr;		/**< Address of the chunk, FAKE_RAM_CHUNK aligned */
+	char *data;
+	struct fakeram *next;
+} fakeram_t;
+
+struct fake
+{
+	devinfo_t *di;		/**< Context the device is opened in */
+	int fd;			/**< Backing file holding the flash pages */
+	uint64_t flashlen;	/**< Bytes of flash stored in the file */
+	unsigned int ppb;	/**< Pages per block */
+	unsigned int ps;	/**< Page size */
+	unsigned int tb;	/**< Total num of blocks */
+	unsigned int lat;	/**< Latency of a transaction, usecs */
+	unsigned int mbps;	/**< Transfer rate in MB/s, 0 for unlimited */
+	unsigned int tprog;	/**< Page program time, usecs */
+	unsigned int terase;	/**< Block erase time, usecs */
+	char *pagebuf;		/**< Page being programmed */
+	char *erased;		/**< Block of 0xFF bytes */
+	fake_srcfn_t srcfn;	/**< Reads pages not in the file yet, or NULL */
+	void *srcarg;		/**< Argument of srcfn */
+	char *have;		/**< Pages in the file, if there's a source */
+	char *srcbuf;		/**< Page read from the source */
+	fakeram_t *ram;		/**< RAM chunks written so far */
+	unsigned long nread, nwrite, nerase, nhelper;
+	unsigned long ndevread;	/**< Pages read by the helper or stub */
+
+	/* Flasher stub jobs, run by a thread standing in for the device CPU */
+	pthread_mutex_t lock;	/**< Protects everything above */
+	pthread_cond_t cond;
+	pthread_t stub;		/**< Thread running the jobs */
+	int stubup;		/**< Thread started */
+	int stop;		/**< Thread to exit once the queue is empty */
+	uint32_t jobs[FAKE_MAX_JOBS];	/**< Parameter block addresses */
+	int njobs, jobhead;
+};
+
+/**
+ * Returns the RAM chunk holding an address
+ * @param f The fake device
+ * @param addr The address
+ * @param create Allocate the chunk if it doesn't exist yet
+ * @returns The chunk, NULL if it doesn't exist
+ */
+static fakeram_t *fake_ram_chunk(fake_t *f, uint32_t addr, int create)
+{
+	fakeram_t *r;
+
+	addr &= ~(FAKE_RAM_CHUNK - 1);
+	for (r = f->ram; r; r = r->next)
+		if (r->addr == addr)
+			return r;
+
+	if (!create)
+		return NULL;
+
+	r = calloc(1, sizeof(fakeram_t));
+	if (r == NULL)
+		return NULL;
+	r->data = calloc(1, FAKE_RAM_CHUNK);
+	if (r->data == NULL)
+	{
+		free(r);
+		return NULL;
+	}
+	r->addr = addr;
+	r->next = f->ram;
+	f->ram = r;
+
+	return r;
+}
+
+/**
+ * Copies between device RAM and a buffer, unwritten RAM reads as zero
+ * @param f The fake device
+ * @param addr Device address
+ * @param buf Host buffer
+ * @param len Length to copy
+ * @param write Copy to device RAM if set
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_ram_copy(fake_t *f, uint32_t addr, char *buf, int len,
+			 int write)
+{
+	fakeram_t *r;
+	int off, n;
+
+	while (len > 0)
+	{
+		off = addr & (FAKE_RAM_CHUNK - 1);
+		n = FAKE_RAM_CHUNK - off;
+		if (n > len)
+			n = len;
+
+		r = fake_ram_chunk(f, addr, write);
+		if (write)
+		{
+			if (r == NULL)
+				return -1;
+			memcpy(r->data + off, buf, n);
+		}
+		else if (r)
+			memcpy(buf, r->data + off, n);
+		else
+			memset(buf, 0, n);
+
+		addr += n;
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes to the backing file, filling any gap after its end as erased
+ * @param f The fake device
+ * @param off Offset in flash
+ * @param buf Data to write
+ * @param len Length to write
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_flash_put(fake_t *f, uint64_t off, char *buf, int len)
+{
+	int n;
+
+	while (f->flashlen < off)
+	{
+		n = (off - f->flashlen < f->ppb * f->ps) ? off - f->flashlen :
+							   f->ppb * f->ps;
+		if (pwrite(f->fd, f->erased, n, f->flashlen) != n)
+			return -1;
+		f->flashlen += n;
+	}
+
+	if (pwrite(f->fd, buf, len, off) != len)
+		return -1;
+	if (off + len > f->flashlen)
+		f->flashlen = off + len;
+
+	return 0;
+}
+
+/**
+ * Marks the pages of a range as being in the backing file, so they aren't
+ * taken from the source device
+ * @param f The fake device
+ * @param off Offset in flash
+ * @param len Length of the range
+ */
+static void fake_flash_have(fake_t *f, uint64_t off, int len)
+{
+	if (f->srcfn && len)
+		memset(f->have + off / f->ps, 1,
+		       (off + len - 1) / f->ps - off / f->ps + 1);
+}
+
+/**
+ * Copies the pages of a range that aren't in the backing file yet from
+ * the source device
+ * @param f The fake device
+ * @param off Offset in flash
+ * @param len Length of the range
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_flash_fetch(fake_t *f, uint64_t off, int len)
+{
+	uint32_t page, last;
+
+	if ((f->srcfn == NULL) || (len == 0))
+		return 0;
+
+	last = (off + len - 1) / f->ps;
+	for (page = off / f->ps; page <= last; page++)
+	{
+		if (f->have[page])
+			continue;
+		if (f->srcfn(f->srcarg, page, f->srcbuf) ||
+		    fake_flash_put(f, (uint64_t)page * f->ps, f->srcbuf, f->ps))
+			return -1;
+		f->have[page] = 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads from the backing file, flash beyond its end reads as erased
+ * @param f The fake device
+ * @param off Offset in flash
+ * @param buf Buffer to fill
+ * @param len Length to read
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_flash_load(fake_t *f, uint64_t off, char *buf, int len)
+{
+	int n = 0;
+
+	if (fake_flash_fetch(f, off, len))
+		return -1;
+
+	if (off < f->flashlen)
+	{
+		n = (f->flashlen - off < len) ? f->flashlen - off : len;
+		if (pread(f->fd, buf, n, off) != n)
+			return -1;
+	}
+
+	memset(buf + n, 0xFF, len - n);
+	return 0;
+}
+
+/**
+ * Writes to the flash of the fake device
+ * @param f The fake device
+ * @param off Offset in flash
+ * @param buf Data to write
+ * @param len Length to write
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_flash_store(fake_t *f, uint64_t off, char *buf, int len)
+{
+	if (fake_flash_fetch(f, off, len))
+		return -1;
+
+	return fake_flash_put(f, off, buf, len);
+}
+
+/**
+ * Waits until a transaction took as long as it would on the device
+ * @param f The fake device
+ * @param start Start of the transaction
+ * @param len Bytes transferred
+ * @param busy Flash busy time of the operation, usecs
+ */
+static void fake_delay(fake_t *f, struct timespec *start, uint32_t len,
+		       unsigned int busy)
+{
+	uint64_t ns = (f->lat + busy) * 1000ULL;
+
+	if (f->mbps)
+		ns += len * 1000ULL / f->mbps;
+	if (ns == 0)
+		return;
+
+	start->tv_nsec += ns % 1000000000ULL;
+	start->tv_sec += ns / 1000000000ULL + start->tv_nsec / 1000000000L;
+	start->tv_nsec %= 1000000000L;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, start, NULL) ==
+	       EINTR)
+		;
+}
+
+/**
+ * Sleeps for the busy time of a flash operation
+ * @param us Time in usecs
+ */
+static void fake_busy(unsigned int us)
+{
+	struct timespec ts;
+
+	if (us == 0)
+		return;
+
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000L;
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+/**
+ * Runs a program job of the flasher stub: erases the blocks, programs the
+ * pages from the staging buffer and reads them back for verifying
+ * Called with the lock held, which is dropped while the flash is busy so
+ * the USB side carries on.
+ * @param f The fake device
+ * @param addr Address of the parameter block
+ * @param page Buffer of a page
+ * @param veri Buffer of a page for verifying
+ */
+static void fake_stub_job(fake_t *f, uint32_t addr, char *page, char *veri)
+{
+	helper_param_t p;
+	uint32_t first, npages, buf, i, j, status = HELPER_STATUS_ERROR;
+	uint64_t off;
+
+	if (fake_ram_copy(f, addr, (char *)&p, sizeof(p), 0))
+		return;
+
+	first = le32toh(p.firstpage);
+	npages = le32toh(p.npages);
+	buf = le32toh(p.buf);
+
+	for (i = 0; i < npages; i++)
+	{
+		if ((le32toh(p.pagesize) != f->ps) || (first % f->ppb) ||
+		    (npages % f->ppb) || (first + npages > f->tb * f->ppb))
+			break;
+
+		off = (uint64_t)(first + i) * f->ps;
+		if ((i % f->ppb) == 0)
+		{
+			fake_flash_have(f, off, f->ppb * f->ps);
+			if ((off < f->flashlen) &&
+			    fake_flash_store(f, off, f->erased, f->ppb * f->ps))
+				break;
+			f->nerase++;
+			pthread_mutex_unlock(&f->lock);
+			fake_busy(f->terase);
+			pthread_mutex_lock(&f->lock);
+		}
+
+		/* The block is erased, so the page is stored as it is */
+		if (fake_ram_copy(f, buf + i * f->ps, page, f->ps, 0) ||
+		    fake_flash_store(f, off, page, f->ps) ||
+		    fake_flash_load(f, off, veri, f->ps))
+			break;
+		f->nwrite++;
+		f->ndevread++;
+
+		pthread_mutex_unlock(&f->lock);
+		fake_busy(f->tprog);
+		j = memcmp(page, veri, f->ps);
+		pthread_mutex_lock(&f->lock);
+		if (j)
+			break;
+	}
+
+	if (i == npages)
+		status = HELPER_STATUS_DONE;
+
+	p.status = htole32(status);
+	p.count = htole32(i);
+	fake_ram_copy(f, addr, (char *)&p, sizeof(p), 1);
+}
+
+/**
+ * Flasher stub thread, runs the queued jobs in order
+ * @param arg The fake device
+ * @returns NULL
+ */
+static void *fake_stub_thread(void *arg)
+{
+	fake_t *f = arg;
+	char *page, *veri;
+	uint32_t addr;
+
+	page = malloc(2 * f->ps);
+	veri = page + f->ps;
+
+	pthread_mutex_lock(&f->lock);
+	for (;;)
+	{
+		while ((f->njobs == 0) && !f->stop)
+			pthread_cond_wait(&f->cond, &f->lock);
+		if (f->njobs == 0)
+			break;
+
+		addr = f->jobs[f->jobhead];
+		if (page)
+			fake_stub_job(f, addr, page, veri);
+		f->jobhead = (f->jobhead + 1) % FAKE_MAX_JOBS;
+		f->njobs--;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	free(page);
+	return NULL;
+}
+
+/**
+ * Queues a program job for the flasher stub thread, the device returns
+ * from EXECUTE while it runs
+ * @param f The fake device
+ * @param addr Address of the parameter block
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_stub_queue(fake_t *f, uint32_t addr)
+{
+	if (f->njobs == FAKE_MAX_JOBS)
+		return -1;
+
+	if (!f->stubup)
+	{
+		if (pthread_create(&f->stub, NULL, fake_stub_thread, f))
+			return -1;
+		f->stubup = 1;
+	}
+
+	f->jobs[(f->jobhead + f->njobs) % FAKE_MAX_JOBS] = addr;
+	f->njobs++;
+	pthread_cond_signal(&f->cond);
+
+	return 0;
+}
+
+/**
+ * Runs the checksum helper if the code at addr is one, like the real
+ * helper would on the device, see sb_helper.c
+ * @param f The fake device
+ * @param addr Address EXECUTE jumps to
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_helper_run(fake_t *f, uint32_t addr)
+{
+	helper_hdr_t hdr;
+	helper_param_t p;
+	uint32_t first, npages, per, n, i, j, crc, status;
+	uint64_t off;
+
+	if (fake_ram_copy(f, HELPER_LOAD_ADDR, (char *)&hdr, sizeof(hdr), 0))
+		return -1;
+
+	/* Other code, nothing to emulate */
+	if ((le32toh(hdr.magic) != HELPER_MAGIC) ||
+	    (addr != HELPER_LOAD_ADDR + le32toh(hdr.entry)))
+		return 0;
+
+	if (fake_ram_copy(f, le32toh(hdr.param), (char *)&p, sizeof(p), 0))
+		return -1;
+
+	first = le32toh(p.firstpage);
+	npages = le32toh(p.npages);
+	per = le32toh(p.pagesper);
+	status = HELPER_STATUS_ERROR;
+	n = 0;
+
+	/* Program jobs are copied to the parameter block of their staging
+	 * buffer and run in the background */
+	if ((le32toh(p.magic) == HELPER_PARAM_MAGIC) &&
+	    (le32toh(p.cmd) == HELPER_CMD_PROGRAM) && hdr.stagelen)
+	{
+		i = (le32toh(p.buf) - le32toh(hdr.stage)) /
+		    le32toh(hdr.stagelen);
+		if ((i >= HELPER_NSTAGES) ||
+		    (npages * f->ps > le32toh(hdr.stagelen)))
+			goto out;
+
+		addr = le32toh(hdr.jobs) + i * sizeof(helper_param_t);
+		p.status = htole32(HELPER_STATUS_BUSY);
+		if (fake_ram_copy(f, addr, (char *)&p, sizeof(p), 1) ||
+		    fake_stub_queue(f, addr))
+			goto out;
+		status = HELPER_STATUS_DONE;
+		goto out;
+	}
+
+	if ((le32toh(p.magic) != HELPER_PARAM_MAGIC) ||
+	    (le32toh(p.cmd) != HELPER_CMD_CRC32C) ||
+	    (le32toh(p.pagesize) != f->ps) || (per == 0) ||
+	    (first + npages > f->tb * f->ppb) ||
+	    ((npages + per - 1) / per > le32toh(hdr.tablemax)))
+		goto out;
+
+	for (i = 0; i < npages; i += per)
+	{
+		crc = 0;
+		for (j = i; (j < i + per) && (j < npages); j++)
+		{
+			off = (uint64_t)(first + j) * f->ps;
+			if (fake_flash_load(f, off, f->pagebuf, f->ps))
+				goto out;
+			crc = crc32c(crc, f->pagebuf, f->ps);
+			f->ndevread++;
+		}
+		crc = htole32(crc);
+		if (fake_ram_copy(f, le32toh(hdr.table) + n * 4, (char *)&crc,
+				  sizeof(crc), 1))
+			goto out;
+		n++;
+	}
+	status = HELPER_STATUS_DONE;
+
+out:
+	p.status = htole32(status);
+	p.count = htole32(n);
+	f->nhelper++;
+	return fake_ram_copy(f, le32toh(hdr.param), (char *)&p, sizeof(p), 1);
+}
+
+/**
+ * Executes a transaction on the fake device, called by usb_txn()
+ * @param f The fake device
+ * @param cmd Command to be sent
+ * @param addr Address to be sent
+ * @param len Length of data
+ * @param data Data buffer, read or written depending on flag
+ * @param flag SCSI_FLAG_READ or SCSI_FLAG_WRITE
+ * @returns 0 if OK, <0 on error
+ */
+int fake_txn(fake_t *f, uint32_t cmd, uint32_t addr, uint32_t len,
+	     char *data, uint8_t flag)
+{
+	struct timespec start;
+	nandconf_t nc;
+	unsigned int busy = 0;
+	uint64_t off = (uint64_t)addr * f->ps;
+	int i, ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&f->lock);
+	switch (cmd)
+	{
+		case CMD_USB_RAMREAD:
+			ret = fake_ram_copy(f, addr, data, len, 0);
+			break;
+		case CMD_USB_RAMWRITE:
+			ret = fake_ram_copy(f, addr, data, len, 1);
+			break;
+		case CMD_USB_FLASHCONFREAD:
+			memset(&nc, 0, sizeof(nandconf_t));
+			nc.pagesperblock = htole16(f->ppb);
+			nc.pagesize = htole16(f->ps + f->ps / 32);
+			nc.payloadlen = htole16(f->ps);
+			nc.totalblocks = htole16(f->tb);
+			memcpy(data, &nc, (len < sizeof(nc)) ? len : sizeof(nc));
+			break;
+		case CMD_USB_FLASHREAD:
+			if ((addr >= f->tb * f->ppb) || (len > f->ps))
+			{
+				ret = -1;
+				break;
+			}
+			ret = fake_flash_load(f, off, data, len);
+			f->nread++;
+			break;
+		case CMD_USB_FLASHWRITE:
+			if ((addr >= f->tb * f->ppb) || (len > f->ps))
+			{
+				ret = -1;
+				break;
+			}
+			/* Programming can only clear bits */
+			ret = fake_flash_load(f, off, f->pagebuf, len);
+			for (i = 0; i < len; i++)
+				f->pagebuf[i] &= data[i];
+			if (!ret)
+				ret = fake_flash_store(f, off, f->pagebuf, len);
+			busy = f->tprog;
+			f->nwrite++;
+			break;
+		case CMD_USB_FLASHBLKERASE:
+			if (addr >= f->tb * f->ppb)
+			{
+				ret = -1;
+				break;
+			}
+			off = (uint64_t)(addr / f->ppb) * f->ppb * f->ps;
+			fake_flash_have(f, off, f->ppb * f->ps);
+			if (off < f->flashlen)
+				ret = fake_flash_store(f, off, f->erased,
+						       f->ppb * f->ps);
+			busy = f->terase;
+			f->nerase++;
+			break;
+		case CMD_USB_EXECUTE:
+			ret = fake_helper_run(f, addr);
+			break;
+		case CMD_USB_BYPASSBR:
+		case CMD_USB_BRVERINFO:
+		case CMD_USB_DRAMINIT:
+		case CMD_USB_FLASHCONFSEND:
+			/* The fake keeps its own geometry */
+			break;
+		default:
+			DBGE(f->di, "Fake device: unsupported command %08X\n", cmd);
+			ret = -1;
+			break;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	if (ret)
+		return -1;
+
+	fake_delay(f, &start, data ? len : 0, busy);
+
+	return 0;
+}
+
+/**
+ * Parses one key=value setting of the fake device spec
+ * @param f The fake device
+ * @param opt The setting
+ * @returns 0 if OK, <0 on error
+ */
+static int fake_parse_opt(fake_t *f, char *opt)
+{
+	static const struct
+	{
+		char *name;
+		size_t offset;
+	} opts[] =
+	{
+		{ "ppb",	offsetof(fake_t, ppb) },
+		{ "ps",		offsetof(fake_t, ps) },
+		{ "tb",		offsetof(fake_t, tb) },
+		{ "lat",	offsetof(fake_t, lat) },
+		{ "mbps",	offsetof(fake_t, mbps) },
+		{ "prog",	offsetof(fake_t, tprog) },
+		{ "erase",	offsetof(fake_t, terase) },
+	};
+	char *val, *end;
+	int i;
+
+	val = strchr(opt, '=');
+	if (val == NULL)
+		return -1;
+	*val++ = 0;
+
+	for (i = 0; i < sizeof(opts) / sizeof(opts[0]); i++)
+	{
+		if (strcmp(opt, opts[i].name))
+			continue;
+		*(unsigned int *)((char *)f + opts[i].offset) =
+			strtoul(val, &end, 0);
+		return *end ? -1 : 0;
+	}
+
+	return -1;
+}
+
+/**
+ * Opens a fake device backed by a flash image file instead of USB
+ * The spec is the filename optionally followed by comma separated
+ * settings: ppb, ps and tb for the geometry, lat for the transaction latency
+ * in usecs, mbps for the transfer rate, prog and erase for the page program
+ * and block erase times in usecs.
+ * @param di Device info struct to attach the fake device to
+ * @param spec The file and settings, e.g. "flash.img,lat=125,mbps=20"
+ * @returns 0 if OK, <0 on error
+ */
+int fake_open(devinfo_t *di, char *spec)
+{
+	fake_t *f;
+	char *s, *opt, *save;
+	struct stat st;
+
+	s = strdup(spec);
+	f = calloc(1, sizeof(fake_t));
+	if ((s == NULL) || (f == NULL))
+		goto fail;
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	f->di = di;
+	f->fd = -1;
+	f->ppb = 128;
+	f->ps = 4096;
+	f->tb = 1024;
+
+	opt = strtok_r(s, ",", &save);
+	while ((opt = strtok_r(NULL, ",", &save)) != NULL)
+	{
+		if (fake_parse_opt(f, opt))
+		{
+			DBGE(di, "Invalid fake device setting: %s\n", opt);
+			goto fail;
+		}
+	}
+
+	if ((f->ppb == 0) || (f->ps == 0) || (f->tb == 0))
+	{
+		DBGE(di, "Invalid fake device geometry\n");
+		goto fail;
+	}
+
+	f->fd = open(s, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if ((f->fd == -1) || fstat(f->fd, &st))
+	{
+		DBGE(di, "Can't open fake device file %s: %s\n", s,
+		     strerror(errno));
+		goto fail;
+	}
+	f->flashlen = st.st_size;
+
+	f->pagebuf = malloc(f->ps);
+	f->erased = malloc(f->ppb * f->ps);
+	if ((f->pagebuf == NULL) || (f->erased == NULL))
+		goto fail;
+	memset(f->erased, 0xFF, f->ppb * f->ps);
+
+	if (fake_ram_copy(f, DEVICE_ID_LOCATION, FAKE_DEVID, DEVICE_ID_LENGTH,
+			  1))
+		goto fail;
+
+	DBG1(di, "Fake device %s: %u blocks of %u pages of %u bytes\n", s, f->tb,
+	     f->ppb, f->ps);
+
+	free(s);
+	di->fake = f;
+	return 0;
+
+fail:
+	free(s);
+	fake_close(f);
+	return -1;
+}
+
+/**
+ * Sets the device a fake device stands in for, the flash reads as that
+ * device until the fake erases or programs it
+ * Pages are read from the source on first access and kept in the backing
+ * file, which should start out empty.
+ * @param f The fake device
+ * @param fn Reads a page of the source, called with the fake device locked
+ * @param arg Argument passed to fn
+ * @returns 0 if OK, <0 on error
+ */
+int fake_set_source(fake_t *f, fake_srcfn_t fn, void *arg)
+{
+	f->have = calloc(f->tb * f->ppb, 1);
+	f->srcbuf = malloc(f->ps);
+	if ((f->have == NULL) || (f->srcbuf == NULL))
+	{
+		free(f->have);
+		free(f->srcbuf);
+		f->have = NULL;
+		f->srcbuf = NULL;
+		return -1;
+	}
+
+	f->srcfn = fn;
+	f->srcarg = arg;
+	return 0;
+}
+
+/**
+ * Returns the flash operations a fake device did so far
+ * @param f The fake device
+ * @param st Filled with the counts
+ */
+void fake_stats(fake_t *f, fakestats_t *st)
+{
+	pthread_mutex_lock(&f->lock);
+	st->nread = f->nread;
+	st->nwrite = f->nwrite;
+	st->nerase = f->nerase;
+	st->nhelper = f->nhelper;
+	st->ndevread = f->ndevread;
+	pthread_mutex_unlock(&f->lock);
+}
+
+/**
+ * Closes a fake device
+ * @param f The fake device, may be NULL
+ */
+void fake_close(fake_t *f)
+{
+	fakeram_t *r;
+
+	if (f == NULL)
+		return;
+
+	/* Let the flasher stub finish its jobs */
+	if (f->stubup)
+	{
+		pthread_mutex_lock(&f->lock);
+		f->stop = 1;
+		pthread_cond_signal(&f->cond);
+		pthread_mutex_unlock(&f->lock);
+		pthread_join(f->stub, NULL);
+	}
+
+	DBG1(f->di, "Fake device: %lu page reads, %lu page writes, %lu erases, "
+	     "%lu helper runs\n", f->nread, f->nwrite, f->nerase, f->nhelper);
+
+	while ((r = f->ram) != NULL)
+	{
+		f->ram = r->next;
+		free(r->data);
+		free(r);
+	}
+
+	if (f->fd != -1)
+		close(f->fd);
+	free(f->pagebuf);
+	free(f->erased);
+	free(f->have);
+	free(f->srcbuf);
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+	free(f);
+}
@@ -18,10 +18,14 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
  * MA  02110-1301, USA.
  */
+#define _GNU_SOURCE		/* O_DIRECT */
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -33,67 +37,399 @@
 
 #include "sb.h"
 
+#define FILE_OUT_BUFSIZE	(2 * 1024 * 1024)
+#define FILE_OUT_NBUFS		8
+#define FILE_DIRECT_ALIGN	4096
+
+#define FILE_IN_BUFSIZE		(4 * 1024 * 1024)
+#define FILE_IN_NBUFS		3
+
+#define FILE_RAM_XFER		(1024 * 1024)	/* Bytes per RAMWRITE */
+
+#define FILE_SCAN_SLOTS		32768	/* candidate pages per scan window */
+
 enum memtype {
 	RAM = 0,
 	FLASH
 };
 
+/**
+ * Input file that can't be mmapped, read through a buffer pool
+ * This is used for stdin, pipes and compressed files.
+ */
+typedef struct
+{
+	devinfo_t *di;		/**< Context errors are reported to */
+	int fd;			/**< Input file descriptor */
+	int bufsize;		/**< Size of the pool buffers, multiple of bs */
+	int first;		/**< Length to fill the first buffer to */
+	decomp_t *dc;		/**< Decompressor, NULL for raw input */
+	queue_t *q;		/**< Buffer pool between reader and USB thread */
+	pthread_t thread;	/**< Reader thread */
+	int err;		/**< Set by the reader thread on failure */
+} filein_t;
+
+/**
+ * Output file of a dump
+ * The USB reader fills large buffers that a writer thread writes out, or
+ * compresses, so disk stalls don't stall the USB link.
+ */
+typedef struct
+{
+	devinfo_t *di;		/**< Context errors are reported to */
+	int fd;			/**< Output file descriptor, -1 if none */
+	int direct;		/**< Output is still written with O_DIRECT */
+	hash_t *hash;		/**< Checksums of the data, NULL if none */
+	comp_t *comp;		/**< Compressor, NULL if writing raw data */
+	queue_t *q;		/**< Queue between reader and writer thread */
+	qbuf_t *cur;		/**< Buffer currently being filled */
+	pthread_t thread;	/**< Writer thread */
+	int err;		/**< Set by the writer thread on failure */
+} fileout_t;
+
+/**
+ * Writes a whole buffer to the output file
+ * O_DIRECT is switched off for good as soon as a write isn't aligned, as
+ * later file offsets won't be aligned either.
+ * @param out The output file
+ * @param data Data to write
+ * @param len Length of data
+ * @returns 0 if OK, <0 on error
+ */
+static int file_out_write_fd(fileout_t *out, char *data, int len)
+{
+	int ret;
+
+	if (out->direct && (len % FILE_DIRECT_ALIGN))
+	{
+		fcntl(out->fd, F_SETFL, fcntl(out->fd, F_GETFL) & ~O_DIRECT);
+		out->direct = 0;
+	}
+
+	while (len > 0)
+	{
+		ret = write(out->fd, data, len);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			DBGE(out->di, "Can't write to output file: %s\n",
+			     strerror(errno));
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Writer thread, checksums and writes out or compresses the buffers filled
+ * by the reader
+ * @param arg The fileout_t of the dump
+ * @returns NULL
+ */
+static void *file_out_thread(void *arg)
+{
+	fileout_t *out = arg;
+	qbuf_t *b;
+	int ret;
+
+	while ((b = queue_get_full(out->q)) != NULL)
+	{
+		if (out->hash)
+			hash_update(out->hash, b->data, b->len);
+
+		if (out->fd == -1)
+			ret = 0;
+		else if (out->comp)
+			ret = comp_write(out->comp, b->data, b->len);
+		else
+			ret = file_out_write_fd(out, b->data, b->len);
+
+		if (ret)
+		{
+			out->err = 1;
+			queue_abort(out->q);
+			break;
+		}
+		queue_put_free(out->q, b);
+	}
+
+	return NULL;
+}
+
+/**
+ * Opens a dump output file and starts its writer thread
+ * Data gets compressed if the filename ends in .zst or .xz, otherwise it's
+ * written with O_DIRECT if requested with the odirect option.
+ * @param out Output struct to fill
+ * @param di Context with the options, errors are reported to
+ * @param fname Path and filename to write to, NULL to only checksum
+ * @param hs Initialized hash state to update with the data, or NULL
+ * @returns 0 if OK, <0 on error
+ */
+static int file_out_open(fileout_t *out, devinfo_t *di, char *fname,
+			 hash_t *hs)
+{
+	enum comptype ct = COMP_NONE;
+	int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	memset(out, 0, sizeof(fileout_t));
+	out->di = di;
+	out->hash = hs;
+	out->fd = -1;
+
+	if (fname == NULL)
+		goto start;
+
+	ct = comp_type_from_name(fname);
+
+	if (di->odirect && (ct == COMP_NONE))
+	{
+		out->fd = open(fname, flags | O_DIRECT,
+			       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+		if (out->fd != -1)
+			out->direct = 1;
+		else
+			DBG1(di, "O_DIRECT not supported for %s\n", fname);
+	}
+
+	if (!out->direct)
+		out->fd = open(fname, flags,
+			       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (out->fd == -1)
+	{
+		DBGE(di, "Can't open output file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (ct != COMP_NONE)
+	{
+		out->comp = comp_open(di, out->fd, ct);
+		if (out->comp == NULL)
+			goto fail;
+		DBG1(di, "Compressing output with %s\n",
+		     (ct == COMP_ZSTD) ? "zstd" : "xz");
+	}
+
+start:
+	out->q = queue_create(FILE_OUT_NBUFS, FILE_OUT_BUFSIZE);
+	if (out->q == NULL)
+	{
+		DBGE(di, "Can't allocate buffer queue\n");
+		goto fail;
+	}
+
+	if (pthread_create(&out->thread, NULL, file_out_thread, out))
+	{
+		DBGE(di, "Can't start writer thread\n");
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	queue_destroy(out->q);
+	if (out->comp)
+		comp_close(out->comp, 0);
+	if (out->fd != -1)
+		close(out->fd);
+	return -1;
+}
+
+/**
+ * Gets space in the current output buffer to read data into
+ * @param out Output struct opened with file_out_open()
+ * @param len Length of space needed, at most FILE_OUT_BUFSIZE
+ * @returns Pointer to the space, NULL on error
+ */
+static char *file_out_getbuf(fileout_t *out, int len)
+{
+	if (out->cur && (FILE_OUT_BUFSIZE - out->cur->len < len))
+	{
+		queue_put_full(out->q, out->cur);
+		out->cur = NULL;
+	}
+
+	if (out->cur == NULL)
+	{
+		out->cur = queue_get_free(out->q);
+		if (out->cur == NULL)
+			return NULL;
+	}
+
+	return out->cur->data + out->cur->len;
+}
+
+/**
+ * Adds data placed in the space got with file_out_getbuf() to the output
+ * @param out Output struct opened with file_out_open()
+ * @param len Length of the data
+ */
+static void file_out_commit(fileout_t *out, int len)
+{
+	out->cur->len += len;
+
+	if (out->cur->len == FILE_OUT_BUFSIZE)
+	{
+		queue_put_full(out->q, out->cur);
+		out->cur = NULL;
+	}
+}
+
+/**
+ * Flushes and closes a dump output file
+ * @param out Output struct opened with file_out_open()
+ * @param ok 0 if the dump failed and the output is discarded anyway
+ * @returns 0 if OK, <0 on error
+ */
+static int file_out_close(fileout_t *out, int ok)
+{
+	int ret = 0;
+
+	if (out->cur && out->cur->len && ok)
+		queue_put_full(out->q, out->cur);
+
+	if (ok)
+		queue_close(out->q);
+	else
+		queue_abort(out->q);
+
+	pthread_join(out->thread, NULL);
+
+	if (out->err)
+		ret = -1;
+	if (out->comp && comp_close(out->comp, ok && !out->err))
+		ret = -1;
+	queue_destroy(out->q);
+
+	if (out->fd != -1)
+		close(out->fd);
+	return ret;
+}
+
+/**
+ * Writes checksum files next to an output file, in the format of the
+ * sha256sum tool
+ * The checksums are of the uncompressed data, so for a compressed file the
+ * listed name is that of the decompressed file.
+ * @param di Context errors are reported to
+ * @param fname Path and filename of the checksummed file
+ * @param hs Finished hash state
+ * @returns 0 if OK, <0 on error
+ */
+static int file_write_sums(devinfo_t *di, char *fname, hash_t *hs)
+{
+	char sumname[PATH_MAX];
+	char hex[65];
+	char *base;
+	int type, baselen;
+	FILE *f;
+
+	base = strrchr(fname, '/');
+	base = base ? base + 1 : fname;
+	baselen = strlen(base);
+	if (comp_type_from_name(base) == COMP_ZSTD)
+		baselen -= 4;
+	else if (comp_type_from_name(base) == COMP_XZ)
+		baselen -= 3;
+
+	for (type = HASH_CRC32C; type <= HASH_SHA256; type <<= 1)
+	{
+		if (!(hs->types & type))
+			continue;
+
+		snprintf(sumname, sizeof(sumname), "%s.%s", fname,
+			 hash_name(type));
+		f = fopen(sumname, "w");
+		if (f == NULL)
+		{
+			DBGE(di, "Can't open checksum file %s: %s\n", sumname,
+			     strerror(errno));
+			return -1;
+		}
+
+		hash_hex(hs, type, hex);
+		fprintf(f, "%s  %.*s\n", hex, baselen, base);
+		if (fclose(f))
+		{
+			DBGE(di, "Can't write checksum file %s\n", sumname);
+			return -1;
+		}
+		DBG1(di, "%s: %s\n", hash_name(type), hex);
+	}
+
+	return 0;
+}
+
 /**
  * Dumps a flash or mem region to a file
  * @param di Device info struct of opened and inited device
  * @param ramflash FILE_DUMP_RAM or FILE_DUMP_FLASH
  * @param addr Address to start dump from
  * @param len Length in bytes to dump
- * @param fname Path and filename to write to
+ * @param fname Path and filename to write to, NULL to only checksum
+ * @param hs Initialized hash state to checksum the data into, or NULL to
+ *	     write the checksums selected with the hashtypes option next to
+ *	     the file
  * @returns 0 if OK, <0 on error
  */
 static int file_mem_dump(devinfo_t *di, enum memtype ramflash, int addr,
-			 int len, char* fname)
+			 int len, char* fname, hash_t *hs)
 {
-	int fd, ret;
-	int wl = 0, poi = 0, i = 0;
-	char *pagebuf;
+	int ret;
+	int wl, poi = 0, skip = 0, i = 0;
+	char *buf;
 	flashoffsets_t fo;
+	fileout_t out;
+	hash_t sums;
 
-	fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC,
-		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	if (fd == -1)
+	if ((hs == NULL) && di->hashtypes)
 	{
-		DBGE("Can't open output file: %s\n", strerror(errno));
-		return -1;
+		hash_init(&sums, di->hashtypes);
+		hs = &sums;
 	}
 
-	pagebuf = malloc(di->ps);
-	if (pagebuf == NULL)
-	{
-		DBGE("Can't allocate space for page buffer\n");
-		close(fd);
+	ret = file_out_open(&out, di, fname, hs);
+	if (ret)
 		return -1;
-	}
 
 	if (ramflash == FLASH)
 	{
 		flash_offset_calc(di, &fo, addr, len);
-		poi = len;
+		skip = addr % di->ps;
+		progress_expect(di->prog, (uint64_t)fo.np * di->ps);
 	}
 	else
+	{
 		fo.np = 0;
+		progress_expect(di->prog, len);
+	}
 
-	DBG2("addr: %08X, len.%08X, fp: %08X, np: %08X\n", addr, len, fo.fp,
+	DBG2(di, "addr: %08X, len.%08X, fp: %08X, np: %08X\n", addr, len, fo.fp,
 	     fo.np);
 
-	while ((poi < len) || i < fo.np)
+	while (poi < len)
 	{
+		/* Pages are read straight into the output buffers */
+		buf = file_out_getbuf(&out, di->ps);
+		if (buf == NULL)
+			goto fail;
+
 		if (ramflash == FLASH)
 		{
-			ret = cmd_read_flash_page(di, fo.fp + i, pagebuf);
+			ret = cmd_read_flash_page(di, fo.fp + i, buf);
 
-			/* Whole page needs to be read, but only write part
-			 * of the last page if len is not multiple pagesize */
-			if (((i + 1) * di->ps) > len)
-				wl = len - ((i - 1) * di->ps);
-			else
-				wl = di->ps;
+			/* Whole page needs to be read, but only write the
+			 * requested part of the first and last page */
+			wl = di->ps - skip;
+			if (wl > len - poi)
+				wl = len - poi;
+			if (skip && !ret)
+				memmove(buf, buf + skip, wl);
+			skip = 0;
 
 			/* Next page */
 			i++;
@@ -107,34 +443,33 @@ static int file_mem_dump(devinfo_t *di, enum memtype ramflash, int addr,
 			else
 				wl = di->ps;
 
-			ret = cmd_read_mem(di, addr + poi, wl, pagebuf);
-
-			poi += wl;
+			ret = cmd_read_mem(di, addr + poi, wl, buf);
 		}
 
 		if (ret)
 		{
-			DBGE("Can't read %s\n", (ramflash == FLASH) ?
+			DBGE(di, "Can't read %s\n", (ramflash == FLASH) ?
 				"flash" : "memory");
 			goto fail;
 		}
 
-		ret = write(fd, pagebuf, wl);
-		if (ret < wl)
-		{
-			DBGE("Can't write to output file: %s\n",
-			     strerror(errno));
-			ret = -1;
-			goto fail;
-		}
+		file_out_commit(&out, wl);
+		poi += wl;
 	}
 
-	ret = 0;
+	ret = file_out_close(&out, 1);
+	if (ret || (hs == NULL))
+		return ret;
+
+	hash_final(hs);
+	if (hs == &sums)
+		ret = file_write_sums(di, fname, hs);
 
-fail:
-	free(pagebuf);
-	close(fd);
 	return ret;
+
+fail:
+	file_out_close(&out, 0);
+	return -1;
 }
 
 /**
@@ -147,7 +482,7 @@ fail:
  */ 
 inline int file_ram_dump(devinfo_t *di, int addr, int len, char* fname)
 {
-	return file_mem_dump(di, RAM, addr, len, fname);
+	return file_mem_dump(di, RAM, addr, len, fname, NULL);
 }
 
 /**
@@ -160,7 +495,65 @@ inline int file_ram_dump(devinfo_t *di, int addr, int len, char* fname)
  */
 inline int file_flash_dump(devinfo_t *di, int addr, int len, char* fname)
 {
-	return file_mem_dump(di, FLASH, addr, len, fname);
+	return file_mem_dump(di, FLASH, addr, len, fname, NULL);
+}
+
+/**
+ * Checksums a flash or mem region and prints the checksums selected with
+ * hashtypes, all of them if none selected
+ * @param di Device info struct of opened and inited device
+ * @param ramflash RAM or FLASH
+ * @param addr Address to start from
+ * @param len Length in bytes
+ * @returns 0 if OK, <0 on error
+ */
+static int file_mem_checksum(devinfo_t *di, enum memtype ramflash, int addr,
+			     int len)
+{
+	hash_t hs;
+	char hex[65];
+	int type, ret;
+
+	hash_init(&hs, di->hashtypes ? di->hashtypes :
+		  (HASH_CRC32C | HASH_SHA256));
+
+	ret = file_mem_dump(di, ramflash, addr, len, NULL, &hs);
+	if (ret)
+		return ret;
+
+	for (type = HASH_CRC32C; type <= HASH_SHA256; type <<= 1)
+	{
+		if (!(hs.types & type))
+			continue;
+		hash_hex(&hs, type, hex);
+		DBG(di, "%s: %s\n", hash_name(type), hex);
+	}
+
+	return 0;
+}
+
+/**
+ * Prints checksums of a RAM region
+ * @param di Device info struct of opened and inited device
+ * @param addr Address to start from
+ * @param len Length in bytes
+ * @returns 0 if OK, <0 on error
+ */
+int file_ram_checksum(devinfo_t *di, int addr, int len)
+{
+	return file_mem_checksum(di, RAM, addr, len);
+}
+
+/**
+ * Prints checksums of a FLASH region
+ * @param di Device info struct of opened and inited device
+ * @param addr Address to start from
+ * @param len Length in bytes
+ * @returns 0 if OK, <0 on error
+ */
+int file_flash_checksum(devinfo_t *di, int addr, int len)
+{
+	return file_mem_checksum(di, FLASH, addr, len);
 }
 
 /**
@@ -177,39 +570,49 @@ int file_bootfile_read(devinfo_t *di, bootfile_info_t *bi, char* fname)
 	int fd, ret;
 	char *file;
 	int filesize = di->ps * (((bi->size - 1) / di->ps) + 1);
+	hash_t hs;
 
 	fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC,
 		  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 	if (fd == -1)
 	{
-		DBGE("Can't open output file: %s\n", strerror(errno));
+		DBGE(di, "Can't open output file: %s\n", strerror(errno));
 		return -1;
 	}
 
 	file = malloc(filesize);
 	if (file == NULL)
 	{
-		DBGE("Can't allocate space for bootfile\n");
+		DBGE(di, "Can't allocate space for bootfile\n");
 		close(fd);
 		return -1;
 	}
 
+	progress_expect(di->prog, filesize);
 	ret = image_get_bootfile_usb(di, bi->patpage, file);
 	if (ret)
 	{
-		DBGE("Can't read bootfile\n");
+		DBGE(di, "Can't read bootfile\n");
 		goto fail;
 	}
 
 	ret = write(fd, file, filesize);
 	if (ret < filesize)
 	{
-		DBGE("Can't write to output file\n");
+		DBGE(di, "Can't write to output file\n");
 		goto fail;
 	}
 
 	ret = 0;
 
+	if (di->hashtypes)
+	{
+		hash_init(&hs, di->hashtypes);
+		hash_update(&hs, file, filesize);
+		hash_final(&hs);
+		ret = file_write_sums(di, fname, &hs);
+	}
+
 fail:
 	free(file);
 	close(fd);
@@ -217,51 +620,152 @@ fail:
 }
 
 /**
- * Dumps all bootfiles from the device with pre-defined names
+ * Dumps all bootfiles found in a page range with pre-defined names
  * @param di Device info struct of opened and inited device
+ * @param firstpage First page to search for PATs
+ * @param npages Number of pages to search, 0 for up to the end of the device
  * @returns 0 if OK, <0 on error
  */
-int file_bootfiles_dump(devinfo_t *di)
+int file_bootfiles_dump(devinfo_t *di, int firstpage, int npages)
 {
-	int ret;
-	int curpage = 0;
+	int ret = 0;
+	int i, n;
 	char fname[128];
-	bootfile_info_t binf;
+	bootfile_info_t *binfs;
+
+	n = image_scan_pats_usb(di, firstpage, npages, &binfs);
+	if (n < 0)
+		return -1;
 
-	while (curpage < PAT_SEARCH_RANGE_PAGES)
+	for (i = 0; i < n; i++)
 	{
-		ret = image_get_bootfile_info_usb(di, curpage, &binf);
+		sprintf(fname, "BF%04X.bin", binfs[i].patpage);
+		ret = file_bootfile_read(di, &binfs[i], fname);
 		if (ret < 0)
-			return -1;
-		else if (ret == 0)
+			break;
+	}
+
+	free(binfs);
+	return ret;
+}
+
+/**
+ * Lists the PATs found in a flash dump file
+ * The page size is not known, so pages starting with the PAT magic are
+ * searched at the smallest page size, and each page size is tried for
+ * validating them.
+ * @param di Context the output goes to
+ * @param fname Dump file starting at flash page 0
+ * @param offset Offset in the file to start searching at
+ * @param len Length to search, 0 for up to the end of the file
+ * @returns 0 if OK, <0 on error
+ */
+int file_pats_scan(devinfo_t *di, char *fname, uint64_t offset,
+		   uint64_t len)
+{
+	static const int pagesizes[] = { 2048, 4096, 8192 };
+	struct stat st;
+	devinfo_t pdi;
+	bootfile_info_t binf;
+	char *data, *pat;
+	int *hits;
+	int fd, i, j, nslots, nhits, found = 0;
+	uint64_t poi, end, slot;
+
+	fd = open(fname, O_RDONLY);
+	if (fd == -1)
+	{
+		DBGE(di, "Can't open input file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) || (st.st_size == 0))
+	{
+		DBGE(di, "Can't get size of %s\n", fname);
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		DBGE(di, "Can't mmap input file: %s\n", strerror(errno));
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+	hits = malloc(FILE_SCAN_SLOTS * sizeof(int));
+	if (hits == NULL)
+	{
+		DBGE(di, "Can't allocate scan buffer\n");
+		munmap(data, st.st_size);
+		return -1;
+	}
+
+	end = (len && (offset + len < st.st_size)) ? offset + len : st.st_size;
+	poi = offset - offset % pagesizes[0];
+	pdi = *di;
+
+	while (poi + pagesizes[0] <= end)
+	{
+		nslots = (end - poi) / pagesizes[0];
+		if (nslots > FILE_SCAN_SLOTS)
+			nslots = FILE_SCAN_SLOTS;
+
+		nhits = image_find_magic(data + poi, nslots, pagesizes[0], hits);
+		for (i = 0; i < nhits; i++)
 		{
-			ret = sprintf(fname, "BF%04X.bin", curpage);
-			if (ret < 0)
-				return -1;
-			ret = file_bootfile_read(di, &binf, fname);
-			if (ret < 0)
-				return -1;
+			slot = poi + (uint64_t)hits[i] * pagesizes[0];
+			pat = data + slot;
+
+			for (j = 0; j < sizeof(pagesizes) / sizeof(pagesizes[0]); j++)
+			{
+				if ((slot % pagesizes[j]) ||
+				    (slot + pagesizes[j] > st.st_size) ||
+				    !image_check_pat((uint32_t *)pat,
+						     pagesizes[j], 0))
+					continue;
+
+				pdi.ps = pagesizes[j];
+				image_get_bootfile_info(slot / pdi.ps,
+							(uint32_t *)pat,
+							pdi.ps, &binf);
+				DBG(di, "- PAT at file offset %08llX, "
+				    "page size %d\n", (unsigned long long)slot,
+				    pdi.ps);
+				image_print_bootfile_info(&pdi, &binf);
+				found++;
+				break;
+			}
 		}
-		curpage++;
+
+		poi += (uint64_t)nslots * pagesizes[0];
 	}
 
+	DBG(di, "- %d PAT(s) found\n", found);
+
+	free(hits);
+	munmap(data, st.st_size);
 	return 0;
 }
 
 /**
  * Open a file in read-only mode and mmaps it
+ * @param di Context errors are reported to
  * @param fname filename to open
  * @param fd Returns the file descriptor in this arg
  * @param length Returns the length of the file in this arg
  * @param data Returns the mmap pointer of the file in this arg
  * @return 0 if OK, <0 on error
  */
-int file_open_mmap(char* fname, int *fd, int *length, char** data)
+int file_open_mmap(devinfo_t *di, char* fname, int *fd, int *length,
+		   char** data)
 {
 	*fd = open(fname, O_RDONLY);
 	if (*fd == -1)
 	{
-		DBGE("Can't open input file: %s\n", strerror(errno));
+		DBGE(di, "Can't open input file: %s\n", strerror(errno));
 		return -1;
 	}
 
@@ -269,14 +773,14 @@ int file_open_mmap(char* fname, int *fd, int *length, char** data)
 	*length = (int)lseek(*fd, 0, SEEK_END);
 	if (*length == -1)
 	{
-		DBGE("Can't determinate file size: %s\n", strerror(errno));
+		DBGE(di, "Can't determinate file size: %s\n", strerror(errno));
 		goto fail;
 	}
 	
 	*data = mmap(NULL, *length, PROT_READ, MAP_SHARED, *fd, 0);
 	if (*data == MAP_FAILED)
 	{
-		DBGE("Can't mmap input file: %s\n", strerror(errno));
+		DBGE(di, "Can't mmap input file: %s\n", strerror(errno));
 		goto fail;
 	}
 
@@ -287,11 +791,279 @@ fail:
 	return -1;
 }
 
+/**
+ * Tells if an input file has to be streamed instead of mmapped
+ * @param fname filename, "-" for stdin
+ * @returns 1 for stdin, pipes, FIFOs, devices and compressed files,
+ *	    0 for other regular files
+ */
+static int file_is_stream(char *fname)
+{
+	struct stat st;
+	unsigned char magic[COMP_MAGIC_LEN];
+	int fd, ret;
+
+	if (!strcmp(fname, "-"))
+		return 1;
+
+	if (stat(fname, &st))
+		return 0;	/* Let file_open_mmap() report the error */
+
+	if (!S_ISREG(st.st_mode))
+		return 1;
+
+	fd = open(fname, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	ret = read(fd, magic, COMP_MAGIC_LEN);
+	close(fd);
+
+	return (ret > 0) && (comp_type_from_magic(magic, ret) != COMP_NONE);
+}
+
+/**
+ * Reads from a streamed input, decompressing it if needed
+ * @param in The input
+ * @param buf Buffer to fill
+ * @param len Length of buf
+ * @returns Number of bytes read, 0 at the end of input, <0 on error
+ */
+static int file_in_read(filein_t *in, char *buf, int len)
+{
+	int ret;
+
+	if (in->dc)
+		return decomp_read(in->dc, buf, len);
+
+	do
+		ret = read(in->fd, buf, len);
+	while ((ret < 0) && (errno == EINTR));
+
+	if (ret < 0)
+		DBGE(in->di, "Can't read input: %s\n", strerror(errno));
+
+	return ret;
+}
+
+/**
+ * Reader thread of a streamed input, fills the buffers of the pool
+ * zstd and xz compressed input is detected from its first bytes and
+ * decompressed here, overlapping with the flash programming.
+ * The first buffer is only filled up to in->first, so that the following
+ * ones start on an erase block boundary.
+ * @param arg The filein_t of the input
+ * @returns NULL
+ */
+static void *file_in_thread(void *arg)
+{
+	filein_t *in = arg;
+	qbuf_t *b;
+	enum comptype ct;
+	int ret, want = in->first;
+	int eof = 0;
+
+	b = queue_get_free(in->q);
+	if (b == NULL)
+		goto out;
+
+	/* Peek at the start of the input to detect compression */
+	while (!eof && (b->len < COMP_MAGIC_LEN))
+	{
+		ret = file_in_read(in, b->data + b->len,
+				   COMP_MAGIC_LEN - b->len);
+		if (ret < 0)
+			goto fail;
+		if (ret == 0)
+			eof = 1;
+		b->len += ret;
+	}
+
+	ct = comp_type_from_magic((unsigned char *)b->data, b->len);
+	if (ct != COMP_NONE)
+	{
+		DBG1(in->di, "Decompressing %s input\n",
+		     (ct == COMP_ZSTD) ? "zstd" : "xz");
+		in->dc = decomp_open(in->di, in->fd, ct, b->data, b->len);
+		if (in->dc == NULL)
+			goto fail;
+		b->len = 0;
+	}
+
+	while (b)
+	{
+		while (!eof && (b->len < want))
+		{
+			ret = file_in_read(in, b->data + b->len,
+					   want - b->len);
+			if (ret < 0)
+				goto fail;
+			if (ret == 0)
+				eof = 1;
+			b->len += ret;
+		}
+
+		if (b->len)
+			queue_put_full(in->q, b);
+		else
+			queue_put_free(in->q, b);
+
+		if (eof)
+			break;
+
+		want = in->bufsize;
+		b = queue_get_free(in->q);
+	}
+
+out:
+	queue_close(in->q);
+	return NULL;
+
+fail:
+	in->err = 1;
+	queue_abort(in->q);
+	return NULL;
+}
+
+/**
+ * Writes a buffer to device memory in large transactions
+ * @param di Device info struct of opened and inited device
+ * @param addr Address to write to
+ * @param data Data to write
+ * @param len Length of data
+ * @returns 0 if OK, <0 on error
+ */
+static int file_ram_put(devinfo_t *di, int addr, char *data, int len)
+{
+	int poi, wl;
+
+	for (poi = 0; poi < len; poi += wl)
+	{
+		wl = (len - poi > FILE_RAM_XFER) ? FILE_RAM_XFER : len - poi;
+		if (cmd_write_mem(di, addr + poi, wl, data + poi))
+		{
+			DBGE(di, "Can't write memory at %08X\n", addr + poi);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Writes a streamed input of any length to flash block by block, or to
+ * memory
+ * Memory use is bounded by the buffer pool, the input is read on a separate
+ * thread while the previous chunk is being programmed or uploaded.
+ * @param di Device info struct of opened and inited device
+ * @param ramflash RAM or FLASH
+ * @param fname Filename to read, "-" for stdin, may be zstd or xz compressed
+ * @param addr Address to write to
+ * @param maxlen Maximum accepted length, 0 for no limit
+ * @param length Returns the number of bytes written
+ * @param hs Initialized hash state to checksum the data into, or NULL
+ * @returns 0 if OK, <0 on error
+ */
+static int file_stream_write(devinfo_t *di, enum memtype ramflash,
+			     char *fname, int addr, int maxlen, int *length,
+			     hash_t *hs)
+{
+	filein_t in;
+	qbuf_t *b;
+	int ret = 0;
+	int nb = FILE_IN_BUFSIZE / di->bs;
+
+	memset(&in, 0, sizeof(filein_t));
+	in.di = di;
+	*length = 0;
+
+	if (!strcmp(fname, "-"))
+		in.fd = STDIN_FILENO;
+	else
+		in.fd = open(fname, O_RDONLY);
+	if (in.fd == -1)
+	{
+		DBGE(di, "Can't open input file: %s\n", strerror(errno));
+		return -1;
+	}
+
+	if (nb < 1)
+		nb = 1;
+	in.bufsize = nb * di->bs;
+	in.first = in.bufsize;
+	if (ramflash == FLASH)
+		in.first -= addr % di->bs;
+
+	in.q = queue_create(FILE_IN_NBUFS, in.bufsize);
+	if (in.q == NULL)
+	{
+		DBGE(di, "Can't allocate buffer queue\n");
+		goto out;
+	}
+
+	if (pthread_create(&in.thread, NULL, file_in_thread, &in))
+	{
+		DBGE(di, "Can't start reader thread\n");
+		queue_destroy(in.q);
+		goto out;
+	}
+
+	DBG1(di, "Streaming input in chunks of %d bytes\n", in.bufsize);
+
+	while ((b = queue_get_full(in.q)) != NULL)
+	{
+		if (maxlen && (*length + b->len > maxlen))
+		{
+			DBGE(di, "Input longer than %d bytes\n", maxlen);
+			ret = -1;
+			break;
+		}
+
+		if (ramflash == FLASH)
+			ret = image_write_random_usb(di, addr + *length,
+						     b->data, b->len);
+		else
+			ret = file_ram_put(di, addr + *length, b->data,
+					   b->len);
+		if (ret)
+			break;
+
+		if (hs)
+			hash_update(hs, b->data, b->len);
+
+		*length += b->len;
+		queue_put_free(in.q, b);
+	}
+
+	if (ret)
+		queue_abort(in.q);
+	pthread_join(in.thread, NULL);
+	queue_destroy(in.q);
+	if (in.dc)
+		decomp_close(in.dc);
+
+	if (in.err)
+		ret = -1;
+	else if (!ret && (*length == 0))
+	{
+		DBGE(di, "No input data\n");
+		ret = -1;
+	}
+
+	if (in.fd != STDIN_FILENO)
+		close(in.fd);
+	return ret;
+
+out:
+	if (in.fd != STDIN_FILENO)
+		close(in.fd);
+	return -1;
+}
+
 /**
  * Writes a file to a flash or mem region
  * @param di Device info struct of opened and inited device
  * @param addr Address to write to
- * @param fname Path and filename to write
+ * @param fname Path and filename to write, "-" for stdin
  * @returns 0 if OK, <0 on error
  */
 int file_flash_write(devinfo_t *di, int addr, char* fname)
@@ -300,14 +1072,23 @@ int file_flash_write(devinfo_t *di, int addr, char* fname)
 	int ret;
 	char *data;
 
-	ret = file_open_mmap(fname, &fd, &length, &data);
+	if (file_is_stream(fname))
+	{
+		ret = file_stream_write(di, FLASH, fname, addr, 0, &length,
+					NULL);
+		if (ret)
+			DBGE(di, "Can't write file to flash\n");
+		return ret;
+	}
+
+	ret = file_open_mmap(di, fname, &fd, &length, &data);
 	if (ret)
 		return -1;
 
 	ret = image_write_random_usb(di, addr, data, length);
 	if (ret)
 	{
-		DBGE("Can't write file to flash\n");
+		DBGE(di, "Can't write file to flash\n");
 		goto out;
 	}
 
@@ -325,7 +1106,7 @@ out:
  * @param id ID to use in PAT table
  * @param patpage Number of the page to write the PAT to
  * @param datapage Number of the page to write the data to
- * @param filename name of the file to write
+ * @param filename name of the file to write, "-" for stdin
  */
 int file_bootfile_write(devinfo_t *di, uint32_t id, int patpage, int datapage,
 			char* fname)
@@ -334,14 +1115,28 @@ int file_bootfile_write(devinfo_t *di, uint32_t id, int patpage, int datapage,
 	int ret;
 	char *data;
 
-	ret = file_open_mmap(fname, &fd, &length, &data);
+	if (file_is_stream(fname))
+	{
+		/* The PAT is written after the data, once the length is known */
+		ret = file_stream_write(di, FLASH, fname, datapage * di->ps,
+					image_bootfile_maxlen(di), &length,
+					NULL);
+		if (!ret)
+			ret = image_write_pat_usb(di, id, patpage, datapage,
+						  length);
+		if (ret)
+			DBGE(di, "Can't write bootfile\n");
+		return ret;
+	}
+
+	ret = file_open_mmap(di, fname, &fd, &length, &data);
 	if (ret)
 		return -1;
 
 	ret = image_write_bootfile_usb(di, id, patpage, datapage, data, length);
 	if (ret)
 	{
-		DBGE("Can't write bootfile\n");
+		DBGE(di, "Can't write bootfile\n");
 		goto out;
 	}
 
@@ -351,3 +1146,73 @@ out:
 	close(fd);
 	return ret;
 }
+
+/**
+ * Uploads a file to device memory, and optionally verifies it by comparing
+ * the CRC32C of the data read back from the device
+ * The file is read on a separate thread while the previous chunk is being
+ * uploaded.
+ * @param di Device info struct of opened and inited device
+ * @param addr Address to write to
+ * @param fname Filename to read, "-" for stdin, may be zstd or xz compressed
+ * @param verify Read back and compare the checksum if set
+ * @returns 0 if OK, <0 on error
+ */
+int file_ram_write(devinfo_t *di, int addr, char *fname, int verify)
+{
+	hash_t hs;
+	struct stat st;
+	char *buf;
+	int length, poi, wl, ret;
+	uint32_t crc = 0;
+
+	/* The length is only known up front for uncompressed files */
+	if (!file_is_stream(fname) && !stat(fname, &st))
+		progress_expect(di->prog, (verify ? 2ULL : 1ULL) * st.st_size);
+
+	hash_init(&hs, HASH_CRC32C);
+
+	ret = file_stream_write(di, RAM, fname, addr, 0, &length, &hs);
+	if (ret)
+	{
+		DBGE(di, "Can't write file to memory\n");
+		return ret;
+	}
+
+	DBG1(di, "Uploaded %d bytes to %08X, crc32c %08x\n", length, addr,
+	     hs.crc32c);
+	if (!verify)
+		return 0;
+
+	buf = malloc(FILE_RAM_XFER);
+	if (buf == NULL)
+	{
+		DBGE(di, "Can't allocate verify buffer\n");
+		return -1;
+	}
+
+	for (poi = 0; poi < length; poi += wl)
+	{
+		wl = (length - poi > FILE_RAM_XFER) ? FILE_RAM_XFER :
+						      length - poi;
+		ret = cmd_read_mem(di, addr + poi, wl, buf);
+		if (ret)
+		{
+			DBGE(di, "Can't read back memory at %08X\n",
+			     addr + poi);
+			goto out;
+		}
+		crc = crc32c(crc, buf, wl);
+	}
+
+	if (crc != hs.crc32c)
+	{
+		DBGE(di, "Verify failed at %08X, crc32c %08x instead of "
+		     "%08x\n", addr, crc, hs.crc32c);
+		ret = -1;
+	}
+
+out:
+	free(buf);
+	return ret;
+}
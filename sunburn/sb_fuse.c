@@ -0,0 +1,262 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#define FUSE_USE_VERSION	31
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <fuse.h>
+#include <usb.h>
+
+#include "sb.h"
+
+#define FS_FLASH_NAME		"flash.bin"
+
+/** A bootfile shown in the filesystem */
+typedef struct
+{
+	char name[16];		/**< BF<patpage>.bin, like -b names them */
+	uint32_t size;		/**< Size from the PAT */
+	uint32_t *pages;	/**< Data pages from the PAT */
+	int npages;		/**< Number of data pages */
+} fs_file_t;
+
+/*
+ * FUSE runs single threaded here, the device is used by one request at a
+ * time
+ */
+static devinfo_t *fs_di;
+static fs_file_t *fs_files;
+static int fs_nfiles;
+static char *fs_pagebuf;
+
+/**
+ * Looks up a bootfile by path
+ * @param path Path in the filesystem
+ * @returns The bootfile, NULL if there's none of that name
+ */
+static fs_file_t *fs_lookup(const char *path)
+{
+	int i;
+
+	for (i = 0; i < fs_nfiles; i++)
+		if (!strcmp(path + 1, fs_files[i].name))
+			return &fs_files[i];
+
+	return NULL;
+}
+
+static int fs_getattr(const char *path, struct stat *st,
+		      struct fuse_file_info *fi)
+{
+	fs_file_t *f;
+
+	memset(st, 0, sizeof(struct stat));
+
+	if (!strcmp(path, "/"))
+	{
+		st->st_mode = S_IFDIR | 0555;
+		st->st_nlink = 2;
+		return 0;
+	}
+
+	st->st_mode = S_IFREG | 0444;
+	st->st_nlink = 1;
+
+	if (!strcmp(path + 1, FS_FLASH_NAME))
+	{
+		st->st_size = (off_t)fs_di->tb * fs_di->bs;
+		return 0;
+	}
+
+	f = fs_lookup(path);
+	if (f == NULL)
+		return -ENOENT;
+
+	st->st_size = f->size;
+	return 0;
+}
+
+static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+		      off_t off, struct fuse_file_info *fi,
+		      enum fuse_readdir_flags flags)
+{
+	int i;
+
+	if (strcmp(path, "/"))
+		return -ENOENT;
+
+	filler(buf, ".", NULL, 0, 0);
+	filler(buf, "..", NULL, 0, 0);
+	filler(buf, FS_FLASH_NAME, NULL, 0, 0);
+	for (i = 0; i < fs_nfiles; i++)
+		filler(buf, fs_files[i].name, NULL, 0, 0);
+
+	return 0;
+}
+
+static int fs_open(const char *path, struct fuse_file_info *fi)
+{
+	if (strcmp(path + 1, FS_FLASH_NAME) && (fs_lookup(path) == NULL))
+		return -ENOENT;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EACCES;
+
+	/* Reads come as they are, the kernel would widen them by readahead */
+	fi->direct_io = 1;
+
+	return 0;
+}
+
+/**
+ * Reads from the raw flash or a bootfile, page by page through the page
+ * cache, touching only the pages the range covers
+ */
+static int fs_read(const char *path, char *buf, size_t size, off_t off,
+		   struct fuse_file_info *fi)
+{
+	devinfo_t *di = fs_di;
+	fs_file_t *f = NULL;
+	uint64_t len;
+	uint32_t idx, page, skip, wl;
+	size_t done = 0;
+
+	if (strcmp(path + 1, FS_FLASH_NAME))
+	{
+		f = fs_lookup(path);
+		if (f == NULL)
+			return -ENOENT;
+		len = f->size;
+	}
+	else
+		len = (uint64_t)di->tb * di->bs;
+
+	if (off >= len)
+		return 0;
+	if (size > len - off)
+		size = len - off;
+
+	while (done < size)
+	{
+		idx = off / di->ps;
+		skip = off % di->ps;
+		wl = (di->ps - skip < size - done) ? di->ps - skip :
+						     size - done;
+
+		/* The PAT may list fewer pages than its size needs */
+		if (f && (idx >= f->npages))
+			memset(buf + done, 0xFF, wl);
+		else
+		{
+			page = f ? f->pages[idx] : idx;
+			if (cmd_read_flash_page(di, page, fs_pagebuf))
+				return -EIO;
+			memcpy(buf + done, fs_pagebuf + skip, wl);
+		}
+
+		done += wl;
+		off += wl;
+	}
+
+	return done;
+}
+
+static const struct fuse_operations fs_ops =
+{
+	.getattr	= fs_getattr,
+	.readdir	= fs_readdir,
+	.open		= fs_open,
+	.read		= fs_read,
+};
+
+/**
+ * Mounts a read-only filesystem showing the bootfiles and the raw flash
+ * until it's unmounted
+ * Each PAT found in the page range shows up as a BF<patpage>.bin file of
+ * the size in the PAT, and flash.bin holds the whole flash. Only the PAT
+ * pages are read at mount time, file data is read on demand and kept in
+ * the page cache.
+ * @param di Device info struct of opened and inited device
+ * @param mountpoint Directory to mount on
+ * @param firstpage First page to look for PATs
+ * @param npages Number of pages to look for PATs in
+ * @returns 0 if OK, <0 on error
+ */
+int fs_run(devinfo_t *di, char *mountpoint, int firstpage, int npages)
+{
+	char *argv[] = { "sunburn", "-f", "-s", "-o", "ro", mountpoint, NULL };
+	bootfile_info_t *binfs;
+	int i, n, ret = -1;
+
+	n = image_scan_pats_usb(di, firstpage, npages, &binfs);
+	if (n < 0)
+		return -1;
+
+	fs_di = di;
+	fs_nfiles = 0;
+	fs_files = calloc(n ? n : 1, sizeof(fs_file_t));
+	fs_pagebuf = malloc(di->ps);
+	if ((fs_files == NULL) || (fs_pagebuf == NULL))
+	{
+		DBGE(di, "Can't allocate bootfile list\n");
+		goto out;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		fs_file_t *f = &fs_files[fs_nfiles];
+
+		f->npages = image_get_bootfile_pages(di, binfs[i].patpage,
+						     &f->pages);
+		if (f->npages < 0)
+			goto out;
+
+		sprintf(f->name, "BF%04X.bin", binfs[i].patpage);
+		f->size = binfs[i].size;
+		fs_nfiles++;
+	}
+
+	cache_serve(di);
+
+	DBG(di, "- Mounting %d bootfile(s) and " FS_FLASH_NAME " on %s\n",
+	    fs_nfiles, mountpoint);
+
+	ret = fuse_main(sizeof(argv) / sizeof(argv[0]) - 1, argv, &fs_ops,
+			NULL) ? -1 : 0;
+
+out:
+	for (i = 0; i < fs_nfiles; i++)
+		free(fs_files[i].pages);
+	free(fs_files);
+	free(fs_pagebuf);
+	free(binfs);
+	fs_files = NULL;
+	fs_nfiles = 0;
+	return ret;
+}
@@ -0,0 +1,371 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HASH_HAVE_SSE42
+#endif
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define CRC32C_POLY		0x82F63B78UL	/* Castagnoli, reflected */
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_func)(uint32_t crc, const unsigned char *p,
+			       size_t len);
+
+static const uint32_t sha256_k[64] =
+{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * Table driven CRC32C, 8 bytes at a time
+ * @param crc Current CRC value, not inverted
+ * @param p Data
+ * @param len Length of data
+ * @returns Updated CRC value
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	while (len && ((uintptr_t)p & 7))
+	{
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8)
+	{
+		lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+			    ((uint32_t)p[3] << 24));
+		hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+		crc = crc32c_table[7][lo & 0xFF] ^
+		      crc32c_table[6][(lo >> 8) & 0xFF] ^
+		      crc32c_table[5][(lo >> 16) & 0xFF] ^
+		      crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xFF] ^
+		      crc32c_table[2][(hi >> 8) & 0xFF] ^
+		      crc32c_table[1][(hi >> 16) & 0xFF] ^
+		      crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef HASH_HAVE_SSE42
+/**
+ * CRC32C with the SSE4.2 crc32 instruction
+ * @param crc Current CRC value, not inverted
+ * @param p Data
+ * @param len Length of data
+ * @returns Updated CRC value
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len && ((uintptr_t)p & 7))
+	{
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+
+#ifdef __x86_64__
+	{
+		uint64_t crc64 = crc;
+
+		while (len >= 8)
+		{
+			crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+			p += 8;
+			len -= 8;
+		}
+		crc = (uint32_t)crc64;
+	}
+#endif
+	while (len >= 4)
+	{
+		crc = _mm_crc32_u32(crc, *(const uint32_t *)p);
+		p += 4;
+		len -= 4;
+	}
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+#endif
+
+/**
+ * Builds the CRC tables and picks the fastest implementation
+ */
+static void crc32c_setup(void)
+{
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++)
+	{
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xFF];
+
+	crc32c_func = crc32c_sw;
+#ifdef HASH_HAVE_SSE42
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_func = crc32c_hw;
+#endif
+}
+
+/**
+ * Calculates a CRC32C (Castagnoli) checksum, can be chained
+ * @param crc CRC of the preceding data, 0 to start
+ * @param data Data
+ * @param len Length of data
+ * @returns CRC of the data
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_setup);
+
+	return ~crc32c_func(~crc, data, len);
+}
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+/**
+ * Runs the SHA-256 compression function on 64 byte blocks
+ * @param h Hash state
+ * @param p Data
+ * @param nblocks Number of blocks
+ */
+static void sha256_blocks(uint32_t *h, const unsigned char *p, size_t nblocks)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, hh, t1, t2;
+	int i;
+
+	while (nblocks--)
+	{
+		for (i = 0; i < 16; i++)
+			w[i] = ((uint32_t)p[i * 4] << 24) | (p[i * 4 + 1] << 16) |
+			       (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+		for (i = 16; i < 64; i++)
+			w[i] = w[i - 16] + w[i - 7] +
+			       (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+				(w[i - 15] >> 3)) +
+			       (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+				(w[i - 2] >> 10));
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3];
+		e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+		for (i = 0; i < 64; i++)
+		{
+			t1 = hh + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+			     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+			     ((a & b) ^ (a & c) ^ (b & c));
+			hh = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+
+		p += 64;
+	}
+}
+
+/**
+ * Starts a hash calculation
+ * @param hs Hash state to init
+ * @param types HASH_CRC32C and/or HASH_SHA256
+ */
+void hash_init(hash_t *hs, int types)
+{
+	static const uint32_t sha256_h0[8] =
+	{
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memset(hs, 0, sizeof(hash_t));
+	hs->types = types;
+	memcpy(hs->sha256, sha256_h0, sizeof(sha256_h0));
+}
+
+/**
+ * Adds data to a hash calculation
+ * @param hs Hash state
+ * @param data Data
+ * @param len Length of data
+ */
+void hash_update(hash_t *hs, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t n;
+
+	if (hs->types & HASH_CRC32C)
+		hs->crc32c = crc32c(hs->crc32c, data, len);
+
+	if (!(hs->types & HASH_SHA256))
+		return;
+
+	hs->len += len;
+
+	if (hs->buflen)
+	{
+		n = 64 - hs->buflen;
+		if (n > len)
+			n = len;
+		memcpy(hs->buf + hs->buflen, p, n);
+		hs->buflen += n;
+		p += n;
+		len -= n;
+		if (hs->buflen < 64)
+			return;
+		sha256_blocks(hs->sha256, hs->buf, 1);
+		hs->buflen = 0;
+	}
+
+	sha256_blocks(hs->sha256, p, len / 64);
+	p += len & ~63UL;
+	len &= 63;
+
+	memcpy(hs->buf, p, len);
+	hs->buflen = len;
+}
+
+/**
+ * Finishes a hash calculation
+ * @param hs Hash state
+ */
+void hash_final(hash_t *hs)
+{
+	uint64_t bits = hs->len * 8;
+	int i;
+
+	if (!(hs->types & HASH_SHA256))
+		return;
+
+	hs->buf[hs->buflen++] = 0x80;
+	if (hs->buflen > 56)
+	{
+		memset(hs->buf + hs->buflen, 0, 64 - hs->buflen);
+		sha256_blocks(hs->sha256, hs->buf, 1);
+		hs->buflen = 0;
+	}
+	memset(hs->buf + hs->buflen, 0, 56 - hs->buflen);
+	for (i = 0; i < 8; i++)
+		hs->buf[63 - i] = bits >> (i * 8);
+	sha256_blocks(hs->sha256, hs->buf, 1);
+}
+
+/**
+ * Formats a finished hash as a hex string
+ * @param hs Hash state after hash_final()
+ * @param type HASH_CRC32C or HASH_SHA256
+ * @param str Output, at least 65 bytes
+ */
+void hash_hex(hash_t *hs, int type, char *str)
+{
+	int i;
+
+	if (type == HASH_CRC32C)
+	{
+		sprintf(str, "%08x", hs->crc32c);
+		return;
+	}
+
+	for (i = 0; i < 8; i++)
+		sprintf(str + i * 8, "%08x", hs->sha256[i]);
+}
+
+/**
+ * Name of a hash type, also used as the checksum file extension
+ * @param type HASH_CRC32C or HASH_SHA256
+ * @returns Name string
+ */
+char *hash_name(int type)
+{
+	return (type == HASH_CRC32C) ? "crc32c" : "sha256";
+}
+
+/**
+ * Parses a comma separated list of hash names
+ * @param str The list, e.g. "crc32c,sha256"
+ * @returns Mask of HASH_ types, <0 on error
+ */
+int hash_parse_types(char *str)
+{
+	int types = 0;
+	int len;
+
+	while (*str)
+	{
+		len = strcspn(str, ",");
+		if ((len == 6) && !strncmp(str, "crc32c", len))
+			types |= HASH_CRC32C;
+		else if ((len == 6) && !strncmp(str, "sha256", len))
+			types |= HASH_SHA256;
+		else
+			return -1;
+		str += len;
+		if (*str == ',')
+			str++;
+	}
+
+	return types ? types : -1;
+}
@@ -0,0 +1,449 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define HELPER_MAX_LEN		0x10000
+#define HELPER_POLL_US		500	/* Wait between job status polls */
+#define HELPER_POLL_MAX		20000	/* Polls before giving up on a job */
+
+/** A program job queued to a staging buffer */
+typedef struct
+{
+	uint32_t firstpage;	/**< First page of the job */
+	int npages;		/**< Number of pages, 0 if no job */
+} helper_job_t;
+
+/**
+ * Loads a checksum helper image, it gets uploaded on first use
+ * @param di Device info struct to keep the image in
+ * @param fname File holding the helper image
+ * @returns 0 if OK, <0 on error
+ */
+int helper_load(devinfo_t *di, char *fname)
+{
+	helper_hdr_t *hdr;
+	struct stat st;
+	char *buf = NULL;
+	int fd, ret;
+
+	fd = open(fname, O_RDONLY);
+	if (fd == -1)
+	{
+		DBGE(di, "Can't open helper %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) || (st.st_size < sizeof(helper_hdr_t)) ||
+	    (st.st_size > HELPER_MAX_LEN))
+	{
+		DBGE(di, "Invalid helper size\n");
+		goto fail;
+	}
+
+	buf = malloc(st.st_size);
+	if (buf == NULL)
+	{
+		DBGE(di, "Can't allocate helper buffer\n");
+		goto fail;
+	}
+
+	ret = read(fd, buf, st.st_size);
+	if (ret != st.st_size)
+	{
+		DBGE(di, "Can't read helper %s\n", fname);
+		goto fail;
+	}
+
+	hdr = (helper_hdr_t *)buf;
+	if ((le32toh(hdr->magic) != HELPER_MAGIC) ||
+	    (le32toh(hdr->version) != HELPER_VERSION) ||
+	    (le32toh(hdr->entry) >= st.st_size) ||
+	    (le32toh(hdr->tablemax) == 0) ||
+	    (hdr->stagelen && !(hdr->jobs && hdr->stage)))
+	{
+		DBGE(di, "%s is not a checksum helper\n", fname);
+		goto fail;
+	}
+
+	close(fd);
+
+	helper_free(di);
+	di->helper = buf;
+	di->helperlen = st.st_size;
+	di->helperup = 0;
+
+	DBG1(di, "Checksum helper: %d bytes, entry %08X, %d entries max, "
+	     "%d byte staging buffers\n", di->helperlen,
+	     HELPER_LOAD_ADDR + le32toh(hdr->entry), le32toh(hdr->tablemax),
+	     le32toh(hdr->stagelen));
+
+	return 0;
+
+fail:
+	free(buf);
+	close(fd);
+	return -1;
+}
+
+/**
+ * Gives a device its own copy of the checksum helper image of another
+ * @param di Device info struct to copy to, its image pointer is replaced
+ * @param from Device info struct holding the image, may have none
+ * @returns 0 if OK, <0 on error
+ */
+int helper_copy(devinfo_t *di, devinfo_t *from)
+{
+	di->helper = NULL;
+	di->helperlen = 0;
+	di->helperup = 0;
+
+	if (from->helper == NULL)
+		return 0;
+
+	di->helper = malloc(from->helperlen);
+	if (di->helper == NULL)
+	{
+		DBGE(di, "Can't allocate helper buffer\n");
+		return -1;
+	}
+
+	memcpy(di->helper, from->helper, from->helperlen);
+	di->helperlen = from->helperlen;
+	return 0;
+}
+
+/**
+ * Frees the checksum helper image of a device
+ * @param di Device info struct
+ */
+void helper_free(devinfo_t *di)
+{
+	free(di->helper);
+	di->helper = NULL;
+	di->helperlen = 0;
+	di->helperup = 0;
+}
+
+/**
+ * Uploads the helper to the device unless it's already there
+ * @param di Device info struct of opened and inited device, with a helper
+ * @returns 0 if OK, <0 on error
+ */
+static int helper_upload(devinfo_t *di)
+{
+	if (di->helperup)
+		return 0;
+
+	DBG1(di, "Uploading checksum helper to %08X\n", HELPER_LOAD_ADDR);
+	if (sb_ram_write(di, HELPER_LOAD_ADDR, di->helper, di->helperlen))
+		return -1;
+
+	di->helperup = 1;
+	return 0;
+}
+
+/**
+ * Runs the helper once, for at most tablemax entries
+ * @param di Device info struct of opened and inited device
+ * @param p Parameters, filled in host byte order
+ * @param crcs Returns the table entries
+ * @returns 0 if OK, <0 on error
+ */
+static int helper_run(devinfo_t *di, helper_param_t *p, uint32_t *crcs)
+{
+	helper_hdr_t *hdr = (helper_hdr_t *)di->helper;
+	helper_param_t dp;
+	uint32_t n, i;
+
+	n = (p->npages + p->pagesper - 1) / p->pagesper;
+
+	dp.magic = htole32(HELPER_PARAM_MAGIC);
+	dp.cmd = htole32(p->cmd);
+	dp.firstpage = htole32(p->firstpage);
+	dp.npages = htole32(p->npages);
+	dp.pagesper = htole32(p->pagesper);
+	dp.pagesize = htole32(p->pagesize);
+	dp.status = 0;
+	dp.count = 0;
+
+	if (sb_ram_write(di, le32toh(hdr->param), &dp, sizeof(dp)) ||
+	    cmd_execute(di, HELPER_LOAD_ADDR + le32toh(hdr->entry)) ||
+	    sb_ram_read(di, le32toh(hdr->param), &dp, sizeof(dp)))
+		return -1;
+
+	if ((le32toh(dp.status) != HELPER_STATUS_DONE) ||
+	    (le32toh(dp.count) != n))
+	{
+		DBGE(di, "Checksum helper failed, status %08X\n",
+		     le32toh(dp.status));
+		return -1;
+	}
+
+	if (sb_ram_read(di, le32toh(hdr->table), crcs, n * sizeof(uint32_t)))
+		return -1;
+
+	for (i = 0; i < n; i++)
+		crcs[i] = le32toh(crcs[i]);
+
+	progress_add(di->prog, PROG_VERIFY, p->npages * di->ps);
+
+	return 0;
+}
+
+/**
+ * Checksums flash pages on the device with the checksum helper
+ * Only the table of CRC32C values is transferred, not the pages.
+ * @param di Device info struct of opened and inited device, with a helper
+ * @param firstpage Number of the first page
+ * @param npages Number of pages
+ * @param pagesper Pages per checksum, 1 for every page, ppb for every block
+ * @param crcs Returns the checksums, one for every pagesper pages
+ * @returns 0 if OK, <0 on error
+ */
+int helper_crc_pages(devinfo_t *di, uint32_t firstpage, int npages,
+		     int pagesper, uint32_t *crcs)
+{
+	helper_hdr_t *hdr = (helper_hdr_t *)di->helper;
+	helper_param_t p;
+	int maxpages;
+
+	if ((hdr == NULL) || (pagesper < 1))
+		return -1;
+
+	if (helper_upload(di))
+		return -1;
+
+	maxpages = le32toh(hdr->tablemax) * pagesper;
+
+	p.cmd = HELPER_CMD_CRC32C;
+	p.pagesper = pagesper;
+	p.pagesize = di->ps;
+
+	while (npages > 0)
+	{
+		p.firstpage = firstpage;
+		p.npages = (npages > maxpages) ? maxpages : npages;
+
+		if (helper_run(di, &p, crcs))
+			return -1;
+
+		crcs += (p.npages + pagesper - 1) / pagesper;
+		firstpage += p.npages;
+		npages -= p.npages;
+	}
+
+	return 0;
+}
+
+/**
+ * Verifies written flash pages against the data, checksumming them on the
+ * device instead of reading them back
+ * @param di Device info struct of opened and inited device, with a helper
+ * @param firstpage Number of the first page
+ * @param npages Number of pages
+ * @param data Data the pages should hold
+ * @returns 0 if OK, 1 if a page doesn't match, <0 if the helper failed
+ */
+int helper_verify_pages(devinfo_t *di, uint32_t firstpage, int npages,
+			char *data)
+{
+	uint32_t *crcs;
+	int i, ret;
+
+	crcs = malloc(npages * sizeof(uint32_t));
+	if (crcs == NULL)
+	{
+		DBGE(di, "Can't allocate checksum table\n");
+		return -1;
+	}
+
+	ret = helper_crc_pages(di, firstpage, npages, 1, crcs);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < npages; i++)
+	{
+		if (crcs[i] != crc32c(0, data + i * di->ps, di->ps))
+		{
+			DBGE(di, "Flash page error on page %08X, checksum "
+			     "mismatch\n", firstpage + i);
+			ret = 1;
+			break;
+		}
+	}
+
+out:
+	free(crcs);
+	return ret;
+}
+
+/**
+ * Tells if the helper can program the flash as a flasher stub
+ * @param di Device info struct of inited device
+ * @returns 1 if it can, 0 if not
+ */
+int helper_can_program(devinfo_t *di)
+{
+	helper_hdr_t *hdr = (helper_hdr_t *)di->helper;
+
+	return hdr && di->bs && (le32toh(hdr->stagelen) >= di->bs);
+}
+
+/**
+ * Waits for the program job of a staging buffer to finish
+ * @param di Device info struct of opened and inited device, with a helper
+ * @param stage Number of the staging buffer
+ * @param job The job, cleared once finished
+ * @returns 0 if OK, <0 if the job failed or the helper doesn't respond
+ */
+static int helper_wait_job(devinfo_t *di, int stage, helper_job_t *job)
+{
+	helper_hdr_t *hdr = (helper_hdr_t *)di->helper;
+	uint32_t addr = le32toh(hdr->jobs) + stage * sizeof(helper_param_t);
+	helper_param_t p;
+	int i, npages = job->npages;
+
+	job->npages = 0;
+
+	for (i = 0; i < HELPER_POLL_MAX; i++)
+	{
+		if (sb_ram_read(di, addr, &p, sizeof(p)))
+			return -1;
+		if (le32toh(p.status) != HELPER_STATUS_BUSY)
+			break;
+		usleep(HELPER_POLL_US);
+	}
+
+	if (le32toh(p.status) == HELPER_STATUS_DONE)
+	{
+		progress_add(di->prog, PROG_PROGRAM, npages * di->ps);
+		return 0;
+	}
+
+	if (le32toh(p.status) == HELPER_STATUS_BUSY)
+		DBGE(di, "Flasher stub timed out on pages %08X-%08X\n",
+		     job->firstpage, job->firstpage + npages - 1);
+	else
+		DBGE(di, "Flasher stub failed on page %08X, status %08X\n",
+		     job->firstpage + le32toh(p.count), le32toh(p.status));
+
+	return -1;
+}
+
+/**
+ * Erases, programs and verifies flash blocks with the helper on the device
+ * The data is streamed into the staging buffers in transfers of a whole
+ * buffer, one buffer being filled while the blocks of the other are
+ * programmed.
+ * @param di Device info struct of opened and inited device, with a helper
+ *	     that can program
+ * @param firstpage First page of the first block
+ * @param nblocks Number of blocks
+ * @param data Data of the blocks
+ * @returns 0 if OK, <0 on error
+ */
+int helper_program_blocks(devinfo_t *di, uint32_t firstpage, int nblocks,
+			  char *data)
+{
+	helper_hdr_t *hdr = (helper_hdr_t *)di->helper;
+	helper_job_t jobs[HELPER_NSTAGES];
+	helper_param_t p;
+	uint32_t buf;
+	int per = le32toh(hdr->stagelen) / di->bs;
+	int i, n, stage = 0, ret = 0;
+
+	memset(jobs, 0, sizeof(jobs));
+
+	if (helper_upload(di))
+		return -1;
+
+	while (nblocks > 0)
+	{
+		/* Wait for the previous job of this buffer */
+		if (jobs[stage].npages && helper_wait_job(di, stage,
+							  &jobs[stage]))
+			goto fail;
+
+		n = (nblocks > per) ? per : nblocks;
+		buf = le32toh(hdr->stage) + stage * le32toh(hdr->stagelen);
+
+		if (cmd_write_mem(di, buf, n * di->bs, data))
+			goto fail;
+
+		p.magic = htole32(HELPER_PARAM_MAGIC);
+		p.cmd = htole32(HELPER_CMD_PROGRAM);
+		p.firstpage = htole32(firstpage);
+		p.npages = htole32(n * di->ppb);
+		p.pagesper = htole32(di->ppb);
+		p.pagesize = htole32(di->ps);
+		p.status = 0;
+		p.count = 0;
+		p.buf = htole32(buf);
+
+		/* The stub accepts the job by copying it to the parameter
+		 * block of the buffer and returns while it runs */
+		if (sb_ram_write(di, le32toh(hdr->param), &p, sizeof(p)) ||
+		    cmd_execute(di, HELPER_LOAD_ADDR + le32toh(hdr->entry)) ||
+		    sb_ram_read(di, le32toh(hdr->param), &p, sizeof(p)))
+			goto fail;
+		if (le32toh(p.status) != HELPER_STATUS_DONE)
+		{
+			DBGE(di, "Flasher stub refused pages %08X-%08X\n",
+			     firstpage, firstpage + n * di->ppb - 1);
+			goto fail;
+		}
+
+		jobs[stage].firstpage = firstpage;
+		jobs[stage].npages = n * di->ppb;
+
+		firstpage += n * di->ppb;
+		data += n * di->bs;
+		nblocks -= n;
+		stage = (stage + 1) % HELPER_NSTAGES;
+	}
+
+	/* Wait for the jobs still running, oldest first */
+	for (i = 0; i < HELPER_NSTAGES; i++, stage = (stage + 1) % HELPER_NSTAGES)
+		if (jobs[stage].npages && helper_wait_job(di, stage,
+							  &jobs[stage]))
+			ret = -1;
+
+	return ret;
+
+fail:
+	/* Leave the device idle, the caller may retry without the stub */
+	for (i = 0; i < HELPER_NSTAGES; i++)
+		if (jobs[i].npages)
+			helper_wait_job(di, i, &jobs[i]);
+	return -1;
+}
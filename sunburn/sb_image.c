@@ -18,11 +18,17 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
  * MA  02110-1301, USA.
  */
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <endian.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <usb.h>
 
 #include "sb.h"
@@ -39,6 +45,39 @@
 
 #define FLASH_WRITE_MAXRETRIES		128
 
+#define PAT_SCAN_BATCH			64	/* pages per read when scanning */
+
+#define WPIPE_MINBLOCKS			2	/* smaller writes aren't pipelined */
+#define WPIPE_NBUFS			4	/* blocks built ahead of the USB */
+
+/** Stages of a pipelined write */
+enum
+{
+	WPIPE_PREFETCH = 0,
+	WPIPE_USB,
+	WPIPE_COMPARE,
+	WPIPE_NSTAGES
+};
+
+/** State of a pipelined write, see image_write_pipe_usb() */
+typedef struct
+{
+	devinfo_t *di;
+	flashoffsets_t *fo;
+	int offset;		/**< Flash offset of the data */
+	char *data;		/**< Data to write */
+	int len;		/**< Length of the data */
+	char *edge[2];		/**< First and last block read back, NULL if
+				     they get fully overwritten */
+	int first;		/**< First block to write, later ones when
+				     resuming from the journal */
+	queue_t *fillq;		/**< Built blocks, prefetch -> USB */
+	queue_t *cmpq;		/**< Read back blocks, USB -> compare */
+	int failed;		/**< A stage failed, the others stop */
+	double busy[WPIPE_NSTAGES];	/**< Time each stage ran */
+	double wait[WPIPE_NSTAGES];	/**< Time each stage waited for buffers */
+} wpipe_t;
+
 void flash_offset_calc(devinfo_t *di, flashoffsets_t *fo,
 			      int offset, int length)
 {
@@ -59,15 +98,15 @@ void image_print_bootfile_info(devinfo_t *di, bootfile_info_t *binf)
 {
 	int numpages = binf->lastpage - binf->firstpage;
 
-	DBG("- Bootfile info:\n");
-	DBG(" Patpage:     0x%08X\n", binf->patpage);
-	DBG(" ID:          0x%08X\n", binf->id);
-	DBG(" Size:        %d\n", binf->size);
-	DBG(" First page:  0x%08X\n", binf->firstpage);
-	DBG(" Last page:   0x%08X\n", binf->lastpage);
+	DBG(di, "- Bootfile info:\n");
+	DBG(di, " Patpage:     0x%08X\n", binf->patpage);
+	DBG(di, " ID:          0x%08X\n", binf->id);
+	DBG(di, " Size:        %d\n", binf->size);
+	DBG(di, " First page:  0x%08X\n", binf->firstpage);
+	DBG(di, " Last page:   0x%08X\n", binf->lastpage);
 
 	if (numpages > (binf->size / di->ps))
-		DBG(" Pages non-continous!\n");
+		DBG(di, " Pages non-continous!\n");
 }
 
 /**
@@ -84,10 +123,7 @@ int image_get_bootfile_info(int patpageno, uint32_t *patpage, uint32_t pagesize,
 	int i = PATPAGE_OFFSET_FIRSTPAGE;
 
 	if (patpage[PATPAGE_OFFSET_MAGIC] != le32toh(PATPAGE_MAGIC))
-	{
-		DBG2("Not a PAT page - magic word not found\n");
 		return -1;
-	};
 
 	binf->patpage = patpageno;
 
@@ -119,7 +155,7 @@ int image_get_bootfile_info_usb(devinfo_t *di, uint32_t patpagenum,
 	buf = malloc(di->ps);
 	if (buf == NULL)
 	{
-		DBGE("Can't alloc buffer for nand page\n");
+		DBGE(di, "Can't alloc buffer for nand page\n");
 		return -1;
 	}
 
@@ -129,7 +165,10 @@ int image_get_bootfile_info_usb(devinfo_t *di, uint32_t patpagenum,
 
 	ret = image_get_bootfile_info(patpagenum, buf, di->ps, binf);
 	if (ret)
+	{
+		DBG2(di, "Not a PAT page - magic word not found\n");
 		ret = 1;
+	}
 
 out:
 	free(buf);
@@ -137,27 +176,199 @@ out:
 }
 
 /**
- * Prints info about all PAT pages and bootfiles found in the device
+ * Finds the pages starting with the PAT magic word in a buffer of pages
+ * Only the first word of each page is touched, compared 4 pages at a time.
+ * @param buf Buffer holding the pages
+ * @param npages Number of pages in the buffer
+ * @param stride Distance of page starts in the buffer
+ * @param hits Filled with the indexes of the matching pages, npages long
+ * @returns Number of matching pages
+ */
+int image_find_magic(char *buf, int npages, int stride, int *hits)
+{
+	uint32_t magic = htole32(PATPAGE_MAGIC);
+	int i = 0, n = 0;
+#ifdef __SSE2__
+	__m128i vmagic = _mm_set1_epi32(magic);
+	__m128i v;
+	int mask;
+
+	for (; i + 4 <= npages; i += 4)
+	{
+		v = _mm_set_epi32(*(uint32_t *)(buf + (i + 3) * stride),
+				  *(uint32_t *)(buf + (i + 2) * stride),
+				  *(uint32_t *)(buf + (i + 1) * stride),
+				  *(uint32_t *)(buf + i * stride));
+		mask = _mm_movemask_ps(_mm_castsi128_ps(
+					_mm_cmpeq_epi32(v, vmagic)));
+		while (mask)
+		{
+			hits[n++] = i + __builtin_ctz(mask);
+			mask &= mask - 1;
+		}
+	}
+#endif
+	for (; i < npages; i++)
+		if (*(uint32_t *)(buf + i * stride) == magic)
+			hits[n++] = i;
+
+	return n;
+}
+
+/**
+ * Checks whether a page holding the PAT magic is a consistent PAT
+ * The page list needs to have exactly as many entries as the size
+ * requires, all of them valid page numbers, followed by the end marker.
+ * @param pat The candidate PAT page
+ * @param ps Page size
+ * @param maxpage Listed pages need to be below this, 0 for no limit
+ * @returns 1 if valid, 0 if not
+ */
+int image_check_pat(uint32_t *pat, int ps, uint32_t maxpage)
+{
+	uint32_t size = le32toh(pat[PATPAGE_OFFSET_SIZE]);
+	uint32_t *list = pat + PATPAGE_OFFSET_FIRSTPAGE;
+	uint32_t limit = maxpage ? maxpage - 1 : PATPAGE_END - 1;
+	int n, i = 0;
+#ifdef __SSE2__
+	__m128i sign = _mm_set1_epi32(0x80000000);
+	__m128i vlimit = _mm_set1_epi32(limit ^ 0x80000000);
+	__m128i v;
+#endif
+
+	if ((pat[PATPAGE_OFFSET_MAGIC] != htole32(PATPAGE_MAGIC)) ||
+	    (size == 0))
+		return 0;
+
+	n = (size - 1) / ps + 1;
+	if (PATPAGE_OFFSET_FIRSTPAGE + n >= ps / sizeof(uint32_t))
+		return 0;
+
+	if (list[n] != PATPAGE_END)
+		return 0;
+
+	/* Unsigned compare of 4 entries at a time against the limit, which
+	 * also catches an early end marker */
+#ifdef __SSE2__
+	for (; i + 4 <= n; i += 4)
+	{
+		v = _mm_xor_si128(_mm_loadu_si128((__m128i *)(list + i)), sign);
+		if (_mm_movemask_epi8(_mm_cmpgt_epi32(v, vlimit)))
+			return 0;
+	}
+#endif
+	for (; i < n; i++)
+		if (le32toh(list[i]) > limit)
+			return 0;
+
+	return 1;
+}
+
+/**
+ * Scans a flash page range for valid PATs, reading a batch of pages at a time
  * @param di Device info struct of opened and inited device
- * @returns 0 if OK, <0 on error
+ * @param firstpage First page to scan
+ * @param npages Number of pages to scan, 0 for up to the end of the device
+ * @param binfs Returns an allocated array of the bootfiles found
+ * @returns Number of bootfiles found, <0 on error
  */
-int image_show_pats_usb(devinfo_t *di)
+int image_scan_pats_usb(devinfo_t *di, int firstpage, int npages,
+			bootfile_info_t **binfs)
 {
-	int ret;
-	int curpage = 0;
-	bootfile_info_t binf;
+	int totalpages = di->tb * di->ppb;
+	int batch, i, nhits, found = 0;
+	int *hits;
+	char *buf, *pat;
+	bootfile_info_t *b;
+
+	*binfs = NULL;
+
+	if ((npages == 0) || (firstpage + npages > totalpages))
+		npages = totalpages - firstpage;
 
-	while (curpage < PAT_SEARCH_RANGE_PAGES)
+	buf = malloc(PAT_SCAN_BATCH * di->ps);
+	hits = malloc(PAT_SCAN_BATCH * sizeof(int));
+	if ((buf == NULL) || (hits == NULL))
 	{
-		ret = image_get_bootfile_info_usb(di, curpage, &binf);
-		if (ret < 0)
-			return -1;
-		else if (ret == 0)
-			image_print_bootfile_info(di, &binf);
+		DBGE(di, "Can't allocate scan buffer\n");
+		goto fail;
+	}
 
-		curpage++;
+	DBG1(di, "Scanning pages %08X-%08X for PATs\n", firstpage,
+	     firstpage + npages - 1);
+	progress_expect(di->prog, (uint64_t)npages * di->ps);
+
+	while (npages > 0)
+	{
+		batch = (npages < PAT_SCAN_BATCH) ? npages : PAT_SCAN_BATCH;
+
+		if (cmd_read_flash_pages(di, firstpage, batch, buf))
+		{
+			DBGE(di, "Can't read flash pages at %08X\n", firstpage);
+			goto fail;
+		}
+
+		nhits = image_find_magic(buf, batch, di->ps, hits);
+		for (i = 0; i < nhits; i++)
+		{
+			pat = buf + hits[i] * di->ps;
+			if (!image_check_pat((uint32_t *)pat, di->ps,
+					     totalpages))
+			{
+				DBG1(di, "Invalid PAT at page %08X\n",
+				     firstpage + hits[i]);
+				continue;
+			}
+
+			b = realloc(*binfs, (found + 1) *
+				    sizeof(bootfile_info_t));
+			if (b == NULL)
+			{
+				DBGE(di, "Can't allocate bootfile info\n");
+				goto fail;
+			}
+			*binfs = b;
+			image_get_bootfile_info(firstpage + hits[i],
+						(uint32_t *)pat, di->ps,
+						&b[found++]);
+		}
+
+		firstpage += batch;
+		npages -= batch;
 	}
 
+	free(buf);
+	free(hits);
+	return found;
+
+fail:
+	free(buf);
+	free(hits);
+	free(*binfs);
+	*binfs = NULL;
+	return -1;
+}
+
+/**
+ * Prints info about all PAT pages and bootfiles found in a page range
+ * @param di Device info struct of opened and inited device
+ * @param firstpage First page to scan
+ * @param npages Number of pages to scan, 0 for up to the end of the device
+ * @returns 0 if OK, <0 on error
+ */
+int image_show_pats_usb(devinfo_t *di, int firstpage, int npages)
+{
+	bootfile_info_t *binfs;
+	int i, n;
+
+	n = image_scan_pats_usb(di, firstpage, npages, &binfs);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		image_print_bootfile_info(di, &binfs[i]);
+
+	free(binfs);
 	return 0;
 }
 
@@ -180,7 +391,7 @@ int image_get_bootfile_usb(devinfo_t *di, uint32_t patpagenum, char* data)
 	pat = malloc(di->ps);
 	if (pat == NULL)
 	{
-		DBGE("Can' alloc buffer for nand page\n");
+		DBGE(di, "Can' alloc buffer for nand page\n");
 		return -1;
 	}
 
@@ -190,7 +401,7 @@ int image_get_bootfile_usb(devinfo_t *di, uint32_t patpagenum, char* data)
 
 	if (pat[PATPAGE_OFFSET_MAGIC] != le32toh(PATPAGE_MAGIC))
 	{
-		DBGE("Not a PAT page - magic word not found\n");
+		DBGE(di, "Not a PAT page - magic word not found\n");
 		goto fail;
 	};
 
@@ -212,8 +423,124 @@ fail:
 	
 }
 
+/**
+ * Reads the list of data pages of a bootfile from its PAT page
+ * @param di Device info struct of opened and inited device
+ * @param patpagenum Page number of the PAT for the bootfile
+ * @param pages Returns the page numbers, to be freed with free()
+ * @returns Number of pages, <0 on error
+ */
+int image_get_bootfile_pages(devinfo_t *di, uint32_t patpagenum,
+			     uint32_t **pages)
+{
+	uint32_t *pat;
+	int i, n = 0;
+
+	*pages = NULL;
+
+	pat = malloc(di->ps);
+	if (pat == NULL)
+	{
+		DBGE(di, "Can't alloc buffer for nand page\n");
+		return -1;
+	}
+
+	if (cmd_read_flash_page(di, patpagenum, (char *)pat))
+		goto fail;
+
+	if (pat[PATPAGE_OFFSET_MAGIC] != le32toh(PATPAGE_MAGIC))
+	{
+		DBGE(di, "Not a PAT page - magic word not found\n");
+		goto fail;
+	}
+
+	while ((PATPAGE_OFFSET_FIRSTPAGE + n < di->ps / sizeof(uint32_t)) &&
+	       (pat[PATPAGE_OFFSET_FIRSTPAGE + n] != PATPAGE_END))
+		n++;
+
+	*pages = malloc((n ? n : 1) * sizeof(uint32_t));
+	if (*pages == NULL)
+	{
+		DBGE(di, "Can't alloc page list\n");
+		goto fail;
+	}
+
+	for (i = 0; i < n; i++)
+		(*pages)[i] = le32toh(pat[PATPAGE_OFFSET_FIRSTPAGE + i]);
+
+	free(pat);
+	return n;
+
+fail:
+	free(pat);
+	return -1;
+}
+
+/**
+ * Reads data from any offset of the NAND flash
+ * @param di Device info struct of opened and inited device
+ * @param offset Offset to read from
+ * @param data Buffer to fill, len length
+ * @param len Length of data to read
+ * @returns 0 if OK, <0 on error
+ */
+int image_read_usb(devinfo_t *di, int offset, char *data, int len)
+{
+	flashoffsets_t fo;
+	char *pagebuf;
+	int i, skip, n, ret = 0;
+
+	if (len <= 0)
+		return 0;
+
+	flash_offset_calc(di, &fo, offset, len);
+
+	pagebuf = malloc(di->ps);
+	if (pagebuf == NULL)
+	{
+		DBGE(di, "Can't allocate page buffer\n");
+		return -1;
+	}
+
+	skip = offset % di->ps;
+
+	for (i = fo.fp; i <= fo.lp; i++)
+	{
+		n = di->ps - skip;
+		if (n > len)
+			n = len;
+
+		/* Whole pages are read directly into the output */
+		if (n == di->ps)
+		{
+			ret = cmd_read_flash_page(di, i, data);
+		}
+		else
+		{
+			ret = cmd_read_flash_page(di, i, pagebuf);
+			memcpy(data, pagebuf + skip, n);
+		}
+		if (ret)
+		{
+			DBGE(di, "Can't read flash page %08X\n", i);
+			ret = -1;
+			break;
+		}
+
+		data += n;
+		len -= n;
+		skip = 0;
+	}
+
+	free(pagebuf);
+	return ret;
+}
+
 /**
  * Write data to flash pages and verify them
+ * With a checksum helper loaded, all pages are written first and then
+ * checksummed on the device. Pages are read back if there's no helper or
+ * it fails to run.
  * @param di Device info struct of opened and inited device
  * @param page Number of first page to write & verify (needs to be erased first)
  * @param num Number of pages to write to
@@ -226,13 +553,40 @@ static int image_write_verify_pages_usb(devinfo_t *di, int page, int num,
 {
 	int i, ret;
 	char *bufpoi = databuf;
+	int written = 0;
 
-	for (i = page; i < page + num; i++)
+	if (di->helper)
 	{
-		ret = cmd_write_flash_page(di, i, bufpoi);
+		ret = cmd_write_flash_pages(di, page, num, databuf);
 		if (ret)
 			return -1;
 
+		ret = helper_verify_pages(di, page, num, databuf);
+		if (ret == 0)
+		{
+			for (i = 0; i < num; i++)
+				cache_put(di->cache, page + i,
+					  databuf + i * di->ps);
+			return 0;
+		}
+		if (ret > 0)
+			return -1;
+
+		/* Don't try again for the next blocks */
+		DBG(di, "- Checksum helper failed, reading pages back\n");
+		helper_free(di);
+		written = 1;
+	}
+
+	for (i = page; i < page + num; i++)
+	{
+		if (!written)
+		{
+			ret = cmd_write_flash_page(di, i, bufpoi);
+			if (ret)
+				return -1;
+		}
+
 		ret = cmd_read_flash_page(di, i, veribuf);
 		if (ret)
 			return -1;
@@ -240,7 +594,7 @@ static int image_write_verify_pages_usb(devinfo_t *di, int page, int num,
 		ret = memcmp(bufpoi, veribuf, di->ps);
 		if (ret)
 		{
-			DBGE("Flash page error on page %08X at %04X\n",
+			DBGE(di, "Flash page error on page %08X at %04X\n",
 			     i, ret);
 			return -1;
 		}
@@ -251,6 +605,394 @@ static int image_write_verify_pages_usb(devinfo_t *di, int page, int num,
 	return 0;
 }
 
+/**
+ * Erases, programs and verifies whole blocks
+ * The flasher stub does all of it on the device if there's one, otherwise
+ * the pages are written from the host.
+ * @param di Device info struct of opened and inited device
+ * @param firstpage First page of the first block
+ * @param nblocks Number of blocks
+ * @param data Data of the blocks
+ * @param veribuf Buffer for reading back a page (page size length)
+ * @returns 0 if OK, <0 on error
+ */
+int image_write_blocks_usb(devinfo_t *di, uint32_t firstpage, int nblocks,
+			   char *data, char *veribuf)
+{
+	int i, ret;
+
+	/* Let the flasher stub erase, program and verify on the device */
+	if (helper_can_program(di))
+	{
+		cache_invalidate(di->cache, firstpage, nblocks * di->ppb);
+		ret = helper_program_blocks(di, firstpage, nblocks, data);
+		if (ret == 0)
+		{
+			for (i = 0; i < nblocks * di->ppb; i++)
+				cache_put(di->cache, firstpage + i,
+					  data + i * di->ps);
+			return 0;
+		}
+
+		/* Don't try again for the next blocks */
+		DBG(di, "- Flasher stub failed, programming from the host\n");
+		helper_free(di);
+	}
+
+	/* Erase the data blocks needed */
+	ret = cmd_erase_blocks(di, firstpage, nblocks);
+	if (ret)
+	{
+		DBGE(di, "Can't erase blocks\n");
+		return -1;
+	}
+
+	/* Write back all pages and verify them */
+	progress_read_phase(di->prog, PROG_VERIFY);
+	ret = image_write_verify_pages_usb(di, firstpage, nblocks * di->ppb,
+					   data, veribuf);
+	progress_read_phase(di->prog, PROG_READ);
+	if (ret)
+	{
+		DBGE(di, "Error writing flash pages back\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Range of the data that goes into a block of a pipelined write
+ * @param p The write
+ * @param blk Index of the block in the write
+ * @param from Returns the offset in the block the data starts at
+ * @param to Returns the offset in the block the data ends at
+ * @returns Pointer to the data for the block
+ */
+static char *image_pipe_range(wpipe_t *p, int blk, int *from, int *to)
+{
+	int start = (p->fo->fb + blk) * p->di->bs;
+
+	*from = (p->offset > start) ? p->offset - start : 0;
+	*to = (p->offset + p->len < start + p->di->bs) ?
+	      p->offset + p->len - start : p->di->bs;
+
+	return p->data + start + *from - p->offset;
+}
+
+/**
+ * Starts reading in the data of a block, so mmapped input doesn't stall
+ * the pipeline on page faults
+ * @param p The write
+ * @param blk Index of the block in the write, ignored if past the end
+ */
+static void image_pipe_advise(wpipe_t *p, int blk)
+{
+	uintptr_t pgmask = sysconf(_SC_PAGESIZE) - 1;
+	uintptr_t start;
+	int from, to;
+	char *src;
+
+	if (blk >= p->fo->nb)
+		return;
+
+	src = image_pipe_range(p, blk, &from, &to);
+	start = (uintptr_t)src & ~pgmask;
+	madvise((void *)start, (uintptr_t)src + to - from - start,
+		MADV_WILLNEED);
+}
+
+/**
+ * Prefetch stage of a pipelined write: builds the blocks from the read
+ * back first and last block and the data
+ * @param arg The wpipe_t of the write
+ * @returns NULL
+ */
+static void *image_pipe_prefetch(void *arg)
+{
+	wpipe_t *p = arg;
+	int bs = p->di->bs;
+	double start = log_now(), t;
+	int i, from, to;
+	char *src;
+	qbuf_t *b;
+
+	for (i = p->first; i < p->first + WPIPE_NBUFS; i++)
+		image_pipe_advise(p, i);
+
+	for (i = p->first; i < p->fo->nb; i++)
+	{
+		image_pipe_advise(p, i + WPIPE_NBUFS);
+
+		t = log_now();
+		b = queue_get_free(p->fillq);
+		p->wait[WPIPE_PREFETCH] += log_now() - t;
+		if (b == NULL)
+			break;
+
+		src = image_pipe_range(p, i, &from, &to);
+		if ((from > 0) || (to < bs))
+			memcpy(b->data, p->edge[i ? 1 : 0], bs);
+		memcpy(b->data + from, src, to - from);
+		b->len = bs;
+
+		queue_put_full(p->fillq, b);
+	}
+
+	queue_close(p->fillq);
+	p->busy[WPIPE_PREFETCH] = log_now() - start -
+				  p->wait[WPIPE_PREFETCH];
+	return NULL;
+}
+
+/**
+ * Compare stage of a pipelined write: checks the read back blocks against
+ * the data written
+ * @param arg The wpipe_t of the write
+ * @returns NULL
+ */
+static void *image_pipe_compare(void *arg)
+{
+	wpipe_t *p = arg;
+	devinfo_t *di = p->di;
+	double start = log_now(), t;
+	int i, blk = p->first;
+	qbuf_t *b, *c;
+
+	while (1)
+	{
+		t = log_now();
+		c = queue_get_full(p->cmpq);
+		p->wait[WPIPE_COMPARE] += log_now() - t;
+		if (c == NULL)
+			break;
+
+		b = c->link;
+		for (i = 0; i < di->ppb; i++)
+			if (memcmp(b->data + i * di->ps, c->data + i * di->ps,
+				   di->ps))
+				break;
+
+		queue_put_free(p->fillq, b);
+		queue_put_free(p->cmpq, c);
+
+		if (i < di->ppb)
+			DBGE(di, "Flash page error on page %08X\n",
+			     (p->fo->fb + blk) * di->ppb + i);
+		if ((i < di->ppb) || (di->journal &&
+		    journal_block(di->journal, blk, JOURNAL_VERIFIED)))
+		{
+			p->failed = 1;
+			queue_abort(p->fillq);
+			queue_abort(p->cmpq);
+			break;
+		}
+		blk++;
+	}
+
+	p->busy[WPIPE_COMPARE] = log_now() - start - p->wait[WPIPE_COMPARE];
+	return NULL;
+}
+
+/**
+ * Writes multiple blocks with the host side work overlapped with the USB
+ * transfers
+ * A prefetch thread builds the blocks from the data and hints the kernel
+ * to read the data ahead, and a compare thread checks the blocks read
+ * back, so the calling thread only erases, programs and reads back. The
+ * stages hand blocks over through bounded queues. Only the first and last
+ * block are read back before writing, and only if the data doesn't cover
+ * them fully. A checksum helper verifies on the device instead of the
+ * compare stage.
+ * With a journal, the blocks read back and the progress of every block
+ * are recorded, and a write found in the journal carries on from its
+ * first block that wasn't verified, with the blocks saved there.
+ * @param di Device info struct of opened and inited device
+ * @param fo Blocks and pages the write touches
+ * @param offset Offset to write to
+ * @param data Pointer to data to be written
+ * @param len Length of data to be written
+ * @returns 0 if OK, <0 on error
+ */
+static int image_write_pipe_usb(devinfo_t *di, flashoffsets_t *fo,
+				int offset, char *data, int len)
+{
+	static const char *stages[WPIPE_NSTAGES] =
+		{ "prefetch", "USB", "compare" };
+	pthread_t prefetch, compare;
+	double start = log_now(), t;
+	char *edgebuf, *veribuf;
+	int i, blk, page, nedge = 0, ret = -1, resumed = 0;
+	uint32_t crc = 0;
+	qbuf_t *b, *c;
+	wpipe_t p;
+
+	memset(&p, 0, sizeof(wpipe_t));
+	p.di = di;
+	p.fo = fo;
+	p.offset = offset;
+	p.data = data;
+	p.len = len;
+
+	edgebuf = malloc(2 * di->bs + di->ps);
+	if (edgebuf == NULL)
+	{
+		DBGE(di, "Can't allocate block buffer\n");
+		return -1;
+	}
+	veribuf = edgebuf + 2 * di->bs;
+
+	/* A single block partially overwritten at either end is the first */
+	if ((offset % di->bs) || ((fo->nb == 1) && ((offset + len) % di->bs)))
+		p.edge[nedge++] = edgebuf;
+	if ((fo->nb > 1) && ((offset + len) % di->bs))
+		p.edge[1] = edgebuf + nedge++ * di->bs;
+
+	if (di->journal)
+	{
+		crc = crc32c(0, data, len);
+		resumed = journal_resume(di->journal, offset, len, crc, p.edge,
+					 fo->nb, &p.first);
+		if (resumed < 0)
+			goto out;
+		if (p.first == fo->nb)
+		{
+			ret = 0;
+			goto out;
+		}
+	}
+
+	/* Erase, program and verify every block, read back the partial ones */
+	progress_expect(di->prog, (di->helper ? 1ULL : 2ULL) *
+			(fo->nb - p.first) * di->bs +
+			(resumed ? 0 : nedge * di->bs));
+
+	progress_read_phase(di->prog, PROG_READBACK);
+	for (i = 0; (i < 2) && !resumed; i++)
+	{
+		blk = i ? fo->lb : fo->fb;
+		if (p.edge[i] && cmd_read_flash_pages(di, blk * di->ppb,
+						      di->ppb, p.edge[i]))
+		{
+			progress_read_phase(di->prog, PROG_READ);
+			DBGE(di, "Can't read block content\n");
+			goto out;
+		}
+	}
+	progress_read_phase(di->prog, PROG_READ);
+
+	if (di->journal && !resumed &&
+	    journal_begin(di->journal, offset, len, crc, p.edge))
+		goto out;
+
+	p.fillq = queue_create(WPIPE_NBUFS, di->bs);
+	p.cmpq = queue_create(WPIPE_NBUFS, di->bs);
+	if ((p.fillq == NULL) || (p.cmpq == NULL))
+	{
+		DBGE(di, "Can't allocate buffer queue\n");
+		goto out;
+	}
+
+	if (pthread_create(&prefetch, NULL, image_pipe_prefetch, &p))
+	{
+		DBGE(di, "Can't start prefetch thread\n");
+		goto out;
+	}
+	if (pthread_create(&compare, NULL, image_pipe_compare, &p))
+	{
+		DBGE(di, "Can't start compare thread\n");
+		queue_abort(p.fillq);
+		pthread_join(prefetch, NULL);
+		goto out;
+	}
+
+	for (blk = p.first; ; blk++)
+	{
+		t = log_now();
+		b = queue_get_full(p.fillq);
+		p.wait[WPIPE_USB] += log_now() - t;
+		if (b == NULL)
+			break;
+
+		page = (fo->fb + blk) * di->ppb;
+
+		/* The helper may fail and get dropped on any block */
+		if (di->helper)
+		{
+			if (image_write_blocks_usb(di, page, 1, b->data,
+						   veribuf))
+				break;
+			queue_put_free(p.fillq, b);
+			if (di->journal &&
+			    journal_block(di->journal, blk, JOURNAL_VERIFIED))
+				break;
+			continue;
+		}
+
+		if (cmd_erase_blocks(di, page, 1))
+		{
+			DBGE(di, "Can't erase blocks\n");
+			break;
+		}
+		if (di->journal &&
+		    journal_block(di->journal, blk, JOURNAL_ERASED))
+			break;
+		if (cmd_write_flash_pages(di, page, di->ppb, b->data))
+		{
+			DBGE(di, "Error writing flash pages back\n");
+			break;
+		}
+		if (di->journal &&
+		    journal_block(di->journal, blk, JOURNAL_PROGRAMMED))
+			break;
+
+		t = log_now();
+		c = queue_get_free(p.cmpq);
+		p.wait[WPIPE_USB] += log_now() - t;
+		if (c == NULL)
+			break;
+
+		progress_read_phase(di->prog, PROG_VERIFY);
+		i = cmd_read_flash_pages(di, page, di->ppb, c->data);
+		progress_read_phase(di->prog, PROG_READ);
+		if (i)
+		{
+			DBGE(di, "Can't read back flash pages\n");
+			break;
+		}
+
+		c->len = di->bs;
+		c->link = b;
+		queue_put_full(p.cmpq, c);
+	}
+
+	if (blk < fo->nb)
+	{
+		p.failed = 1;
+		queue_abort(p.fillq);
+		queue_abort(p.cmpq);
+	}
+	else
+		queue_close(p.cmpq);
+
+	pthread_join(prefetch, NULL);
+	pthread_join(compare, NULL);
+	p.busy[WPIPE_USB] = log_now() - start - p.wait[WPIPE_USB];
+	ret = p.failed ? -1 : 0;
+	if (!ret && di->journal)
+		ret = journal_end(di->journal);
+
+	for (i = 0; i < WPIPE_NSTAGES; i++)
+		DBG1(di, "Write pipeline %s stage: %.3f s busy, %.3f s "
+		     "waiting\n", stages[i], p.busy[i], p.wait[i]);
+
+out:
+	queue_destroy(p.fillq);
+	queue_destroy(p.cmpq);
+	free(edgebuf);
+	return ret;
+}
+
 /**
  * Writes data at any offset into NAND flash taking care of erasing and
  * re-writing blocks
@@ -266,52 +1008,62 @@ int image_write_random_usb(devinfo_t *di, int offset, char* data, int len)
 {
 	flashoffsets_t fo;
 	char *blockbuf, *veribuf;
-	int ret;
+	int ret, first, last;
 
 	flash_offset_calc(di, &fo, offset, len);
 	
-	DBG2("offset: %08X, len: %08X |", offset, len);
-	DBG2("FB: %08X, LB: %08X, NB: %d, FP: %08X, LP: %08X, NP: %d\n", fo.fb,
-	     fo.lb, fo.nb, fo.fp, fo.lp, fo.np);
+	DBG2(di, "offset: %08X, len: %08X | FB: %08X, LB: %08X, NB: %d, FP: %08X, "
+	     "LP: %08X, NP: %d\n", offset, len, fo.fb, fo.lb, fo.nb, fo.fp,
+	     fo.lp, fo.np);
+
+	/* The flasher stub overlaps the transfers on the device already.
+	 * Journaled writes go block by block whatever their size. */
+	if (((fo.nb >= WPIPE_MINBLOCKS) && !helper_can_program(di)) ||
+	    di->journal)
+		return image_write_pipe_usb(di, &fo, offset, data, len);
 
 	/* Allocate space for all to be erased data plus a page for verifying */
 	blockbuf = malloc(fo.nb * di->bs + di->ps);
 	if (blockbuf == NULL)
 	{
-		DBGE("Can't allocate block buffer\n");
+		DBGE(di, "Can't allocate block buffer\n");
 		return -1;
 	}
 
 	veribuf = blockbuf + fo.nb * di->bs;
 
-	/* Read current blocks content */
-	ret = cmd_read_flash_pages(di, fo.fb * di->ppb, fo.nb * di->ppb,
-				   blockbuf);
-	if (ret)
-	{
-		DBGE("Can't read block content\n");
-		goto fail;
-	}
-	
-	/* Erase the data blocks needed */
-	ret = cmd_erase_blocks(di, fo.fb * di->ppb, fo.nb);
+	/* Erase, program and verify every block, read back the partial ones
+	 * at either end. A checksum helper verifies on the device, a flasher
+	 * stub also erases there but gets the data through its staging
+	 * buffers. */
+	first = (offset % di->bs) || ((fo.nb == 1) && ((offset + len) % di->bs));
+	last = (fo.nb > 1) && ((offset + len) % di->bs);
+	progress_expect(di->prog, (di->helper ? 1ULL : 2ULL) * fo.nb * di->bs +
+			(first + last) * di->bs);
+
+	/* Read current content of the partial blocks */
+	progress_read_phase(di->prog, PROG_READBACK);
+	ret = 0;
+	if (first)
+		ret = cmd_read_flash_pages(di, fo.fb * di->ppb, di->ppb,
+					   blockbuf);
+	if (!ret && last)
+		ret = cmd_read_flash_pages(di, fo.lb * di->ppb, di->ppb,
+					   blockbuf + (fo.nb - 1) * di->bs);
+	progress_read_phase(di->prog, PROG_READ);
 	if (ret)
 	{
-		DBGE("Can't erase blocks\n");
+		DBGE(di, "Can't read block content\n");
 		goto fail;
 	}
 
 	/* Copy data into the block buffer, overwriting previous content */
 	memcpy(blockbuf + (offset - (fo.fb * di->bs)), data, len);
 
-	/* Write back all pages and verify them */
-	ret = image_write_verify_pages_usb(di, fo.fb * di->ppb, fo.nb * di->ppb,
-					   blockbuf, veribuf);
+	ret = image_write_blocks_usb(di, fo.fb * di->ppb, fo.nb, blockbuf,
+				     veribuf);
 	if (ret)
-	{
-		DBGE("Error writing flash pages back\n");
 		goto fail;
-	}
 
 	free(blockbuf);
 	return 0;
@@ -329,8 +1081,8 @@ fail:
  * @param size Size of the file this PAT belongs to
  * @param id ID field of PAT
  */
-static void image_fill_pat(devinfo_t *di, int datapage, char *patbuf,
-			   uint32_t size, uint32_t id)
+void image_fill_pat(devinfo_t *di, int datapage, char *patbuf,
+		    uint32_t size, uint32_t id)
 {
 	uint32_t *pat=(uint32_t*)patbuf;
 	int numpages = ((size - 1) / di->ps) + 1;
@@ -349,6 +1101,53 @@ static void image_fill_pat(devinfo_t *di, int datapage, char *patbuf,
 	}
 }
 
+/**
+ * Maximum length of a bootfile that fits into a 1 page PAT
+ * The page holds the header, a word per data page and the end marker.
+ * @param di Device info struct of inited device
+ * @returns Length in bytes
+ */
+int image_bootfile_maxlen(devinfo_t *di)
+{
+	return (di->ps / 4 - PATPAGE_OFFSET_FIRSTPAGE - 1) * di->ps;
+}
+
+/**
+ * Writes the PAT page of a bootfile whose data is already in the flash
+ * @param di Device info struct of opened and inited device
+ * @param id ID field of PAT
+ * @param patpage Number of page to write PAT to
+ * @param datapage Number of first data page
+ * @param len Length of the bootfile
+ * @returns 0 if OK, <0 on error
+ */
+int image_write_pat_usb(devinfo_t *di, uint32_t id, int patpage,
+			int datapage, int len)
+{
+	int ret;
+	int ps = di->ps;
+	char *patbuf;
+
+	patbuf = malloc(ps);
+	if (patbuf == NULL)
+	{
+		DBGE(di, "Can't allocate buffer for pat\n");
+		return -1;
+	}
+	memset(patbuf, 0xFF, ps);
+
+	/* Create PAT */
+	image_fill_pat(di, datapage, patbuf, len, id);
+
+	/* Write PAT */
+	ret = image_write_random_usb(di, patpage * di->ps, patbuf, ps);
+	if (ret)
+		DBGE(di, "Can't write PAT page - 2nd round\n");
+
+	free(patbuf);
+	return ret;
+}
+
 /**
  * Writes a bootfile to the flash, including its patpage
  * @param di Device info struct of opened and inited device
@@ -361,57 +1160,28 @@ static void image_fill_pat(devinfo_t *di, int datapage, char *patbuf,
  *       the block after writing data
  * NOTE: This currently only supports file sizes which require a PAT
  * 	 of maximum 1 page length
- * 	 2K pages: 4.161.536 bytes
- * 	 4K pages: 16.711.680 bytes
+ * 	 2K pages: 1.038.336 bytes
+ * 	 4K pages: 4.173.824 bytes
  * TODO: Implement multi-page PAT support. Test if romboot supports it at all
  */
 int image_write_bootfile_usb(devinfo_t *di, uint32_t id, int patpage,
 			     int datapage, char* data, int len)
 {
 	int ret;
-	int ps = di->ps;
-	flashoffsets_t fo;
-	char *patbuf;
-
-	flash_offset_calc(di, &fo, datapage * di->ps, len);
 
-	if (len > (ps - 4 * sizeof(uint32_t)) * ps)
-	{
-		DBGE("Data length bigger than what fits to 1 PAT page\n");
-		return -1;
-	}
-	
-	patbuf = malloc(ps);
-	if (patbuf == NULL)
+	if (len > image_bootfile_maxlen(di))
 	{
-		DBGE("Can't allocate buffer for pat\n");
+		DBGE(di, "Data length bigger than what fits to 1 PAT page\n");
 		return -1;
 	}
-	memset(patbuf, 0xFF, ps);
 
 	/* Write data */
 	ret = image_write_random_usb(di, datapage * di->ps, data, len);
 	if (ret)
 	{
-		DBGE("Can't write bootfile data\n");
-		goto fail;
-	}
-
-	/* Create PAT */
-	image_fill_pat(di, datapage, patbuf, len, id);
-
-	/* Write PAT */
-	ret = image_write_random_usb(di, patpage * di->ps, patbuf, ps);
-	if (ret)
-	{
-		DBGE("Can't write PAT page - 2nd round\n");
-		goto fail;
+		DBGE(di, "Can't write bootfile data\n");
+		return -1;
 	}
 
-	free(patbuf);
-	return 0;
-
-fail:
-	free(patbuf);
-	return -1;
+	return image_write_pat_usb(di, id, patpage, datapage, len);
 }
@@ -0,0 +1,457 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
+#include <usb.h>
+
+#include "sb.h"
+
+#define JOURNAL_MAGIC		0x4C4E524AUL	/* "JRNL" */
+#define JOURNAL_SYNC_BLOCKS	8	/* Block records per fsync */
+
+/** Record types */
+enum
+{
+	JOURNAL_HEADER = 0,	/**< Flash geometry: ps, ppb, tb */
+	JOURNAL_WRITE,		/**< Write started: offset, len, data crc32c,
+				     edges, followed by the saved blocks */
+	JOURNAL_BLOCK,		/**< Block progress: block index, state */
+	JOURNAL_DONE		/**< Write finished */
+};
+
+/** Record in the journal file, in host byte order */
+typedef struct
+{
+	uint32_t magic;		/**< JOURNAL_MAGIC */
+	uint32_t type;		/**< Type of the record */
+	uint32_t seq;		/**< Number of the write in the journal */
+	uint32_t arg[4];	/**< Depends on the type */
+	uint32_t len;		/**< Length of the data following the record */
+	uint32_t crc;		/**< crc32c of the record with this 0 and the
+				     data */
+} __attribute__((packed)) jrec_t;
+
+/** A write found in the journal */
+typedef struct
+{
+	uint32_t offset;	/**< Flash offset of the data */
+	uint32_t len;		/**< Length of the data */
+	uint32_t crc;		/**< crc32c of the data */
+	uint32_t edges;		/**< Which of the first and last block are
+				     saved, bit 0 and 1 */
+	off_t edgepos;		/**< Position of the saved blocks in the file */
+	int verified;		/**< Blocks verified from the first one on */
+	int done;		/**< All blocks verified */
+} jwrite_t;
+
+struct journal
+{
+	devinfo_t *di;
+	char *path;		/**< Journal file */
+	int fd;
+	jwrite_t *writes;	/**< Writes recorded by the interrupted run */
+	int nwrites;		/**< Number of writes, new ones included */
+	int next;		/**< Next recorded write to resume */
+	uint32_t seq;		/**< Number of the running write */
+	int unsynced;		/**< Block records since the last fsync */
+	pthread_mutex_t lock;	/**< Block records come from two threads */
+};
+
+/**
+ * Appends a record to the journal
+ * @param j The journal
+ * @param type Type of the record
+ * @param arg Arguments of the record, 4 words
+ * @param data Buffers of data following the record
+ * @param ndata Number of buffers
+ * @param dlen Length of each buffer
+ * @returns 0 if OK, <0 on error
+ */
+static int journal_put(journal_t *j, uint32_t type, uint32_t *arg,
+		       char **data, int ndata, uint32_t dlen)
+{
+	struct iovec iov[3];
+	jrec_t rec;
+	int i, total = sizeof(jrec_t);
+
+	memset(&rec, 0, sizeof(jrec_t));
+	rec.magic = JOURNAL_MAGIC;
+	rec.type = type;
+	rec.seq = j->seq;
+	memcpy(rec.arg, arg, sizeof(rec.arg));
+	rec.len = ndata * dlen;
+
+	rec.crc = crc32c(0, &rec, sizeof(jrec_t));
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(jrec_t);
+	for (i = 0; i < ndata; i++)
+	{
+		rec.crc = crc32c(rec.crc, data[i], dlen);
+		iov[i + 1].iov_base = data[i];
+		iov[i + 1].iov_len = dlen;
+		total += dlen;
+	}
+
+	if (writev(j->fd, iov, ndata + 1) != total)
+	{
+		DBGE(j->di, "Can't write journal: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Flushes the journal to the disk
+ * @param j The journal
+ * @returns 0 if OK, <0 on error
+ */
+static int journal_sync(journal_t *j)
+{
+	j->unsynced = 0;
+	if (fdatasync(j->fd))
+	{
+		DBGE(j->di, "Can't sync journal: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Reads the records of an interrupted run, up to the first torn one
+ * @param j The journal, with the file opened
+ * @returns 0 if OK, <0 on error
+ */
+static int journal_load(journal_t *j)
+{
+	devinfo_t *di = j->di;
+	off_t pos = 0, good = 0;
+	jwrite_t *w;
+	uint32_t crc;
+	jrec_t rec;
+	char *buf;
+
+	buf = malloc(2 * di->bs);
+	if (buf == NULL)
+		return -1;
+
+	while (pread(j->fd, &rec, sizeof(jrec_t), pos) == sizeof(jrec_t))
+	{
+		crc = rec.crc;
+		rec.crc = 0;
+		if ((rec.magic != JOURNAL_MAGIC) || (rec.len > 2 * di->bs) ||
+		    (pread(j->fd, buf, rec.len, pos + sizeof(jrec_t)) !=
+		     rec.len) ||
+		    (crc32c(crc32c(0, &rec, sizeof(jrec_t)), buf, rec.len) !=
+		     crc))
+			break;
+
+		if ((pos == 0) != (rec.type == JOURNAL_HEADER))
+			break;
+
+		switch (rec.type)
+		{
+		case JOURNAL_HEADER:
+			if ((rec.arg[0] != di->ps) || (rec.arg[1] != di->ppb) ||
+			    (rec.arg[2] != di->tb))
+			{
+				DBGE(di, "Journal is of another flash\n");
+				free(buf);
+				return -1;
+			}
+			break;
+		case JOURNAL_WRITE:
+			if (rec.seq != j->nwrites)
+				goto torn;
+			w = realloc(j->writes,
+				    (j->nwrites + 1) * sizeof(jwrite_t));
+			if (w == NULL)
+			{
+				free(buf);
+				return -1;
+			}
+			j->writes = w;
+			w += j->nwrites++;
+			memset(w, 0, sizeof(jwrite_t));
+			w->offset = rec.arg[0];
+			w->len = rec.arg[1];
+			w->crc = rec.arg[2];
+			w->edges = rec.arg[3];
+			w->edgepos = pos + sizeof(jrec_t);
+			break;
+		case JOURNAL_BLOCK:
+			if (rec.seq >= j->nwrites)
+				goto torn;
+			w = &j->writes[rec.seq];
+			if ((rec.arg[1] == JOURNAL_VERIFIED) &&
+			    (rec.arg[0] == w->verified))
+				w->verified++;
+			break;
+		case JOURNAL_DONE:
+			if (rec.seq >= j->nwrites)
+				goto torn;
+			j->writes[rec.seq].done = 1;
+			break;
+		default:
+			goto torn;
+		}
+
+		pos += sizeof(jrec_t) + rec.len;
+		good = pos;
+	}
+
+torn:
+	free(buf);
+
+	if (good == 0)
+	{
+		DBGE(di, "No journal to resume in %s\n", j->path);
+		return -1;
+	}
+
+	/* Append after the last complete record */
+	if (ftruncate(j->fd, good) || (lseek(j->fd, good, SEEK_SET) != good))
+	{
+		DBGE(di, "Can't truncate journal: %s\n", strerror(errno));
+		return -1;
+	}
+
+	DBG1(di, "Journal has %d write(s)\n", j->nwrites);
+	return 0;
+}
+
+/**
+ * Opens a write journal, called by sb_setup() once the flash geometry is
+ * known
+ * @param di Device info struct of opened and inited device
+ * @param path Journal file
+ * @param resume Resume the writes recorded in the file if set, start a
+ *	  new journal otherwise
+ * @returns Pointer to the journal, NULL on error
+ */
+journal_t *journal_open(devinfo_t *di, char *path, int resume)
+{
+	uint32_t arg[4] = { di->ps, di->ppb, di->tb, 0 };
+	journal_t *j;
+
+	j = calloc(1, sizeof(journal_t));
+	if (j == NULL)
+		return NULL;
+
+	j->di = di;
+	j->path = path;
+	pthread_mutex_init(&j->lock, NULL);
+
+	j->fd = open(path, resume ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC,
+		     0644);
+	if (j->fd == -1)
+	{
+		DBGE(di, "Can't open journal %s: %s\n", path, strerror(errno));
+		goto fail;
+	}
+
+	if (resume)
+	{
+		if (journal_load(j))
+			goto fail;
+	}
+	else if (journal_put(j, JOURNAL_HEADER, arg, NULL, 0, 0) ||
+		 journal_sync(j))
+		goto fail;
+
+	return j;
+
+fail:
+	journal_close(j, 0);
+	return NULL;
+}
+
+/**
+ * Closes a journal
+ * @param j The journal, may be NULL
+ * @param done The journaled writes are complete, delete the file if set
+ */
+void journal_close(journal_t *j, int done)
+{
+	if (j == NULL)
+		return;
+
+	if (j->fd != -1)
+	{
+		close(j->fd);
+		if (done)
+			unlink(j->path);
+		else if (j->nwrites)
+			DBG(j->di, "- Journal kept in %s\n", j->path);
+	}
+
+	pthread_mutex_destroy(&j->lock);
+	free(j->writes);
+	free(j);
+}
+
+/**
+ * Looks up a write in the records of the interrupted run
+ * Writes are expected in the same order as they were journaled. For a
+ * write found, the blocks saved before it erased the first and last
+ * block are returned, as the flash may not hold them anymore.
+ * @param j The journal
+ * @param offset Flash offset of the data
+ * @param len Length of the data
+ * @param crc crc32c of the data
+ * @param edge Buffers for the first and last block, NULL for a block that
+ *	  is fully overwritten
+ * @param nb Number of blocks of the write
+ * @param first Returns the first block still to write, nb if the write is
+ *	  done
+ * @returns 1 if the write was found, 0 if it's a new one, <0 on error
+ */
+int journal_resume(journal_t *j, uint32_t offset, uint32_t len, uint32_t crc,
+		   char **edge, int nb, int *first)
+{
+	devinfo_t *di = j->di;
+	jwrite_t *w;
+	off_t pos;
+	int i;
+
+	if (j->next >= j->nwrites)
+		return 0;
+
+	w = &j->writes[j->next];
+	if ((w->offset != offset) || (w->len != len) || (w->crc != crc) ||
+	    (w->edges != ((edge[0] ? 1 : 0) | (edge[1] ? 2 : 0))))
+	{
+		DBGE(di, "Journal has a write of %08X bytes at %08X, not of "
+		     "%08X bytes at %08X\n", w->len, w->offset, len, offset);
+		return -1;
+	}
+
+	pos = w->edgepos;
+	for (i = 0; i < 2; i++)
+	{
+		if (edge[i] == NULL)
+			continue;
+		if (pread(j->fd, edge[i], di->bs, pos) != di->bs)
+		{
+			DBGE(di, "Can't read journal: %s\n", strerror(errno));
+			return -1;
+		}
+		pos += di->bs;
+	}
+
+	j->seq = j->next++;
+	*first = w->done ? nb : w->verified;
+
+	if (w->done)
+		DBG1(di, "Write at %08X done already\n", offset);
+	else
+		DBG(di, "- Resuming write at %08X from block %d of %d\n",
+		    offset, *first, nb);
+
+	return 1;
+}
+
+/**
+ * Records a new write, with the first and last block saved as they were
+ * before erasing
+ * @param j The journal
+ * @param offset Flash offset of the data
+ * @param len Length of the data
+ * @param crc crc32c of the data
+ * @param edge First and last block, NULL for a block that is fully
+ *	  overwritten
+ * @returns 0 if OK, <0 on error
+ */
+int journal_begin(journal_t *j, uint32_t offset, uint32_t len, uint32_t crc,
+		  char **edge)
+{
+	uint32_t arg[4] = { offset, len, crc, 0 };
+	char *data[2];
+	int n = 0;
+
+	if (edge[0])
+	{
+		data[n++] = edge[0];
+		arg[3] |= 1;
+	}
+	if (edge[1])
+	{
+		data[n++] = edge[1];
+		arg[3] |= 2;
+	}
+
+	j->seq = j->nwrites++;
+	j->next = j->nwrites;
+
+	/* The saved blocks have to be on disk before erasing */
+	if (journal_put(j, JOURNAL_WRITE, arg, data, n, j->di->bs) ||
+	    journal_sync(j))
+		return -1;
+
+	return 0;
+}
+
+/**
+ * Records the progress of a block, synced in batches
+ * A block whose records got lost is simply written again on resume.
+ * @param j The journal
+ * @param blk Index of the block in the write
+ * @param state JOURNAL_ERASED, JOURNAL_PROGRAMMED or JOURNAL_VERIFIED
+ * @returns 0 if OK, <0 on error
+ */
+int journal_block(journal_t *j, int blk, int state)
+{
+	uint32_t arg[4] = { blk, state, 0, 0 };
+	int ret;
+
+	pthread_mutex_lock(&j->lock);
+	ret = journal_put(j, JOURNAL_BLOCK, arg, NULL, 0, 0);
+	if (!ret && (state == JOURNAL_VERIFIED) &&
+	    (++j->unsynced >= JOURNAL_SYNC_BLOCKS))
+		ret = journal_sync(j);
+	pthread_mutex_unlock(&j->lock);
+
+	return ret;
+}
+
+/**
+ * Records that the running write is complete
+ * @param j The journal
+ * @returns 0 if OK, <0 on error
+ */
+int journal_end(journal_t *j)
+{
+	uint32_t arg[4] = { 0, 0, 0, 0 };
+
+	if (journal_put(j, JOURNAL_DONE, arg, NULL, 0, 0))
+		return -1;
+
+	return journal_sync(j);
+}
@@ -0,0 +1,421 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <usb.h>
+
+#include "sb.h"
+
+/* What a page of the range is used for */
+#define LAYOUT_PAT	1
+#define LAYOUT_DATA	2
+#define LAYOUT_OTHER	3	/* Not erased, but in no bootfile */
+#define LAYOUT_ERASED	4	/* Read back as erased */
+
+#define LAYOUT_FREE(lo, page)	(((lo)->used[(page) - (lo)->firstpage] == 0) || \
+				 ((lo)->used[(page) - (lo)->firstpage] == \
+				  LAYOUT_ERASED))
+
+/** Bootfile to place */
+typedef struct
+{
+	char *fname;		/**< Input file */
+	int fd;			/**< Its descriptor, -1 if not open */
+	char *data;		/**< Its mmap */
+	int len;		/**< Its length */
+	int patpage;		/**< PAT page chosen for it */
+	int datapage;		/**< First data page chosen for it */
+} lfile_t;
+
+/** Layout of new bootfiles in a page range */
+typedef struct
+{
+	int firstpage;		/**< First page of the range */
+	int npages;		/**< Number of pages in the range */
+	char *used;		/**< What the pages are used for, 0 if not known */
+	int patpage;		/**< First page of the new PATs */
+	int patfresh;		/**< The PAT block holds nothing yet */
+	int runpage;		/**< First page of the data run */
+	int runblocks;		/**< Blocks of the data run */
+} layout_t;
+
+/**
+ * Marks the PAT and data pages of the bootfiles in the range as used
+ * @param di Device info struct of opened and inited device
+ * @param lo The layout, with the range set
+ * @returns 0 if OK, <0 on error
+ */
+static int layout_scan(devinfo_t *di, layout_t *lo)
+{
+	bootfile_info_t *binfs;
+	uint32_t *pages;
+	int i, j, n, np;
+
+	lo->used = calloc(lo->npages, 1);
+	if (lo->used == NULL)
+		return -1;
+
+	n = image_scan_pats_usb(di, lo->firstpage, lo->npages, &binfs);
+	if (n < 0)
+		return -1;
+
+	for (i = 0; i < n; i++)
+	{
+		np = image_get_bootfile_pages(di, binfs[i].patpage, &pages);
+		if (np < 0)
+		{
+			free(binfs);
+			return -1;
+		}
+
+		lo->used[binfs[i].patpage - lo->firstpage] = LAYOUT_PAT;
+		for (j = 0; j < np; j++)
+			if ((pages[j] >= lo->firstpage) &&
+			    (pages[j] < lo->firstpage + lo->npages))
+				lo->used[pages[j] - lo->firstpage] = LAYOUT_DATA;
+		free(pages);
+	}
+
+	DBG1(di, "Layout: %d bootfile(s) in the range already\n", n);
+	free(binfs);
+	return 0;
+}
+
+/**
+ * Tells what a block of the range holds
+ * @param di Device info struct of inited device
+ * @param lo The layout
+ * @param blk Block number
+ * @returns LAYOUT_DATA if it holds data, LAYOUT_PAT if only PATs, 0 if
+ *	    nothing
+ */
+static int layout_block(devinfo_t *di, layout_t *lo, int blk)
+{
+	int i, page, what = 0;
+
+	for (i = 0; i < di->ppb; i++)
+	{
+		page = blk * di->ppb + i - lo->firstpage;
+		if ((lo->used[page] == LAYOUT_DATA) ||
+		    (lo->used[page] == LAYOUT_OTHER))
+			what = LAYOUT_DATA;
+		else if ((lo->used[page] == LAYOUT_PAT) && !what)
+			what = LAYOUT_PAT;
+	}
+
+	return what;
+}
+
+/**
+ * Tells if the free pages of a stretch are erased
+ * Pages in no bootfile may still hold something, e.g. the firmware
+ * itself, so the pages a layout is about to use are read back first. The
+ * ones that aren't erased are marked LAYOUT_OTHER and never used.
+ * @param di Device info struct of opened and inited device
+ * @param lo The layout
+ * @param page First page of the stretch
+ * @param npages Number of pages
+ * @returns 1 if all are erased, 0 if not, <0 on error
+ */
+static int layout_erased(devinfo_t *di, layout_t *lo, int page, int npages)
+{
+	char *buf;
+	int i, j, ret = 1;
+
+	buf = malloc(di->ps);
+	if (buf == NULL)
+		return -1;
+
+	for (i = page; i < page + npages; i++)
+	{
+		if (lo->used[i - lo->firstpage] == LAYOUT_ERASED)
+			continue;
+		if (cmd_read_flash_pages(di, i, 1, buf))
+		{
+			DBGE(di, "Can't read page %08X\n", i);
+			ret = -1;
+			break;
+		}
+
+		for (j = 0; (j < di->ps) && (buf[j] == (char)0xFF); j++)
+			;
+		if (j == di->ps)
+			lo->used[i - lo->firstpage] = LAYOUT_ERASED;
+		else
+		{
+			lo->used[i - lo->firstpage] = LAYOUT_OTHER;
+			ret = 0;
+		}
+	}
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * Finds a stretch of free pages in a block
+ * @param di Device info struct of inited device
+ * @param lo The layout
+ * @param blk Block number
+ * @param npages Number of pages
+ * @returns First page of the stretch, <0 if there's none
+ */
+static int layout_stretch(devinfo_t *di, layout_t *lo, int blk, int npages)
+{
+	int i, run;
+
+	for (i = 0, run = 0; (i < di->ppb) && (run < npages); i++)
+		run = LAYOUT_FREE(lo, blk * di->ppb + i) ? run + 1 : 0;
+
+	return (run == npages) ? blk * di->ppb + i - npages : -1;
+}
+
+/**
+ * Computes where new bootfiles go, touching as few blocks as possible
+ * Each block written costs an erase and, if it's partially used, a read
+ * back. With one page of PAT per bootfile that has to be in another
+ * block than its data, the fewest blocks are touched by packing all PATs
+ * into a single block and all data, page aligned one file after the
+ * other, into one run of free blocks: 1 + ceil(data pages / ppb) blocks.
+ * The PATs go to a block of PATs only that has room for all of them, so
+ * the existing PAT index grows in place, or to a free block if there's
+ * none. The data run goes to the first free blocks after it. Pages of
+ * the range not used by the bootfiles found in it count as free if they
+ * read back as erased.
+ * @param di Device info struct of opened and inited device
+ * @param lo The layout, with the range set
+ * @param files The bootfiles, data pages are filled in
+ * @param nfiles Number of bootfiles
+ * @returns 0 if OK, <0 on error
+ */
+static int layout_place(devinfo_t *di, layout_t *lo, lfile_t *files,
+			int nfiles)
+{
+	int fb = (lo->firstpage + di->ppb - 1) / di->ppb;
+	int lb = (lo->firstpage + lo->npages) / di->ppb;
+	int i, blk, page, run, ret, datapages = 0;
+
+	if (nfiles > di->ppb)
+	{
+		DBGE(di, "More bootfiles than fit into a block of PATs\n");
+		return -1;
+	}
+
+	for (i = 0; i < nfiles; i++)
+		datapages += (files[i].len - 1) / di->ps + 1;
+	lo->runblocks = (datapages - 1) / (int)di->ppb + 1;
+
+	/* A PAT block with a free stretch for all, or else a free block */
+	lo->patpage = -1;
+	for (blk = fb; (blk < lb) && (lo->patpage < 0); blk++)
+	{
+		if (layout_block(di, lo, blk) != LAYOUT_PAT)
+			continue;
+		while ((page = layout_stretch(di, lo, blk, nfiles)) >= 0)
+		{
+			ret = layout_erased(di, lo, page, nfiles);
+			if (ret < 0)
+				return -1;
+			if (ret)
+			{
+				lo->patpage = page;
+				break;
+			}
+		}
+	}
+	for (blk = fb; (blk < lb) && (lo->patpage < 0); blk++)
+	{
+		if (layout_block(di, lo, blk))
+			continue;
+		ret = layout_erased(di, lo, blk * di->ppb, di->ppb);
+		if (ret < 0)
+			return -1;
+		if (ret)
+		{
+			lo->patpage = blk * di->ppb;
+			lo->patfresh = 1;
+		}
+	}
+	if (lo->patpage < 0)
+	{
+		DBGE(di, "No room for the PATs in the range\n");
+		return -1;
+	}
+
+	/* First fit of the data run in free blocks */
+	lo->runpage = -1;
+	for (blk = fb, run = 0; blk < lb; blk++)
+	{
+		ret = !layout_block(di, lo, blk) &&
+		      (blk != lo->patpage / di->ppb);
+		if (ret)
+			ret = layout_erased(di, lo, blk * di->ppb, di->ppb);
+		if (ret < 0)
+			return -1;
+		run = ret ? run + 1 : 0;
+		if (run == lo->runblocks)
+		{
+			lo->runpage = (blk - run + 1) * di->ppb;
+			break;
+		}
+	}
+	if (lo->runpage < 0)
+	{
+		DBGE(di, "No %d free blocks in a row for %d data pages in the "
+		     "range\n", lo->runblocks, datapages);
+		return -1;
+	}
+
+	for (i = 0, datapages = 0; i < nfiles; i++)
+	{
+		files[i].patpage = lo->patpage + i;
+		files[i].datapage = lo->runpage + datapages;
+		datapages += (files[i].len - 1) / di->ps + 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes the data run and the PATs of a layout
+ * Whole blocks of the data run are written, padded with erased pages, so
+ * none of them is read back. The PATs go in a single write.
+ * @param di Device info struct of opened and inited device
+ * @param lo The layout
+ * @param files The bootfiles
+ * @param nfiles Number of bootfiles
+ * @returns 0 if OK, <0 on error
+ */
+static int layout_write(devinfo_t *di, layout_t *lo, lfile_t *files,
+			int nfiles)
+{
+	char *buf;
+	int i, len, ret;
+
+	len = lo->runblocks * di->bs;
+	buf = malloc(len > nfiles * di->ps ? len : nfiles * di->ps);
+	if (buf == NULL)
+	{
+		DBGE(di, "Can't allocate layout buffer\n");
+		return -1;
+	}
+
+	memset(buf, 0xFF, len);
+	for (i = 0; i < nfiles; i++)
+		memcpy(buf + (files[i].datapage - lo->runpage) * di->ps,
+		       files[i].data, files[i].len);
+
+	ret = image_write_random_usb(di, lo->runpage * di->ps, buf, len);
+	if (ret)
+	{
+		DBGE(di, "Can't write bootfile data\n");
+		goto out;
+	}
+
+	/* A fresh PAT block gets erased pages after the PATs as well */
+	len = lo->patfresh ? di->bs : nfiles * di->ps;
+	memset(buf, 0xFF, len);
+	for (i = 0; i < nfiles; i++)
+		image_fill_pat(di, files[i].datapage, buf + i * di->ps,
+			       files[i].len, BOOTFILE_DEFAULT_ID);
+
+	ret = image_write_random_usb(di, lo->patpage * di->ps, buf, len);
+	if (ret)
+		DBGE(di, "Can't write PAT pages\n");
+
+out:
+	free(buf);
+	return ret;
+}
+
+/**
+ * Adds bootfiles to a page range, choosing their PAT and data pages so
+ * the fewest blocks get erased and read back
+ * The bootfiles already in the range are kept.
+ * @param di Device info struct of opened and inited device
+ * @param firstpage First page of the range
+ * @param npages Number of pages in the range
+ * @param fnames The bootfile images
+ * @param nfiles Number of bootfiles
+ * @returns 0 if OK, <0 on error
+ */
+int layout_write_bootfiles(devinfo_t *di, int firstpage, int npages,
+			   char **fnames, int nfiles)
+{
+	lfile_t *files;
+	layout_t lo;
+	int i, ret = -1;
+
+	memset(&lo, 0, sizeof(layout_t));
+	lo.firstpage = firstpage;
+	lo.npages = npages;
+	if ((npages == 0) || (firstpage + npages > di->tb * di->ppb))
+		lo.npages = di->tb * di->ppb - firstpage;
+
+	files = calloc(nfiles, sizeof(lfile_t));
+	if (files == NULL)
+		return -1;
+	for (i = 0; i < nfiles; i++)
+		files[i].fd = -1;
+
+	for (i = 0; i < nfiles; i++)
+	{
+		files[i].fname = fnames[i];
+		if (file_open_mmap(di, fnames[i], &files[i].fd, &files[i].len,
+				   &files[i].data))
+			goto out;
+		if ((files[i].len == 0) ||
+		    (files[i].len > image_bootfile_maxlen(di)))
+		{
+			DBGE(di, "%s doesn't fit into a bootfile\n", fnames[i]);
+			goto out;
+		}
+	}
+
+	if (layout_scan(di, &lo) || layout_place(di, &lo, files, nfiles))
+		goto out;
+
+	DBG(di, "- Layout touches %d block(s), reads back %d, PATs at page "
+	    "%08X, data at page %08X\n", lo.runblocks + 1, !lo.patfresh,
+	    lo.patpage, lo.runpage);
+	for (i = 0; i < nfiles; i++)
+		DBG(di, "- %s: PAT page %08X, data pages %08X-%08X\n",
+		    files[i].fname, files[i].patpage, files[i].datapage,
+		    files[i].datapage + (files[i].len - 1) / di->ps);
+
+	ret = layout_write(di, &lo, files, nfiles);
+
+out:
+	for (i = 0; i < nfiles; i++)
+		if (files[i].fd != -1)
+		{
+			munmap(files[i].data, files[i].len);
+			close(files[i].fd);
+		}
+	free(files);
+	free(lo.used);
+	return ret;
+}
@@ -0,0 +1,509 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define LIB_RAM_CHUNK		0x1000	/* RAM bytes moved in one transaction */
+
+/* Flash config data for the Letcool device with Micron 29F32G08 flash */
+static const char fc_29F32G08[sizeof(nandconf_t)] =
+{
+				0x80, 0x00, 0x80, 0x10, 0x00, 0x10, 0x80, 0x00,
+				0x20, 0x00, 0x20, 0x00, 0x00, 0x20, 0x0D, 0x00,
+				0x00, 0x00, 0x00, 0x00, 0x5d, 0xf0, 0x07, 0x00,
+				0x80, 0x00, 0x05, 0x00, 0x05, 0x00, 0x00, 0x00,
+				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00,
+				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00,
+				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00,
+				0x2c, 0xd7, 0x94, 0x3e, 0x84, 0x00, 0x00, 0x00
+};
+
+/**
+ * Creates a context with the default options: the built-in flash config is
+ * sent, messages go to stdout
+ * @returns Pointer to the context, NULL on error
+ */
+devinfo_t *sb_create(void)
+{
+	devinfo_t *di;
+
+	di = calloc(1, sizeof(devinfo_t));
+	if (di == NULL)
+		return NULL;
+
+	di->flashconfig = 1;
+
+	return di;
+}
+
+/**
+ * Closes the device of a context if it's open and frees the context
+ * @param di The context, may be NULL
+ */
+void sb_destroy(devinfo_t *di)
+{
+	if (di == NULL)
+		return;
+
+	sb_close(di);
+	helper_free(di);
+	free(di);
+}
+
+/**
+ * Sets where the messages of a context go
+ * @param di The context
+ * @param fn Log sink, NULL for stdout
+ * @param arg Argument passed to the sink
+ * @param level Debug level, 0 for info and errors only, up to 3
+ */
+void sb_set_log(devinfo_t *di, sb_logfn_t fn, void *arg, int level)
+{
+	di->logfn = fn;
+	di->logarg = arg;
+	di->dl = level;
+}
+
+/**
+ * Sets the options of a context, to be used before sb_setup()
+ * @param di The context
+ * @param opts SB_OPT_ flags
+ */
+void sb_set_options(devinfo_t *di, int opts)
+{
+	di->initdram = !!(opts & SB_OPT_INITDRAM);
+	di->flashconfig = !(opts & SB_OPT_NOFLASHCONFIG);
+	di->odirect = !!(opts & SB_OPT_ODIRECT);
+}
+
+/**
+ * Sets the checksum files written next to dump files
+ * @param di The context
+ * @param list Comma separated list of crc32c and sha256, NULL for none
+ * @returns 0 if OK, <0 on error
+ */
+int sb_set_hashes(devinfo_t *di, char *list)
+{
+	int types = 0;
+
+	if (list)
+	{
+		types = hash_parse_types(list);
+		if (types < 0)
+			return -1;
+	}
+
+	di->hashtypes = types;
+	return 0;
+}
+
+/**
+ * Loads a checksum helper, flash writes are then verified by checksumming
+ * the pages on the device instead of reading them back
+ * The helper runs from DRAM, so the DRAM has to be inited.
+ * @param di The context
+ * @param fname Helper image file, NULL to verify by reading back
+ * @returns 0 if OK, <0 on error
+ */
+int sb_set_helper(devinfo_t *di, char *fname)
+{
+	if (fname == NULL)
+	{
+		helper_free(di);
+		return 0;
+	}
+
+	return helper_load(di, fname);
+}
+
+/**
+ * Sets the size of the flash page cache, which keeps pages read or written
+ * during a session so they aren't read over USB again
+ * The cache is created by sb_setup() and dropped by sb_close().
+ * @param di The context
+ * @param bytes Memory for cached pages, 0 for no cache
+ */
+void sb_set_cache(devinfo_t *di, unsigned long bytes)
+{
+	cache_destroy(di->cache);
+	di->cache = NULL;
+	di->cachesize = bytes;
+}
+
+/**
+ * Sets the journal flash writes are recorded in, so an interrupted write
+ * can be resumed from the block it stopped at
+ * The journal is opened by sb_setup(). It's kept if the writes don't
+ * complete, until sb_finish_journal() is called.
+ * @param di The context
+ * @param path Journal file, NULL for no journal
+ * @param resume Resume the writes recorded in the journal if set, the same
+ *	  writes have to be issued again in the same order
+ */
+void sb_set_journal(devinfo_t *di, char *path, int resume)
+{
+	journal_close(di->journal, 0);
+	di->journal = NULL;
+	di->journalpath = path;
+	di->resume = resume;
+}
+
+/**
+ * Closes the journal once all journaled writes completed, and deletes it
+ * @param di The context
+ */
+void sb_finish_journal(devinfo_t *di)
+{
+	journal_close(di->journal, 1);
+	di->journal = NULL;
+}
+
+/**
+ * Returns the last error message of a context
+ * @param di The context
+ * @returns The message, empty if there was no error
+ */
+const char *sb_error(devinfo_t *di)
+{
+	return di->err;
+}
+
+/**
+ * Opens one of the attached SPMP8000 devices in ISP mode
+ * @param di The context
+ * @param index Which device to open, 0 for the first one found
+ * @returns 0 if OK, <0 on error
+ */
+int sb_open_usb(devinfo_t *di, int index)
+{
+	int ret;
+
+	ret = usb_spmp8000_open(di, index);
+	if (ret > 0)
+	{
+		DBGE(di, "Could not find SPMP8000 device\n");
+		return -1;
+	}
+
+	return ret;
+}
+
+/**
+ * Opens a fake device backed by a flash image file
+ * @param di The context
+ * @param spec Fake device spec, see fake_open()
+ * @returns 0 if OK, <0 on error
+ */
+int sb_open_fake(devinfo_t *di, char *spec)
+{
+	return fake_open(di, spec);
+}
+
+/**
+ * Prepares an opened device for the flash and memory operations
+ * Runs the DRAM init if requested, sends the flash config and reads back
+ * the flash geometry into the context. The DRAM init is only run once.
+ * @param di The context with an opened device
+ * @returns 0 if OK, <0 on error
+ */
+int sb_setup(devinfo_t *di)
+{
+	int ret;
+	nandconf_t nc;
+
+	if (di->initdram)
+	{
+		ret = cmd_init_dram(di);
+		if (ret)
+		{
+			DBGE(di, "Can't init DRAM\n");
+			return -1;
+		}
+		di->initdram = 0;
+		DBG(di, "- DRAM Init called\n");
+	}
+
+	if (di->flashconfig)
+	{
+		ret = cmd_write_flash_config(di, (nandconf_t *)fc_29F32G08);
+		if (ret)
+		{
+			DBGE(di, "Can't send flash configuration\n");
+			return -1;
+		}
+		DBG(di, "- FLASH config sent\n");
+	}
+
+	ret = cmd_get_flash_info(di, &nc);
+	if (ret)
+	{
+		DBGE(di, "Can't read flash config\n");
+		return -1;
+	}
+
+	if (di->cachesize && (di->cache == NULL))
+	{
+		di->cache = cache_create(di, di->cachesize, di->ps);
+		if (di->cache == NULL)
+		{
+			DBGE(di, "Can't allocate page cache\n");
+			return -1;
+		}
+	}
+
+	if (di->journalpath && (di->journal == NULL))
+	{
+		di->journal = journal_open(di, di->journalpath, di->resume);
+		if (di->journal == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Closes the device of a context, the context can be used for opening
+ * another one
+ * @param di The context
+ */
+void sb_close(devinfo_t *di)
+{
+	/* A plan's fake device is closed, the context had the other one */
+	plan_end(di);
+
+	if (di->fake)
+		fake_close(di->fake);
+	else if (di->ud)
+		usb_close(di->ud);
+
+	/* The next device has other pages */
+	cache_destroy(di->cache);
+	sched_detach(di);
+	journal_close(di->journal, 0);
+
+	di->fake = NULL;
+	di->ud = NULL;
+	di->cache = NULL;
+	di->journal = NULL;
+	di->helperup = 0;
+}
+
+/**
+ * Returns the flash geometry read by sb_setup()
+ * @param di The context
+ * @param ppb Returns the number of pages per block, may be NULL
+ * @param ps Returns the page size, may be NULL
+ * @param tb Returns the total number of blocks, may be NULL
+ */
+void sb_geometry(devinfo_t *di, unsigned int *ppb, unsigned int *ps,
+		 unsigned int *tb)
+{
+	if (ppb)
+		*ppb = di->ppb;
+	if (ps)
+		*ps = di->ps;
+	if (tb)
+		*tb = di->tb;
+}
+
+/**
+ * Reads device memory into a buffer
+ * @param di The context with an opened device
+ * @param addr Address to read from
+ * @param buf Buffer to fill
+ * @param len Number of bytes to read
+ * @returns 0 if OK, <0 on error
+ */
+int sb_ram_read(devinfo_t *di, uint32_t addr, void *buf, uint32_t len)
+{
+	uint32_t poi, wl;
+
+	for (poi = 0; poi < len; poi += wl)
+	{
+		wl = (len - poi > LIB_RAM_CHUNK) ? LIB_RAM_CHUNK : len - poi;
+		if (cmd_read_mem(di, addr + poi, wl, (char *)buf + poi))
+		{
+			DBGE(di, "Can't read RAM at %08X\n", addr + poi);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Writes a buffer to device memory
+ * @param di The context with an opened device
+ * @param addr Address to write to
+ * @param buf Data to write
+ * @param len Number of bytes to write
+ * @returns 0 if OK, <0 on error
+ */
+int sb_ram_write(devinfo_t *di, uint32_t addr, void *buf, uint32_t len)
+{
+	uint32_t poi, wl;
+
+	for (poi = 0; poi < len; poi += wl)
+	{
+		wl = (len - poi > LIB_RAM_CHUNK) ? LIB_RAM_CHUNK : len - poi;
+		if (cmd_write_mem(di, addr + poi, wl, (char *)buf + poi))
+		{
+			DBGE(di, "Can't write RAM at %08X\n", addr + poi);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Reads flash into a buffer
+ * @param di The context with a set up device
+ * @param addr Flash address to read from
+ * @param buf Buffer to fill
+ * @param len Number of bytes to read
+ * @returns 0 if OK, <0 on error
+ */
+int sb_flash_read(devinfo_t *di, uint32_t addr, void *buf, uint32_t len)
+{
+	return image_read_usb(di, addr, buf, len);
+}
+
+/**
+ * Writes a buffer to flash, keeping the rest of the touched blocks
+ * @param di The context with a set up device
+ * @param addr Flash address to write to
+ * @param buf Data to write
+ * @param len Number of bytes to write
+ * @returns 0 if OK, <0 on error
+ */
+int sb_flash_write(devinfo_t *di, uint32_t addr, void *buf, uint32_t len)
+{
+	return image_write_random_usb(di, addr, buf, len);
+}
+
+/**
+ * Jumps to code in device memory, the romboot code gets control back if
+ * the code returns
+ * @param di The context with an opened device
+ * @param addr Address to jump to
+ * @returns 0 if OK, <0 on error
+ */
+int sb_execute(devinfo_t *di, uint32_t addr)
+{
+	return cmd_execute(di, addr);
+}
+
+/**
+ * Dumps device memory to a file
+ * @param di The context with an opened device
+ * @param addr Address to start the dump from
+ * @param len Number of bytes to dump
+ * @param fname File to write, compressed if it ends in .zst or .xz
+ * @returns 0 if OK, <0 on error
+ */
+int sb_ram_dump(devinfo_t *di, uint32_t addr, uint32_t len, char *fname)
+{
+	return file_ram_dump(di, addr, len, fname);
+}
+
+/**
+ * Dumps flash to a file
+ * @param di The context with a set up device
+ * @param addr Flash address to start the dump from
+ * @param len Number of bytes to dump
+ * @param fname File to write, compressed if it ends in .zst or .xz
+ * @returns 0 if OK, <0 on error
+ */
+int sb_flash_dump(devinfo_t *di, uint32_t addr, uint32_t len, char *fname)
+{
+	return file_flash_dump(di, addr, len, fname);
+}
+
+/**
+ * Writes a file to flash
+ * @param di The context with a set up device
+ * @param addr Flash address to write to
+ * @param fname File to read, "-" for stdin, may be zstd or xz compressed
+ * @returns 0 if OK, <0 on error
+ */
+int sb_flash_write_file(devinfo_t *di, uint32_t addr, char *fname)
+{
+	return file_flash_write(di, addr, fname);
+}
+
+/**
+ * Uploads a file to device memory
+ * @param di The context with an opened device
+ * @param addr Address to write to
+ * @param fname File to read, "-" for stdin, may be zstd or xz compressed
+ * @param verify Read back and compare the CRC32C of the data if set
+ * @returns 0 if OK, <0 on error
+ */
+int sb_ram_write_file(devinfo_t *di, uint32_t addr, char *fname, int verify)
+{
+	return file_ram_write(di, addr, fname, verify);
+}
+
+/**
+ * Writes a file to flash as a bootfile, with its PAT page
+ * @param di The context with a set up device
+ * @param id ID of the bootfile
+ * @param pataddr Flash address of the PAT page
+ * @param dataddr Flash address of the bootfile data
+ * @param fname File to read, "-" for stdin, may be zstd or xz compressed
+ * @returns 0 if OK, <0 on error
+ */
+int sb_bootfile_write_file(devinfo_t *di, uint32_t id, uint32_t pataddr,
+			   uint32_t dataddr, char *fname)
+{
+	return file_bootfile_write(di, id, pataddr / di->ps, dataddr / di->ps,
+				   fname);
+}
+
+/**
+ * Backs up the whole flash into a deduplicating store, see sb_store.c
+ * @param di The context with a set up device
+ * @param store Store directory, created if needed
+ * @returns 0 if OK, <0 on error
+ */
+int sb_backup(devinfo_t *di, char *store)
+{
+	return store_backup(di, store);
+}
+
+/**
+ * Restores a backup from a store to flash, skipping unchanged blocks
+ * @param di The context with a set up device
+ * @param store Store directory
+ * @param index Index of the backup, NULL for the last backup of the device
+ * @returns 0 if OK, <0 on error
+ */
+int sb_restore(devinfo_t *di, char *store, char *index)
+{
+	return store_restore(di, store, index);
+}
@@ -0,0 +1,574 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define LOG_RING_SIZE		(256 * 1024)	/* per thread, power of 2 */
+#define LOG_MAX_TEXT		512
+#define LOG_FLUSH_MS		100
+#define LOG_ALIGN(x)		(((x) + 15) & ~15)
+
+enum logrectype {
+	LOG_REC_PAD = 0,	/* Skip to the end of the ring */
+	LOG_REC_TEXT,		/* Formatted message */
+	LOG_REC_TXN		/* USB transaction, formatted by the flusher */
+};
+
+typedef struct
+{
+	uint32_t len;		/**< Length of the record including header */
+	uint8_t type;		/**< One of LOG_REC_ */
+	uint8_t level;		/**< Debug level of the message */
+	uint16_t datalen;	/**< Length of the payload */
+	double ts;		/**< Time of the message, see log_now() */
+} logrec_t;
+
+typedef struct
+{
+	uint32_t cmd;
+	uint32_t addr;
+	uint32_t len;
+	uint8_t flag;
+	uint8_t hasdata;
+} logtxn_t;
+
+/**
+ * Single producer, single consumer ring of log records
+ * The owner thread only moves head, the flusher only moves tail.
+ */
+typedef struct logring
+{
+	char *buf;		/**< LOG_RING_SIZE bytes of records */
+	uint32_t head;		/**< Write position, free running */
+	uint32_t tail;		/**< Read position, free running */
+	uint32_t dropped;	/**< Records lost because the ring was full */
+	int dead;		/**< Owner thread exited */
+	struct logring *next;
+} logring_t;
+
+static __thread logring_t *log_ring;
+static logring_t *log_rings;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static double log_start;
+static int log_active;
+static FILE *log_out;		/* NULL for stdout */
+
+/**
+ * Returns the stream messages without a log sink go to
+ * @returns The stream
+ */
+static FILE *log_file(void)
+{
+	return log_out ? log_out : stdout;
+}
+
+/**
+ * Sets the stream messages without a log sink go to, for when stdout
+ * carries data
+ * @param f The stream, NULL for stdout
+ */
+void log_set_file(FILE *f)
+{
+	log_sync();
+	log_out = f;
+}
+
+/**
+ * Returns a monotonic timestamp, the clock all timings and log records use
+ * @returns Time in seconds
+ */
+double log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Prints a record, called by the flusher only
+ * @param rec The record
+ */
+static void log_emit(logrec_t *rec)
+{
+	double ts = rec->ts - log_start;
+	logtxn_t *txn;
+
+	switch (rec->type)
+	{
+		case LOG_REC_TEXT:
+			fprintf(log_file(), "-%d-:[%10.6f] %.*s", rec->level,
+				ts, rec->datalen, (char *)(rec + 1));
+			break;
+		case LOG_REC_TXN:
+			txn = (logtxn_t *)(rec + 1);
+			fprintf(log_file(), "-%d-:[%10.6f] USB txn: "
+				"Cmd:0x%08X, addr:0x%08X, len:0x%08X, %s, "
+				"data:%s\n", rec->level, ts, txn->cmd,
+				txn->addr, txn->len,
+				(txn->flag == SCSI_FLAG_READ) ? "read" : "write",
+				txn->hasdata ? "yes" : "NULL");
+			break;
+	}
+}
+
+/**
+ * Returns the oldest record of a ring, skipping padding
+ * @param r The ring
+ * @returns The record, NULL if the ring is empty
+ */
+static logrec_t *log_ring_peek(logring_t *r)
+{
+	uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	logrec_t *rec;
+
+	while (r->tail != head)
+	{
+		rec = (logrec_t *)(r->buf + (r->tail & (LOG_RING_SIZE - 1)));
+		if (rec->type != LOG_REC_PAD)
+			return rec;
+		__atomic_store_n(&r->tail, r->tail + rec->len,
+				 __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/**
+ * Prints the records of all threads in time order and frees the rings of
+ * exited threads, called with log_lock held
+ */
+static void log_drain(void)
+{
+	logring_t *r, *best, **pr;
+	logrec_t *rec, *bestrec;
+	uint32_t dropped;
+
+	for (;;)
+	{
+		best = NULL;
+		bestrec = NULL;
+		for (r = log_rings; r; r = r->next)
+		{
+			rec = log_ring_peek(r);
+			if (rec && ((bestrec == NULL) || (rec->ts < bestrec->ts)))
+			{
+				best = r;
+				bestrec = rec;
+			}
+		}
+
+		if (best == NULL)
+			break;
+
+		log_emit(bestrec);
+		__atomic_store_n(&best->tail, best->tail + bestrec->len,
+				 __ATOMIC_RELEASE);
+	}
+
+	pr = &log_rings;
+	while ((r = *pr) != NULL)
+	{
+		dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped)
+			fprintf(log_file(), "-1-:%u log messages dropped\n",
+				dropped);
+
+		if (__atomic_load_n(&r->dead, __ATOMIC_ACQUIRE) &&
+		    (log_ring_peek(r) == NULL))
+		{
+			*pr = r->next;
+			free(r->buf);
+			free(r);
+		}
+		else
+			pr = &r->next;
+	}
+
+	fflush(log_file());
+}
+
+/**
+ * Background thread printing the buffered records
+ * @param arg Unused
+ */
+static void *log_flusher(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&log_lock);
+	for (;;)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += LOG_FLUSH_MS * 1000000L;
+		if (ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&log_cond, &log_lock, &ts);
+		log_drain();
+	}
+
+	return NULL;
+}
+
+/**
+ * Marks the ring of an exiting thread, the flusher frees it once drained
+ * @param arg The ring
+ */
+static void log_ring_release(void *arg)
+{
+	logring_t *r = arg;
+
+	__atomic_store_n(&r->dead, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&log_cond);
+}
+
+/**
+ * Starts the flusher thread, done once on the first buffered message
+ */
+static void log_init(void)
+{
+	pthread_t thread;
+	sigset_t sigs, oldsigs;
+
+	log_start = log_now();
+	if (pthread_key_create(&log_key, log_ring_release))
+		return;
+
+	/* Signals are left to the threads doing the real work */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+	if (pthread_create(&thread, NULL, log_flusher, NULL) == 0)
+	{
+		pthread_detach(thread);
+		atexit(log_sync);
+		log_active = 1;
+	}
+	pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+}
+
+/**
+ * Returns the ring of the calling thread, creating it on first use
+ * @returns The ring, NULL if logging can't be buffered
+ */
+static logring_t *log_ring_get(void)
+{
+	logring_t *r;
+
+	if (log_ring)
+		return log_ring;
+
+	pthread_once(&log_once, log_init);
+	if (!log_active)
+		return NULL;
+
+	r = calloc(1, sizeof(logring_t));
+	if (r == NULL)
+		return NULL;
+	r->buf = malloc(LOG_RING_SIZE);
+	if (r->buf == NULL)
+	{
+		free(r);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	r->next = log_rings;
+	log_rings = r;
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_setspecific(log_key, r);
+	log_ring = r;
+
+	return r;
+}
+
+/**
+ * Reserves space for a record in the ring, wrapping to its start if needed
+ * @param r The ring
+ * @param need Maximum length of the record including header
+ * @param head Returns the position of the record
+ * @returns Pointer to the record, NULL if the ring is full
+ */
+static logrec_t *log_reserve(logring_t *r, uint32_t need, uint32_t *head)
+{
+	uint32_t h = r->head;
+	uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	uint32_t off = h & (LOG_RING_SIZE - 1);
+	uint32_t pad = 0;
+	logrec_t *rec;
+
+	if (off + need > LOG_RING_SIZE)
+		pad = LOG_RING_SIZE - off;
+
+	if (LOG_RING_SIZE - (h - tail) < pad + need)
+	{
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	if (pad)
+	{
+		rec = (logrec_t *)(r->buf + off);
+		rec->len = pad;
+		rec->type = LOG_REC_PAD;
+		h += pad;
+	}
+
+	*head = h;
+	return (logrec_t *)(r->buf + (h & (LOG_RING_SIZE - 1)));
+}
+
+/**
+ * Publishes a record to the flusher
+ * @param r The ring
+ * @param head Position of the record returned by log_reserve()
+ * @param rec The record
+ * @param type One of LOG_REC_
+ * @param level Debug level
+ * @param datalen Length of the payload
+ */
+static void log_commit(logring_t *r, uint32_t head, logrec_t *rec, int type,
+		       int level, int datalen)
+{
+	rec->len = LOG_ALIGN(sizeof(logrec_t) + datalen);
+	rec->type = type;
+	rec->level = level;
+	rec->datalen = datalen;
+	rec->ts = log_now();
+
+	head += rec->len;
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+
+	/* Wake the flusher early rather than dropping messages */
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) >
+	    LOG_RING_SIZE / 2)
+		pthread_cond_signal(&log_cond);
+}
+
+/**
+ * Prints an info or error message, errors are also kept in the context
+ * Use through the DBG and DBGE macros.
+ * @param di Context the message belongs to, may be NULL
+ * @param level SB_LOG_INFO or SB_LOG_ERROR
+ * @param fmt printf format
+ */
+void log_msg(devinfo_t *di, int level, const char *fmt, ...)
+{
+	va_list ap;
+	char msg[LOG_MAX_TEXT];
+	int n;
+
+	if (di && (level == SB_LOG_ERROR))
+	{
+		va_start(ap, fmt);
+		vsnprintf(di->err, SB_ERRLEN, fmt, ap);
+		va_end(ap);
+		n = strlen(di->err);
+		if (n && (di->err[n - 1] == '\n'))
+			di->err[n - 1] = 0;
+	}
+
+	if (di && di->logfn)
+	{
+		va_start(ap, fmt);
+		vsnprintf(msg, LOG_MAX_TEXT, fmt, ap);
+		va_end(ap);
+		di->logfn(di->logarg, level, msg);
+		return;
+	}
+
+	log_sync();
+	if (level == SB_LOG_ERROR)
+		fprintf(log_file(), "- Error: ");
+	va_start(ap, fmt);
+	vfprintf(log_file(), fmt, ap);
+	va_end(ap);
+}
+
+/**
+ * Formats a debug message into the ring of the calling thread, or hands it
+ * to the log sink of the context
+ * Use through the DBG1 and DBG2 macros.
+ * @param di Context the message belongs to, may be NULL
+ * @param level Debug level of the message
+ * @param fmt printf format
+ */
+void log_printf(devinfo_t *di, int level, const char *fmt, ...)
+{
+	va_list ap;
+	logring_t *r;
+	logrec_t *rec;
+	uint32_t head;
+	char msg[LOG_MAX_TEXT];
+	int n;
+
+	if (di && di->logfn)
+	{
+		va_start(ap, fmt);
+		vsnprintf(msg, LOG_MAX_TEXT, fmt, ap);
+		va_end(ap);
+		di->logfn(di->logarg, level, msg);
+		return;
+	}
+
+	r = log_ring_get();
+	if (r == NULL)
+	{
+		fprintf(log_file(), "-%d-:", level);
+		va_start(ap, fmt);
+		vfprintf(log_file(), fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	rec = log_reserve(r, LOG_ALIGN(sizeof(logrec_t) + LOG_MAX_TEXT), &head);
+	if (rec == NULL)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf((char *)(rec + 1), LOG_MAX_TEXT, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		n = 0;
+	else if (n >= LOG_MAX_TEXT)
+		n = LOG_MAX_TEXT - 1;
+
+	log_commit(r, head, rec, LOG_REC_TEXT, level, n);
+}
+
+/**
+ * Logs a USB transaction as a binary record, formatted later by the flusher
+ * A log sink of the context gets it formatted right away.
+ * @param di Context the transaction belongs to
+ * @param level Debug level of the message
+ * @param cmd Command of the transaction
+ * @param addr Address of the transaction
+ * @param len Length of the transaction
+ * @param flag SCSI_FLAG_READ or SCSI_FLAG_WRITE
+ * @param hasdata Whether the transaction has a data stage
+ */
+void log_txn(devinfo_t *di, int level, uint32_t cmd, uint32_t addr,
+	     uint32_t len, uint8_t flag, int hasdata)
+{
+	logring_t *r;
+	logrec_t *rec;
+	logtxn_t *txn;
+	uint32_t head;
+	char msg[LOG_MAX_TEXT];
+
+	if (di->logfn)
+	{
+		snprintf(msg, LOG_MAX_TEXT, "USB txn: Cmd:0x%08X, addr:0x%08X, "
+			 "len:0x%08X, %s, data:%s\n", cmd, addr, len,
+			 (flag == SCSI_FLAG_READ) ? "read" : "write",
+			 hasdata ? "yes" : "NULL");
+		di->logfn(di->logarg, level, msg);
+		return;
+	}
+
+	r = log_ring_get();
+	if (r == NULL)
+	{
+		fprintf(log_file(), "-%d-:USB txn: Cmd:0x%08X, addr:0x%08X, "
+			"len:0x%08X, data:%s\n", level, cmd, addr, len,
+			hasdata ? "yes" : "NULL");
+		return;
+	}
+
+	rec = log_reserve(r, LOG_ALIGN(sizeof(logrec_t) + sizeof(logtxn_t)),
+			  &head);
+	if (rec == NULL)
+		return;
+
+	txn = (logtxn_t *)(rec + 1);
+	txn->cmd = cmd;
+	txn->addr = addr;
+	txn->len = len;
+	txn->flag = flag;
+	txn->hasdata = hasdata;
+
+	log_commit(r, head, rec, LOG_REC_TXN, level, sizeof(logtxn_t));
+}
+
+/**
+ * Prints all buffered debug messages
+ * Called before direct output, so it stays in order with the debug messages.
+ */
+void log_sync(void)
+{
+	if (!log_active)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	log_drain();
+	pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * Prints a hexdump of a buffer, 16 bytes per line
+ * @param data Data to dump
+ * @param length Length of the data
+ * @param base Address printed for the first byte
+ */
+void hexdump(unsigned char *data, int length, int base)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char line[10 + 16 * 3 + 1];
+	unsigned int addr;
+	int i, j, p;
+
+	log_sync();
+
+	for (i = 0; i < length; i += 16)
+	{
+		addr = base + i;
+		for (p = 0; p < 8; p++)
+			line[p] = hex[(addr >> (28 - p * 4)) & 0xF];
+		line[p++] = ':';
+		line[p++] = ' ';
+
+		for (j = i; (j < length) && (j < i + 16); j++)
+		{
+			line[p++] = hex[data[j] >> 4];
+			line[p++] = hex[data[j] & 0xF];
+			line[p++] = ' ';
+		}
+		line[p++] = '\n';
+
+		fwrite(line, 1, p, log_file());
+	}
+}
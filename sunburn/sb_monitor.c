@@ -0,0 +1,351 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <endian.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "sb.h"
+
+#define MON_MAX_RANGES	32
+#define MON_MAX_TXN	0x10000		/* Bytes read in one transaction */
+/* A gap this small is read along, it costs less than another transaction */
+#define MON_MERGE_GAP	0x1000
+
+/** RAM range, word aligned */
+typedef struct
+{
+	uint32_t addr;
+	uint32_t len;
+	uint32_t off;	/**< Offset of its words in a sample */
+} monrange_t;
+
+static volatile sig_atomic_t mon_stop;
+
+static void mon_sighandler(int sig)
+{
+	mon_stop = 1;
+}
+
+static int mon_cmp(const void *a, const void *b)
+{
+	const monrange_t *ra = a, *rb = b;
+
+	return (ra->addr > rb->addr) - (ra->addr < rb->addr);
+}
+
+/**
+ * Parses the ranges to monitor, overlapping ones are joined
+ * @param di Device info struct the errors are reported to
+ * @param spec Comma separated list of 0xaddr:0xlen ranges
+ * @param r Filled with the ranges in address order, MON_MAX_RANGES long
+ * @returns Number of ranges, <0 on error
+ */
+static int mon_parse(devinfo_t *di, char *spec, monrange_t *r)
+{
+	char *s, *opt, *save;
+	uint32_t addr, len, end;
+	int i, m, n = 0;
+
+	s = strdup(spec);
+	if (s == NULL)
+		return -1;
+
+	for (opt = strtok_r(s, ",", &save); opt;
+	     opt = strtok_r(NULL, ",", &save))
+	{
+		if ((sscanf(opt, "0x%8X:0x%8X", &addr, &len) < 2) ||
+		    (len == 0) || (n == MON_MAX_RANGES))
+		{
+			DBGE(di, "Invalid RAM range: %s\n", opt);
+			free(s);
+			return -1;
+		}
+
+		/* Whole words */
+		r[n].addr = addr & ~3;
+		r[n].len = ((addr + len + 3) & ~3) - r[n].addr;
+		n++;
+	}
+	free(s);
+
+	if (n == 0)
+	{
+		DBGE(di, "No RAM ranges given\n");
+		return -1;
+	}
+
+	qsort(r, n, sizeof(monrange_t), mon_cmp);
+	for (i = 1, m = 0; i < n; i++)
+	{
+		end = r[m].addr + r[m].len;
+		if (r[i].addr > end)
+			r[++m] = r[i];
+		else if (r[i].addr + r[i].len > end)
+			r[m].len = r[i].addr + r[i].len - r[m].addr;
+	}
+
+	return m + 1;
+}
+
+/**
+ * Merges ranges close to each other into the ranges read, so a sample
+ * takes as few transactions as possible
+ * @param r The ranges in address order, their offsets in a sample are set
+ * @param nr Number of ranges
+ * @param t Filled with the ranges read, MON_MAX_RANGES long
+ * @returns Number of ranges read
+ */
+static int mon_merge(monrange_t *r, int nr, monrange_t *t)
+{
+	uint32_t off = 0;
+	int i, m = 0;
+
+	t[0] = r[0];
+	for (i = 1; i < nr; i++)
+	{
+		if (r[i].addr > t[m].addr + t[m].len + MON_MERGE_GAP)
+		{
+			off += t[m].len;
+			t[++m] = r[i];
+		}
+		else
+			t[m].len = r[i].addr + r[i].len - t[m].addr;
+		r[i].off = off + r[i].addr - t[m].addr;
+	}
+	r[0].off = 0;
+
+	return m + 1;
+}
+
+/**
+ * Reads all ranges of a sample
+ * @param di Device info struct of opened and inited device
+ * @param r The ranges read
+ * @param nr Number of ranges read
+ * @param buf Buffer to fill, the ranges back to back
+ * @returns 0 if OK, <0 on error
+ */
+static int mon_sample(devinfo_t *di, monrange_t *r, int nr, char *buf)
+{
+	uint32_t poi, wl;
+	int i;
+
+	for (i = 0; i < nr; i++)
+	{
+		for (poi = 0; poi < r[i].len; poi += wl)
+		{
+			wl = (r[i].len - poi > MON_MAX_TXN) ? MON_MAX_TXN :
+							      r[i].len - poi;
+			if (cmd_read_mem(di, r[i].addr + poi, wl, buf + poi))
+				return -1;
+		}
+		buf += r[i].len;
+	}
+
+	return 0;
+}
+
+/**
+ * Finds the next word that changed since the last sample
+ * Most of the words usually stay the same, so they are compared 4 at a
+ * time.
+ * @param cur The sample
+ * @param last The last sample
+ * @param from Word to start at
+ * @param n Number of words
+ * @returns Index of the changed word, n if there's none
+ */
+static int mon_next_change(uint32_t *cur, uint32_t *last, int from, int n)
+{
+	int i = from;
+#ifdef __SSE2__
+	__m128i a, b;
+
+	for (; i + 4 <= n; i += 4)
+	{
+		a = _mm_loadu_si128((__m128i *)(cur + i));
+		b = _mm_loadu_si128((__m128i *)(last + i));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, b)) != 0xFFFF)
+			break;
+	}
+#endif
+	for (; i < n; i++)
+		if (cur[i] != last[i])
+			break;
+
+	return i;
+}
+
+/**
+ * Writes the words of the ranges that changed, as one line of the timestamp
+ * followed by an addr=word,word,... entry for each run of changed words
+ * @param out Stream to write to
+ * @param r The ranges, not the ones read
+ * @param nr Number of ranges
+ * @param cur The sample
+ * @param last The last sample
+ * @param t Time of the sample, seconds since the first one
+ * @param all Write all words, for the first sample
+ * @returns Number of words written
+ */
+static int mon_emit(FILE *out, monrange_t *r, int nr, uint32_t *cur,
+		    uint32_t *last, double t, int all)
+{
+	uint32_t *c, *l;
+	int i, j, k, nw, n = 0;
+
+	for (i = 0; i < nr; i++)
+	{
+		nw = r[i].len / 4;
+		c = cur + r[i].off / 4;
+		l = last + r[i].off / 4;
+		j = all ? 0 : mon_next_change(c, l, 0, nw);
+		while (j < nw)
+		{
+			if (n == 0)
+				fprintf(out, "%.6f", t);
+			fprintf(out, " %08X=%08X", r[i].addr + j * 4,
+				le32toh(c[j]));
+			n++;
+
+			for (k = j + 1; k < nw; k++, n++)
+			{
+				if (!all && (c[k] == l[k]))
+					break;
+				fprintf(out, ",%08X", le32toh(c[k]));
+			}
+
+			j = all ? nw : mon_next_change(c, l, k, nw);
+		}
+	}
+
+	if (n)
+	{
+		fputc('\n', out);
+		fflush(out);
+	}
+
+	return n;
+}
+
+/**
+ * Monitors device RAM until SIGINT or SIGTERM, writing only the words that
+ * changed between samples
+ * The ranges are read over and over in one session, those close to each
+ * other in one go. The first line holds all their words, the others the
+ * changed ones, each line starts with the time of the sample in seconds.
+ * @param di Device info struct of opened and inited device
+ * @param ranges Comma separated list of 0xaddr:0xlen ranges
+ * @param fname File to write to, NULL or - for stdout
+ * @returns 0 if OK, <0 on error
+ */
+int mon_run(devinfo_t *di, char *ranges, char *fname)
+{
+	monrange_t r[MON_MAX_RANGES], rd[MON_MAX_RANGES];
+	struct sigaction sact;
+	uint32_t *cur, *last, *tmp;
+	unsigned long nsamples = 0, nchanged = 0;
+	double start, t;
+	FILE *out = stdout;
+	int i, nr, nrd, n, want = 0, total = 0, ntxns = 0, ret = -1;
+
+	nr = mon_parse(di, ranges, r);
+	if (nr < 0)
+		return -1;
+	nrd = mon_merge(r, nr, rd);
+
+	for (i = 0; i < nr; i++)
+		want += r[i].len;
+	for (i = 0; i < nrd; i++)
+	{
+		total += rd[i].len;
+		ntxns += (rd[i].len + MON_MAX_TXN - 1) / MON_MAX_TXN;
+	}
+
+	cur = malloc(total);
+	last = malloc(total);
+	if ((cur == NULL) || (last == NULL))
+	{
+		DBGE(di, "Can't allocate sample buffers\n");
+		goto out;
+	}
+
+	if (fname && strcmp(fname, "-"))
+	{
+		out = fopen(fname, "w");
+		if (out == NULL)
+		{
+			DBGE(di, "Can't open %s\n", fname);
+			goto out;
+		}
+	}
+
+	/* No SA_RESTART, an interrupted transaction ends the monitor */
+	memset(&sact, 0, sizeof(sact));
+	sact.sa_handler = mon_sighandler;
+	sigaction(SIGINT, &sact, NULL);
+	sigaction(SIGTERM, &sact, NULL);
+
+	DBG(di, "- Monitoring %d bytes of RAM, reading %d in %d transaction(s) "
+	    "per sample\n", want, total, ntxns);
+
+	start = log_now();
+	while (!mon_stop)
+	{
+		t = log_now() - start;
+		if (mon_sample(di, rd, nrd, (char *)cur))
+		{
+			if (mon_stop)
+				break;
+			DBGE(di, "Can't read RAM\n");
+			goto out;
+		}
+
+		n = mon_emit(out, r, nr, cur, last, t, nsamples == 0);
+		if (nsamples++)
+			nchanged += n;
+
+		tmp = cur;
+		cur = last;
+		last = tmp;
+	}
+
+	t = log_now() - start;
+	DBG(di, "- %lu samples in %.1f s (%.0f/s), %lu changed words\n",
+	    nsamples, t, t > 0 ? nsamples / t : 0, nchanged);
+	ret = 0;
+
+out:
+	if (out && (out != stdout))
+		fclose(out);
+	free(cur);
+	free(last);
+	return ret;
+}
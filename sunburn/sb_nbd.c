@@ -0,0 +1,658 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+/*
+ * NBD protocol, fixed newstyle negotiation and simple replies only
+ * All fields are big endian.
+ */
+#define NBD_MAGIC		0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC		0x49484156454F5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_REPLY_MAGIC		0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)
+#define NBD_FLAG_SEND_FLUSH	(1 << 2)
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_INFO_EXPORT		0
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+
+#define NBD_EIO			5
+#define NBD_EINVAL		22
+
+#define NBD_BACKLOG		1
+#define NBD_MAX_OPTLEN		4096
+#define NBD_MAX_REQLEN		(32 * 1024 * 1024)
+#define NBD_MAX_DIRTY		64	/* Blocks held before writing back */
+#define NBD_READAHEAD		64	/* Pages read ahead on sequential reads */
+
+/** A block written by the client, held until it's flushed */
+typedef struct
+{
+	uint32_t block;		/**< Number of the block */
+	char *data;		/**< Content of the whole block */
+} nbd_dirty_t;
+
+typedef struct
+{
+	devinfo_t *di;		/**< The exported device */
+	int sock;		/**< Client socket */
+	uint64_t size;		/**< Size of the export */
+	uint64_t next;		/**< End of the previous read */
+	nbd_dirty_t dirty[NBD_MAX_DIRTY];	/**< Blocks not written yet */
+	int ndirty;		/**< Number of dirty blocks */
+	char *veribuf;		/**< Page buffer for verifying */
+} nbd_t;
+
+static volatile sig_atomic_t nbd_stop;
+
+static void nbd_sighandler(int sig)
+{
+	nbd_stop = 1;
+}
+
+/**
+ * Receives exactly len bytes from the client
+ * @param n The server
+ * @param buf Buffer to fill
+ * @param len Number of bytes
+ * @returns 0 if OK, <0 on error or disconnect
+ */
+static int nbd_recv(nbd_t *n, void *buf, int len)
+{
+	int ret;
+
+	while (len > 0)
+	{
+		ret = recv(n->sock, buf, len, 0);
+		if ((ret < 0) && (errno == EINTR) && !nbd_stop)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Sends exactly len bytes to the client
+ * @param n The server
+ * @param buf Data to send
+ * @param len Number of bytes
+ * @returns 0 if OK, <0 on error
+ */
+static int nbd_send(nbd_t *n, const void *buf, int len)
+{
+	int ret;
+
+	while (len > 0)
+	{
+		ret = send(n->sock, buf, len, MSG_NOSIGNAL);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (const char *)buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * Sends an option reply
+ * @param n The server
+ * @param opt The option replied to
+ * @param type NBD_REP_ type
+ * @param data Reply data, may be NULL
+ * @param len Length of data
+ * @returns 0 if OK, <0 on error
+ */
+static int nbd_opt_reply(nbd_t *n, uint32_t opt, uint32_t type, void *data,
+			 uint32_t len)
+{
+	struct __attribute__((packed))
+	{
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t type;
+		uint32_t len;
+	} rep;
+
+	rep.magic = htobe64(NBD_REP_MAGIC);
+	rep.opt = htobe32(opt);
+	rep.type = htobe32(type);
+	rep.len = htobe32(len);
+
+	if (nbd_send(n, &rep, sizeof(rep)))
+		return -1;
+	return len ? nbd_send(n, data, len) : 0;
+}
+
+/**
+ * Negotiates the export with a new client
+ * @param n The server
+ * @returns 0 to start the transmission, <0 to drop the client
+ */
+static int nbd_negotiate(nbd_t *n)
+{
+	struct __attribute__((packed))
+	{
+		uint64_t magic;
+		uint64_t optmagic;
+		uint16_t flags;
+	} hello;
+	struct __attribute__((packed))
+	{
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t len;
+	} req;
+	struct __attribute__((packed))
+	{
+		uint16_t type;
+		uint64_t size;
+		uint16_t flags;
+	} info;
+	struct __attribute__((packed))
+	{
+		uint64_t size;
+		uint16_t flags;
+	} exp;
+	char zeroes[124];
+	char *optdata = NULL;
+	uint32_t cflags, opt, len;
+	int ret = -1;
+
+	hello.magic = htobe64(NBD_MAGIC);
+	hello.optmagic = htobe64(NBD_OPTS_MAGIC);
+	hello.flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	if (nbd_send(n, &hello, sizeof(hello)) ||
+	    nbd_recv(n, &cflags, sizeof(cflags)))
+		return -1;
+	cflags = be32toh(cflags);
+
+	optdata = malloc(NBD_MAX_OPTLEN);
+	if (optdata == NULL)
+		return -1;
+
+	for (;;)
+	{
+		if (nbd_recv(n, &req, sizeof(req)) ||
+		    (be64toh(req.magic) != NBD_OPTS_MAGIC))
+			goto out;
+
+		opt = be32toh(req.opt);
+		len = be32toh(req.len);
+		if ((len > NBD_MAX_OPTLEN) || nbd_recv(n, optdata, len))
+			goto out;
+
+		DBG1(n->di, "NBD option %u\n", opt);
+
+		switch (opt)
+		{
+			case NBD_OPT_EXPORT_NAME:
+				/* No reply header, the transmission starts */
+				exp.size = htobe64(n->size);
+				exp.flags = htobe16(NBD_FLAG_HAS_FLAGS |
+						    NBD_FLAG_SEND_FLUSH);
+				memset(zeroes, 0, sizeof(zeroes));
+				if (nbd_send(n, &exp, sizeof(exp)) ||
+				    (!(cflags & NBD_FLAG_NO_ZEROES) &&
+				     nbd_send(n, zeroes, sizeof(zeroes))))
+					goto out;
+				ret = 0;
+				goto out;
+			case NBD_OPT_ABORT:
+				nbd_opt_reply(n, opt, NBD_REP_ACK, NULL, 0);
+				goto out;
+			case NBD_OPT_LIST:
+				/* One export, with an empty name */
+				len = 0;
+				if (nbd_opt_reply(n, opt, NBD_REP_SERVER, &len,
+						  sizeof(len)) ||
+				    nbd_opt_reply(n, opt, NBD_REP_ACK, NULL, 0))
+					goto out;
+				break;
+			case NBD_OPT_INFO:
+			case NBD_OPT_GO:
+				info.type = htobe16(NBD_INFO_EXPORT);
+				info.size = htobe64(n->size);
+				info.flags = htobe16(NBD_FLAG_HAS_FLAGS |
+						     NBD_FLAG_SEND_FLUSH);
+				if (nbd_opt_reply(n, opt, NBD_REP_INFO, &info,
+						  sizeof(info)) ||
+				    nbd_opt_reply(n, opt, NBD_REP_ACK, NULL, 0))
+					goto out;
+				if (opt == NBD_OPT_GO)
+				{
+					ret = 0;
+					goto out;
+				}
+				break;
+			default:
+				if (nbd_opt_reply(n, opt, NBD_REP_ERR_UNSUP,
+						  NULL, 0))
+					goto out;
+				break;
+		}
+	}
+
+out:
+	free(optdata);
+	return ret;
+}
+
+/**
+ * Looks up a block written by the client
+ * @param n The server
+ * @param block Number of the block
+ * @returns The dirty block, NULL if the block is clean
+ */
+static nbd_dirty_t *nbd_find_dirty(nbd_t *n, uint32_t block)
+{
+	int i;
+
+	for (i = 0; i < n->ndirty; i++)
+		if (n->dirty[i].block == block)
+			return &n->dirty[i];
+
+	return NULL;
+}
+
+/**
+ * Writes back all dirty blocks, in flash order
+ * @param n The server
+ * @returns 0 if OK, <0 on error
+ */
+static int nbd_flush(nbd_t *n)
+{
+	devinfo_t *di = n->di;
+	nbd_dirty_t t;
+	int i, j, ret = 0;
+
+	/* Few blocks, a simple sort does */
+	for (i = 1; i < n->ndirty; i++)
+		for (j = i; (j > 0) &&
+		     (n->dirty[j - 1].block > n->dirty[j].block); j--)
+		{
+			t = n->dirty[j];
+			n->dirty[j] = n->dirty[j - 1];
+			n->dirty[j - 1] = t;
+		}
+
+	if (n->ndirty)
+		DBG1(di, "NBD writing back %d blocks\n", n->ndirty);
+
+	for (i = 0; i < n->ndirty; i++)
+	{
+		if (!ret && image_write_blocks_usb(di, n->dirty[i].block *
+						   di->ppb, 1,
+						   n->dirty[i].data,
+						   n->veribuf))
+		{
+			DBGE(di, "Can't write back block %u\n",
+			     n->dirty[i].block);
+			ret = -1;
+		}
+		free(n->dirty[i].data);
+	}
+	n->ndirty = 0;
+
+	return ret;
+}
+
+/**
+ * Reads part of the export, from the dirty blocks or the flash
+ * Pages come through the page cache, sequential reads also fill it with
+ * the following pages.
+ * @param n The server
+ * @param off Offset in the export
+ * @param buf Buffer to fill
+ * @param len Number of bytes
+ * @returns 0 if OK, <0 on error
+ */
+static int nbd_read(nbd_t *n, uint64_t off, char *buf, uint32_t len)
+{
+	devinfo_t *di = n->di;
+	nbd_dirty_t *d;
+	uint32_t page, last, ra, skip, wl;
+	char *pagebuf = n->veribuf;
+
+	/* Read ahead in the same block, so a whole block is fetched in a
+	 * few sequential requests */
+	if ((off == n->next) && len)
+	{
+		last = (off + len - 1) / di->ps;
+		ra = last + NBD_READAHEAD;
+		if (ra / di->ppb != last / di->ppb)
+			ra = (last / di->ppb + 1) * di->ppb - 1;
+		for (page = last + 1; page <= ra; page++)
+			if (!nbd_find_dirty(n, page / di->ppb) &&
+			    cmd_read_flash_page(di, page, pagebuf))
+				return -1;
+	}
+	n->next = off + len;
+
+	while (len > 0)
+	{
+		page = off / di->ps;
+		skip = off % di->ps;
+		wl = (di->ps - skip < len) ? di->ps - skip : len;
+
+		d = nbd_find_dirty(n, page / di->ppb);
+		if (d)
+			memcpy(buf, d->data + (off % di->bs), wl);
+		else
+		{
+			if (cmd_read_flash_page(di, page, pagebuf))
+				return -1;
+			memcpy(buf, pagebuf + skip, wl);
+		}
+
+		off += wl;
+		buf += wl;
+		len -= wl;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes part of the export into dirty blocks, written back on flush or
+ * when too many blocks are dirty
+ * @param n The server
+ * @param off Offset in the export
+ * @param buf Data to write
+ * @param len Number of bytes
+ * @returns 0 if OK, <0 on error
+ */
+static int nbd_write(nbd_t *n, uint64_t off, char *buf, uint32_t len)
+{
+	devinfo_t *di = n->di;
+	nbd_dirty_t *d;
+	uint32_t block, skip, wl;
+
+	while (len > 0)
+	{
+		block = off / di->bs;
+		skip = off % di->bs;
+		wl = (di->bs - skip < len) ? di->bs - skip : len;
+
+		d = nbd_find_dirty(n, block);
+		if (d == NULL)
+		{
+			if ((n->ndirty == NBD_MAX_DIRTY) && nbd_flush(n))
+				return -1;
+
+			d = &n->dirty[n->ndirty];
+			d->block = block;
+			d->data = malloc(di->bs);
+			if (d->data == NULL)
+				return -1;
+
+			/* Whole blocks get written back, keep the rest */
+			if ((wl < di->bs) &&
+			    cmd_read_flash_pages(di, block * di->ppb, di->ppb,
+						 d->data))
+			{
+				free(d->data);
+				return -1;
+			}
+			n->ndirty++;
+		}
+
+		memcpy(d->data + skip, buf, wl);
+
+		off += wl;
+		buf += wl;
+		len -= wl;
+	}
+
+	return 0;
+}
+
+/**
+ * Serves the requests of a client until it disconnects
+ * @param n The server
+ * @returns 0 if OK, <0 on error
+ */
+static int nbd_serve(nbd_t *n)
+{
+	struct __attribute__((packed))
+	{
+		uint32_t magic;
+		uint16_t flags;
+		uint16_t type;
+		uint64_t handle;
+		uint64_t off;
+		uint32_t len;
+	} req;
+	struct __attribute__((packed))
+	{
+		uint32_t magic;
+		uint32_t error;
+		uint64_t handle;
+	} rep;
+	char *buf = NULL;
+	uint64_t off;
+	uint32_t len, err;
+	int type;
+
+	while (!nbd_stop)
+	{
+		if (nbd_recv(n, &req, sizeof(req)) ||
+		    (be32toh(req.magic) != NBD_REQUEST_MAGIC))
+			break;
+
+		type = be16toh(req.type);
+		off = be64toh(req.off);
+		len = be32toh(req.len);
+		err = 0;
+
+		DBG2(n->di, "NBD cmd %d off %llx len %x\n", type,
+		     (unsigned long long)off, len);
+
+		if (type == NBD_CMD_DISC)
+			break;
+
+		if (((type == NBD_CMD_READ) || (type == NBD_CMD_WRITE)) &&
+		    ((len > NBD_MAX_REQLEN) || (off > n->size) ||
+		     (len > n->size - off)))
+		{
+			/* The data of a write still has to be taken */
+			if ((type == NBD_CMD_WRITE) && (len > NBD_MAX_REQLEN))
+				break;
+			err = NBD_EINVAL;
+		}
+
+		if ((type == NBD_CMD_READ) || (type == NBD_CMD_WRITE))
+		{
+			free(buf);
+			buf = malloc(len ? len : 1);
+			if (buf == NULL)
+				break;
+		}
+
+		switch (type)
+		{
+			case NBD_CMD_READ:
+				if (!err && nbd_read(n, off, buf, len))
+					err = NBD_EIO;
+				break;
+			case NBD_CMD_WRITE:
+				if (nbd_recv(n, buf, len))
+					goto out;
+				if (!err && nbd_write(n, off, buf, len))
+					err = NBD_EIO;
+				break;
+			case NBD_CMD_FLUSH:
+				if (nbd_flush(n))
+					err = NBD_EIO;
+				break;
+			default:
+				err = NBD_EINVAL;
+				break;
+		}
+
+		rep.magic = htobe32(NBD_REPLY_MAGIC);
+		rep.error = htobe32(err);
+		rep.handle = req.handle;
+		if (nbd_send(n, &rep, sizeof(rep)))
+			break;
+		if ((type == NBD_CMD_READ) && !err && nbd_send(n, buf, len))
+			break;
+	}
+
+out:
+	free(buf);
+	return nbd_flush(n);
+}
+
+/**
+ * Exports the flash of a device as an NBD block device on a Unix domain
+ * socket until SIGINT or SIGTERM, serving one client at a time
+ * Pages are only read when the client asks for them and are kept in the
+ * page cache, writes are collected into whole blocks that get written back
+ * on flush, on disconnect or when too many are pending.
+ * @param di Device info struct of opened and inited device
+ * @param sockpath Path of the socket to create
+ * @returns 0 if OK, <0 on error
+ */
+int nbd_run(devinfo_t *di, char *sockpath)
+{
+	struct sockaddr_un sa;
+	struct sigaction sact;
+	nbd_t n;
+	int lsock, ret = 0;
+
+	if (strlen(sockpath) >= sizeof(sa.sun_path))
+	{
+		DBGE(di, "Socket path too long\n");
+		return -1;
+	}
+
+	memset(&n, 0, sizeof(n));
+	n.di = di;
+	n.size = (uint64_t)di->tb * di->bs;
+	n.veribuf = malloc(di->ps);
+	if (n.veribuf == NULL)
+	{
+		DBGE(di, "Can't allocate page buffer\n");
+		return -1;
+	}
+
+	cache_serve(di);
+
+	lsock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (lsock == -1)
+	{
+		DBGE(di, "Can't create socket: %s\n", strerror(errno));
+		free(n.veribuf);
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, sockpath);
+	unlink(sockpath);
+
+	if (bind(lsock, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    listen(lsock, NBD_BACKLOG))
+	{
+		DBGE(di, "Can't listen on %s: %s\n", sockpath,
+		     strerror(errno));
+		close(lsock);
+		free(n.veribuf);
+		return -1;
+	}
+
+	/* No SA_RESTART, so accept() and recv() return when stopped */
+	memset(&sact, 0, sizeof(sact));
+	sact.sa_handler = nbd_sighandler;
+	sigaction(SIGINT, &sact, NULL);
+	sigaction(SIGTERM, &sact, NULL);
+
+	DBG(di, "- Exporting %llu bytes of FLASH on %s\n",
+	    (unsigned long long)n.size, sockpath);
+
+	while (!nbd_stop)
+	{
+		n.sock = accept(lsock, NULL, NULL);
+		if (n.sock == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			DBGE(di, "Can't accept client: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+
+		DBG1(di, "NBD client connected\n");
+		n.next = 0;
+		if ((nbd_negotiate(&n) == 0) && nbd_serve(&n))
+			ret = -1;
+		close(n.sock);
+		DBG1(di, "NBD client disconnected\n");
+	}
+
+	DBG(di, "- Stopping NBD export\n");
+
+	close(lsock);
+	unlink(sockpath);
+	free(n.veribuf);
+
+	return ret;
+}
@@ -0,0 +1,415 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define PLAN_PROBE_TXNS		32	/* Transactions per probe */
+#define PLAN_PROBE_LEN		(64 * 1024)	/* Bytes of a throughput probe */
+
+/*
+ * Program and erase can't be probed without writing the flash, these are
+ * typical of the MLC NAND in these devices
+ */
+#define PLAN_PROG_US		900
+#define PLAN_ERASE_US		3000
+
+/** Latency model of a device */
+typedef struct
+{
+	unsigned int lat;	/**< Latency of a transaction, usecs */
+	unsigned int mbps;	/**< Transfer rate in MB/s */
+	unsigned int tread;	/**< Page read time of the flash, usecs */
+	unsigned int tprog;	/**< Page program time, usecs */
+	unsigned int terase;	/**< Block erase time, usecs */
+} planmodel_t;
+
+struct plan
+{
+	fake_t *dev;		/**< Fake device the context had, or NULL */
+	planmodel_t m;
+	unsigned int ppb;	/**< Pages per block */
+	uint32_t npages;	/**< Pages of the flash */
+	char *written;		/**< Pages programmed over USB, not erased since */
+	unsigned long ntxn;	/**< USB transactions */
+	uint64_t nbytes;	/**< Bytes transferred over USB */
+	unsigned long nverify;	/**< Pages read back after programming */
+};
+
+/* Profile keys, the ones the fake device has are named like in its spec */
+static const struct
+{
+	char *name;
+	size_t offset;
+} plan_keys[] =
+{
+	{ "lat",	offsetof(planmodel_t, lat) },
+	{ "mbps",	offsetof(planmodel_t, mbps) },
+	{ "read",	offsetof(planmodel_t, tread) },
+	{ "prog",	offsetof(planmodel_t, tprog) },
+	{ "erase",	offsetof(planmodel_t, terase) },
+};
+
+#define PLAN_NKEYS	(sizeof(plan_keys) / sizeof(plan_keys[0]))
+
+/**
+ * Loads a saved latency model
+ * @param di Device info struct the errors are reported to
+ * @param fname Profile file, one key=value per line
+ * @param m Filled with the model
+ * @returns 0 if OK, 1 if there's no such file, <0 on error
+ */
+static int plan_load(devinfo_t *di, char *fname, planmodel_t *m)
+{
+	char line[64], *val, *end;
+	FILE *f;
+	int i, ret = 0;
+
+	f = fopen(fname, "r");
+	if (f == NULL)
+		return (errno == ENOENT) ? 1 : -1;
+
+	while (fgets(line, sizeof(line), f))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		val = strchr(line, '=');
+		if (val == NULL)
+			continue;
+		*val++ = 0;
+
+		for (i = 0; i < PLAN_NKEYS; i++)
+			if (!strcmp(line, plan_keys[i].name))
+				break;
+		if (i == PLAN_NKEYS)
+			continue;
+
+		*(unsigned int *)((char *)m + plan_keys[i].offset) =
+			strtoul(val, &end, 0);
+		if (*end)
+		{
+			DBGE(di, "Invalid value of %s in profile %s\n", line,
+			     fname);
+			ret = -1;
+		}
+	}
+
+	fclose(f);
+	return ret;
+}
+
+/**
+ * Saves a latency model for later plans
+ * @param di Device info struct the errors are reported to
+ * @param fname Profile file
+ * @param m The model
+ * @returns 0 if OK, <0 on error
+ */
+static int plan_save(devinfo_t *di, char *fname, planmodel_t *m)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(fname, "w");
+	if (f == NULL)
+	{
+		DBGE(di, "Can't write profile %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < PLAN_NKEYS; i++)
+		fprintf(f, "%s=%u\n", plan_keys[i].name,
+			*(unsigned int *)((char *)m + plan_keys[i].offset));
+
+	return fclose(f) ? -1 : 0;
+}
+
+/**
+ * Times transactions of one kind on the device
+ * @param di Device info struct of opened and inited device
+ * @param cmd Command to send, a read
+ * @param addr Address to send
+ * @param len Length to read
+ * @param buf Buffer of len bytes
+ * @returns Average time of a transaction in usecs, <0 on error
+ */
+static double plan_time(devinfo_t *di, uint32_t cmd, uint32_t addr,
+			uint32_t len, char *buf)
+{
+	double start;
+	int i;
+
+	start = log_now();
+	for (i = 0; i < PLAN_PROBE_TXNS; i++)
+		if (usb_txn(di, cmd, addr, len, buf, SCSI_FLAG_READ))
+			return -1;
+
+	return (log_now() - start) * 1e6 / PLAN_PROBE_TXNS;
+}
+
+/**
+ * Calibrates the latency model with reads only, the flash is not changed
+ * The latency is that of tiny RAM reads, the transfer rate comes from
+ * large ones and the page read time is what a flash page read takes on
+ * top of these.
+ * @param di Device info struct of opened and inited device
+ * @param m Filled with the model
+ * @returns 0 if OK, <0 on error
+ */
+static int plan_probe(devinfo_t *di, planmodel_t *m)
+{
+	double small, big, page;
+	char *buf;
+
+	buf = malloc(PLAN_PROBE_LEN > di->ps ? PLAN_PROBE_LEN : di->ps);
+	if (buf == NULL)
+		return -1;
+
+	small = plan_time(di, CMD_USB_RAMREAD, DEVICE_ID_LOCATION,
+			  DEVICE_ID_LENGTH, buf);
+	big = plan_time(di, CMD_USB_RAMREAD, ROMBOOT_LOCATION, PLAN_PROBE_LEN,
+			buf);
+	page = plan_time(di, CMD_USB_FLASHREAD, 0, di->ps, buf);
+	free(buf);
+
+	if ((small < 0) || (big < 0) || (page < 0))
+	{
+		DBGE(di, "Can't probe the device\n");
+		return -1;
+	}
+
+	/* 1 MB/s is a byte per usec */
+	m->lat = small + 0.5;
+	m->mbps = (big > small) ? PLAN_PROBE_LEN / (big - small) + 0.5 : 0;
+	page -= small + (m->mbps ? (double)di->ps / m->mbps : 0);
+	m->tread = (page > 0) ? page + 0.5 : 0;
+	m->tprog = PLAN_PROG_US;
+	m->terase = PLAN_ERASE_US;
+
+	return 0;
+}
+
+/**
+ * Reads a page of the device being planned for, for the fake device
+ * @param arg Device info struct in planning
+ * @param page Page to read
+ * @param buf Buffer of a page
+ * @returns 0 if OK, <0 on error
+ */
+static int plan_source(void *arg, uint32_t page, char *buf)
+{
+	devinfo_t *di = arg;
+
+	if (di->plan->dev)
+		return fake_txn(di->plan->dev, CMD_USB_FLASHREAD, page, di->ps,
+				buf, SCSI_FLAG_READ);
+
+	return usb_bulk_txn(di, CMD_USB_FLASHREAD, page, di->ps, buf,
+			    SCSI_FLAG_READ);
+}
+
+/**
+ * Switches a context to planning the operations run on it
+ * The latency model is loaded from the profile, or probed on the device
+ * and saved to it if there's none yet. From then on the transactions go
+ * to a fake device of the same geometry, backed by a temporary file, so
+ * the operation runs its usual logic, including verifying, without
+ * erasing or programming the device. The pages the plan didn't erase or
+ * program read as they are on the device, each is read from it once.
+ * @param di Device info struct of opened and inited device
+ * @param profile File holding the latency model
+ * @param blank The flash reads as erased instead, for operations that
+ *	  don't depend on what's on it
+ * @returns 0 if OK, <0 on error
+ */
+int plan_start(devinfo_t *di, char *profile, int blank)
+{
+	char path[] = "/tmp/sunburn-plan-XXXXXX";
+	char spec[sizeof(path) + 48];
+	plan_t *p;
+	int fd, ret;
+
+	p = calloc(1, sizeof(plan_t));
+	if (p == NULL)
+		return -1;
+
+	p->ppb = di->ppb;
+	p->npages = di->tb * di->ppb;
+	p->written = calloc(p->npages, 1);
+	if (p->written == NULL)
+		goto fail;
+
+	ret = plan_load(di, profile, &p->m);
+	if (ret < 0)
+	{
+		DBGE(di, "Can't load profile %s\n", profile);
+		goto fail;
+	}
+	if (ret)
+	{
+		if (plan_probe(di, &p->m) || plan_save(di, profile, &p->m))
+			goto fail;
+		DBG(di, "- Probed the device, profile saved to %s\n", profile);
+	}
+
+	fd = mkstemp(path);
+	if (fd == -1)
+	{
+		DBGE(di, "Can't create plan file: %s\n", strerror(errno));
+		goto fail;
+	}
+	close(fd);
+
+	snprintf(spec, sizeof(spec), "%s,ppb=%u,ps=%u,tb=%u", path, di->ppb,
+		 di->ps, di->tb);
+	p->dev = di->fake;
+	di->fake = NULL;
+	ret = fake_open(di, spec);
+	unlink(path);
+	if (ret)
+	{
+		di->fake = p->dev;
+		goto fail;
+	}
+
+	di->plan = p;
+	if (!blank && fake_set_source(di->fake, plan_source, di))
+	{
+		plan_end(di);
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	free(p->written);
+	free(p);
+	return -1;
+}
+
+/**
+ * Counts a transaction of a plan, called by usb_txn()
+ * @param p The plan
+ * @param cmd Command sent
+ * @param addr Address sent
+ * @param len Length of data
+ * @param hasdata Data was transferred
+ */
+void plan_txn(plan_t *p, uint32_t cmd, uint32_t addr, uint32_t len,
+	      int hasdata)
+{
+	p->ntxn++;
+	if (hasdata)
+		p->nbytes += len;
+
+	/* The fake device rejects pages out of range */
+	if (addr >= p->npages)
+		return;
+
+	switch (cmd)
+	{
+		case CMD_USB_FLASHWRITE:
+			p->written[addr] = 1;
+			break;
+		case CMD_USB_FLASHREAD:
+			if (p->written[addr])
+				p->nverify++;
+			break;
+		case CMD_USB_FLASHBLKERASE:
+			addr -= addr % p->ppb;
+			memset(p->written + addr, 0, p->ppb);
+			break;
+	}
+}
+
+/**
+ * Prints what the planned operation did and how long it would take on
+ * the device
+ * The estimate adds up the transactions and flash operations one after
+ * the other, overlapping ones like those of the flasher stub make the
+ * real operation faster.
+ * @param di Device info struct in planning
+ */
+void plan_report(devinfo_t *di)
+{
+	plan_t *p = di->plan;
+	planmodel_t *m;
+	fakestats_t st;
+	struct rusage ru;
+	double usb, flash;
+
+	if (p == NULL)
+		return;
+
+	m = &p->m;
+	fake_stats(di->fake, &st);
+	getrusage(RUSAGE_SELF, &ru);
+
+	usb = (double)p->ntxn * m->lat;
+	if (m->mbps)
+		usb += (double)p->nbytes / m->mbps;
+	flash = (double)(st.nread + st.ndevread) * m->tread +
+		(double)st.nwrite * m->tprog + (double)st.nerase * m->terase;
+
+	DBG(di, "- Plan:\n");
+	DBG(di, "Page reads over USB:    %lu (%lu verifying)\n", st.nread,
+	    p->nverify);
+	DBG(di, "Page reads on device:   %lu\n", st.ndevread);
+	DBG(di, "Page programs:          %lu\n", st.nwrite);
+	DBG(di, "Block erases:           %lu\n", st.nerase);
+	DBG(di, "Helper runs:            %lu\n", st.nhelper);
+	DBG(di, "USB transactions:       %lu\n", p->ntxn);
+	DBG(di, "USB bytes:              %llu\n",
+	    (unsigned long long)p->nbytes);
+	DBG(di, "Peak host memory:       %.1f MB\n", ru.ru_maxrss / 1024.0);
+	DBG(di, "Estimated time:         %.2f s (%.2f s USB, %.2f s flash)\n",
+	    (usb + flash) / 1e6, usb / 1e6, flash / 1e6);
+	DBG(di, "Model: lat=%u us, mbps=%u, read=%u us, prog=%u us, "
+	    "erase=%u us\n", m->lat, m->mbps, m->tread, m->tprog, m->terase);
+}
+
+/**
+ * Ends planning, the context gets its device back
+ * @param di Device info struct, may not be planning
+ */
+void plan_end(devinfo_t *di)
+{
+	plan_t *p = di->plan;
+
+	if (p == NULL)
+		return;
+
+	fake_close(di->fake);
+	di->fake = p->dev;
+	di->plan = NULL;
+
+	free(p->written);
+	free(p);
+}
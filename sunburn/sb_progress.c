@@ -0,0 +1,247 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define PROGRESS_INTERVAL	0.25	/* secs between redraws */
+#define MB			(1024.0 * 1024.0)
+
+typedef struct
+{
+	double secs;		/**< Time spent in the phase */
+	uint64_t bytes;		/**< Bytes transferred in the phase */
+	unsigned long txns;	/**< Number of operations in the phase */
+} progphase_t;
+
+struct progress
+{
+	devinfo_t *di;		/**< Context the summary is printed to */
+	char *opname;		/**< Name of the operation */
+	int tty;		/**< Draw live progress to stderr */
+	int readphase;		/**< Phase flash page reads are counted in */
+	int curphase;		/**< Phase of the last update */
+	uint64_t expect;	/**< Expected total bytes, 0 if unknown */
+	uint64_t done;		/**< Bytes done in all phases */
+	double start;		/**< Start of the operation */
+	double last;		/**< Time of the last update */
+	double lastdraw;	/**< Time of the last redraw */
+	progphase_t phases[PROG_NPHASES];
+};
+
+static const char *progress_names[PROG_NPHASES] =
+{
+	"read", "readback", "erase", "program", "verify", "ramread", "ramwrite"
+};
+
+/**
+ * Creates a progress tracker for an operation
+ * Live progress is drawn only if stderr is a terminal.
+ * @param di Context the summary is printed to
+ * @param opname Name of the operation, used in the summary
+ * @returns Pointer to the tracker, NULL on error
+ */
+progress_t *progress_create(devinfo_t *di, char *opname)
+{
+	progress_t *p;
+
+	p = calloc(1, sizeof(progress_t));
+	if (p == NULL)
+		return NULL;
+
+	p->di = di;
+	p->opname = opname;
+	p->tty = isatty(STDERR_FILENO);
+	p->readphase = PROG_READ;
+	p->start = log_now();
+	p->last = p->start;
+
+	return p;
+}
+
+/**
+ * Frees a progress tracker
+ * @param p The tracker, may be NULL
+ */
+void progress_free(progress_t *p)
+{
+	free(p);
+}
+
+/**
+ * Adds to the number of bytes the operation is expected to transfer,
+ * for the ETA
+ * @param p The tracker, may be NULL
+ * @param bytes Number of bytes
+ */
+void progress_expect(progress_t *p, uint64_t bytes)
+{
+	if (p)
+		p->expect += bytes;
+}
+
+/**
+ * Sets which phase the following flash page reads belong to
+ * @param p The tracker, may be NULL
+ * @param phase PROG_READ, PROG_READBACK or PROG_VERIFY
+ */
+void progress_read_phase(progress_t *p, int phase)
+{
+	if (p)
+		p->readphase = phase;
+}
+
+/**
+ * Redraws the live progress line
+ * @param p The tracker
+ * @param now Current time
+ */
+static void progress_draw(progress_t *p, double now)
+{
+	double el = now - p->start;
+	double rate = (el > 0) ? p->done / el : 0;
+	int eta;
+
+	fprintf(stderr, "\r- %-8s %8.1f MB", progress_names[p->curphase],
+		p->done / MB);
+	if (p->expect)
+		fprintf(stderr, " of %.1f MB", p->expect / MB);
+	fprintf(stderr, "  %6.2f MB/s", rate / MB);
+	if (p->expect && (rate > 0) && (p->done <= p->expect))
+	{
+		eta = (p->expect - p->done) / rate;
+		fprintf(stderr, "  ETA %d:%02d:%02d", eta / 3600,
+			(eta / 60) % 60, eta % 60);
+	}
+	fprintf(stderr, "   ");
+
+	p->lastdraw = now;
+}
+
+/**
+ * Accounts a finished operation, the time since the previous one is
+ * counted to its phase
+ * @param p The tracker, may be NULL
+ * @param phase One of PROG_, PROG_READ means the current read phase
+ * @param bytes Number of bytes transferred
+ */
+void progress_add(progress_t *p, int phase, int bytes)
+{
+	double now;
+	progphase_t *ph;
+
+	if (p == NULL)
+		return;
+
+	if (phase == PROG_READ)
+		phase = p->readphase;
+
+	now = log_now();
+	ph = &p->phases[phase];
+	ph->secs += now - p->last;
+	ph->bytes += bytes;
+	ph->txns++;
+	p->done += bytes;
+	p->curphase = phase;
+	p->last = now;
+
+	if (p->tty && (now - p->lastdraw >= PROGRESS_INTERVAL))
+		progress_draw(p, now);
+}
+
+/**
+ * Finishes the live progress line and prints a summary
+ * @param p The tracker, may be NULL
+ */
+void progress_finish(progress_t *p)
+{
+	double el;
+
+	if (p == NULL)
+		return;
+
+	el = log_now() - p->start;
+
+	if (p->tty && (p->lastdraw > 0))
+	{
+		progress_draw(p, p->last);
+		fprintf(stderr, "\n");
+	}
+
+	if (p->done)
+		DBG(p->di, "- %.1f MB in %.1f s (%.2f MB/s)\n", p->done / MB, el,
+		    (el > 0) ? p->done / MB / el : 0);
+}
+
+/**
+ * Writes a JSON summary of the operation with per-phase durations and
+ * byte counts
+ * @param p The tracker
+ * @param fname File to write, "-" for stdout
+ * @param status Result of the operation, 0 if OK
+ * @returns 0 if OK, <0 on error
+ */
+int progress_write_json(progress_t *p, char *fname, int status)
+{
+	FILE *f;
+	progphase_t *ph;
+	int i, first = 1;
+
+	if (!strcmp(fname, "-"))
+		f = stdout;
+	else
+		f = fopen(fname, "w");
+	if (f == NULL)
+	{
+		DBGE(p->di, "Can't open summary file %s\n", fname);
+		return -1;
+	}
+
+	fprintf(f, "{\"operation\":\"%s\",\"status\":\"%s\","
+		"\"seconds\":%.3f,\"bytes\":%llu,\"phases\":{",
+		p->opname, status ? "failed" : "ok",
+		log_now() - p->start, (unsigned long long)p->done);
+
+	for (i = 0; i < PROG_NPHASES; i++)
+	{
+		ph = &p->phases[i];
+		if (ph->txns == 0)
+			continue;
+		fprintf(f, "%s\"%s\":{\"seconds\":%.3f,\"bytes\":%llu,"
+			"\"ops\":%lu}", first ? "" : ",", progress_names[i],
+			ph->secs, (unsigned long long)ph->bytes, ph->txns);
+		first = 0;
+	}
+
+	fprintf(f, "}}\n");
+
+	if (f != stdout)
+		return fclose(f) ? -1 : 0;
+
+	fflush(f);
+	return 0;
+}
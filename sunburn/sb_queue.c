@@ -0,0 +1,222 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define QUEUE_BUF_ALIGN		4096
+
+struct queue
+{
+	qbuf_t *bufs;		/**< All buffers of the queue */
+	qbuf_t **freeq;		/**< Stack of empty buffers */
+	qbuf_t **fullq;		/**< Ring of filled buffers, oldest first */
+	int nbufs;		/**< Number of buffers */
+	int bufsize;		/**< Size of one buffer */
+	int nfree;		/**< Number of buffers in freeq */
+	int nfull;		/**< Number of buffers in fullq */
+	int fullhead;		/**< Index of the oldest buffer in fullq */
+	int closed;		/**< Producer won't queue more buffers */
+	int aborted;		/**< Either side failed, stop both */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/**
+ * Creates a bounded buffer queue between a producer and a consumer thread
+ * All buffers start out on the free list.
+ * @param nbufs Number of buffers in the queue
+ * @param bufsize Size of each buffer, buffers are page aligned
+ * @returns Pointer to the queue, NULL on error
+ */
+queue_t *queue_create(int nbufs, int bufsize)
+{
+	queue_t *q;
+	int i;
+
+	q = calloc(1, sizeof(queue_t));
+	if (q == NULL)
+		return NULL;
+
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+
+	q->bufs = calloc(nbufs, sizeof(qbuf_t));
+	q->freeq = calloc(nbufs, sizeof(qbuf_t *));
+	q->fullq = calloc(nbufs, sizeof(qbuf_t *));
+	if ((q->bufs == NULL) || (q->freeq == NULL) || (q->fullq == NULL))
+		goto fail;
+
+	q->nbufs = nbufs;
+	q->bufsize = bufsize;
+
+	for (i = 0; i < nbufs; i++)
+	{
+		if (posix_memalign((void **)&q->bufs[i].data, QUEUE_BUF_ALIGN,
+				   bufsize))
+			goto fail;
+		q->freeq[i] = &q->bufs[i];
+	}
+	q->nfree = nbufs;
+
+	return q;
+
+fail:
+	queue_destroy(q);
+	return NULL;
+}
+
+/**
+ * Frees a queue and all its buffers
+ * @param q The queue
+ */
+void queue_destroy(queue_t *q)
+{
+	int i;
+
+	if (q == NULL)
+		return;
+
+	if (q->bufs)
+		for (i = 0; i < q->nbufs; i++)
+			free(q->bufs[i].data);
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->cond);
+	free(q->bufs);
+	free(q->freeq);
+	free(q->fullq);
+	free(q);
+}
+
+/**
+ * Gets an empty buffer for the producer, waits until one is available
+ * @param q The queue
+ * @returns Buffer with len set to 0, NULL if the queue was aborted
+ */
+qbuf_t *queue_get_free(queue_t *q)
+{
+	qbuf_t *b = NULL;
+
+	pthread_mutex_lock(&q->lock);
+
+	while ((q->nfree == 0) && !q->aborted)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if (!q->aborted)
+	{
+		b = q->freeq[--q->nfree];
+		b->len = 0;
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return b;
+}
+
+/**
+ * Hands a filled buffer over to the consumer
+ * @param q The queue
+ * @param b Buffer previously got with queue_get_free()
+ */
+void queue_put_full(queue_t *q, qbuf_t *b)
+{
+	pthread_mutex_lock(&q->lock);
+
+	q->fullq[(q->fullhead + q->nfull) % q->nbufs] = b;
+	q->nfull++;
+
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Gets the oldest filled buffer for the consumer, waits until one is
+ * available
+ * @param q The queue
+ * @returns Buffer, NULL if the producer closed the queue and all buffers
+ *	    are consumed, or the queue was aborted
+ */
+qbuf_t *queue_get_full(queue_t *q)
+{
+	qbuf_t *b = NULL;
+
+	pthread_mutex_lock(&q->lock);
+
+	while ((q->nfull == 0) && !q->closed && !q->aborted)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	if ((q->nfull > 0) && !q->aborted)
+	{
+		b = q->fullq[q->fullhead];
+		q->fullhead = (q->fullhead + 1) % q->nbufs;
+		q->nfull--;
+	}
+
+	pthread_mutex_unlock(&q->lock);
+
+	return b;
+}
+
+/**
+ * Gives a consumed buffer back to the producer
+ * @param q The queue
+ * @param b Buffer previously got with queue_get_full()
+ */
+void queue_put_free(queue_t *q, qbuf_t *b)
+{
+	pthread_mutex_lock(&q->lock);
+
+	q->freeq[q->nfree++] = b;
+
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Called by the producer when no more buffers will be queued
+ * @param q The queue
+ */
+void queue_close(queue_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/**
+ * Stops both sides of the queue, used when either of them fails
+ * @param q The queue
+ */
+void queue_abort(queue_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->aborted = 1;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
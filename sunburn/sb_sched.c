@@ -0,0 +1,481 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define SCHED_MAX_DEVS		32	/* Devices on one link */
+#define SCHED_NAMELEN		32
+#define SCHED_WINDOW		0.25	/* Seconds a link is measured for */
+#define SCHED_GAIN		1.05	/* Throughput gain worth a transaction */
+#define SCHED_REPROBE		20	/* Windows before trying more again */
+#define SCHED_MAXSKIP		64	/* Grants a waiting device can miss */
+#define SCHED_RATE_WEIGHT	0.1	/* Weight of a new transfer in the rate */
+
+/**
+ * Devices sharing the bandwidth of a USB bus
+ * On USB 2.0 all devices behind one host controller port share its
+ * 480 Mbit/s, whichever hubs they hang off, so the bus is the link.
+ */
+typedef struct usblink
+{
+	char name[SCHED_NAMELEN];	/**< Bus the devices are on */
+	schedev_t *devs[SCHED_MAX_DEVS];	/**< Devices on the link */
+	int ndevs;		/**< Number of devices */
+	int active;		/**< Transactions in flight */
+	int limit;		/**< Transactions allowed in flight */
+	int nwaiting;		/**< Devices waiting for a transaction */
+	double wstart;		/**< Start of the measuring window */
+	uint64_t wbytes;	/**< Bytes moved in the window */
+	int wfull;		/**< The limit was reached in the window */
+	double rate;		/**< Throughput at the previous limit, bytes/s */
+	int dir;		/**< Direction the limit is probed in, 0 if
+				     settled */
+	int settled;		/**< Windows since the limit settled */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct usblink *next;
+} usblink_t;
+
+struct schedev
+{
+	usblink_t *link;	/**< Link the device is on */
+	int64_t pending;	/**< Bytes of work queued for the device */
+	double rate;		/**< Achieved transfer rate, bytes/s */
+	uint64_t bytes;		/**< Bytes moved */
+	double waited;		/**< Time spent waiting for the link */
+	double start;		/**< Start of the running transaction */
+	int waiting;		/**< Wants to start a transaction */
+	int skipped;		/**< Grants missed while waiting */
+};
+
+/** All links with devices on them */
+static usblink_t *sched_links;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Finds the hub a device is attached to
+ * libusb-0.1 fills the device tree on some platforms only.
+ * @param hub Hub to search from
+ * @param dev The device
+ * @param port Returns the port of the hub the device is on
+ * @returns The hub, NULL if the device isn't in the tree
+ */
+static struct usb_device *sched_find_hub(struct usb_device *hub,
+					 struct usb_device *dev, int *port)
+{
+	struct usb_device *found;
+	int i;
+
+	if (hub == NULL)
+		return NULL;
+
+	for (i = 0; i < hub->num_children; i++)
+	{
+		if (hub->children[i] == dev)
+		{
+			*port = i + 1;
+			return hub;
+		}
+		found = sched_find_hub(hub->children[i], dev, port);
+		if (found)
+			return found;
+	}
+
+	return NULL;
+}
+
+/**
+ * Names the link of a device from the USB topology
+ * @param di Device info struct of opened device
+ * @param name Buffer for the name
+ * @param len Length of the buffer
+ */
+static void sched_link_name(devinfo_t *di, char *name, int len)
+{
+	struct usb_device *dev, *hub;
+	int port = 0;
+
+	if (di->ud == NULL)
+	{
+		snprintf(name, len, "fake");
+		return;
+	}
+
+	dev = usb_device(di->ud);
+	snprintf(name, len, "%.*s", len - 1, dev->bus->dirname);
+
+	hub = sched_find_hub(dev->bus->root_dev, dev, &port);
+	if (hub)
+		DBG1(di, "Device %d on bus %s, hub %d port %d\n", dev->devnum,
+		     name, hub->devnum, port);
+	else
+		DBG1(di, "Device %d on bus %s\n", dev->devnum, name);
+}
+
+/**
+ * Puts an opened device under the scheduler of the USB bus it's on
+ * Devices on the same bus then take turns for their transactions. The
+ * number of transactions in flight on a bus is kept as low as it can be
+ * without losing throughput, and the turns go to the device with the
+ * longest time left at its achieved rate, so all devices of a bus finish
+ * about together.
+ * @param di Device info struct of opened device
+ * @returns 0 if OK, <0 on error
+ */
+int sched_attach(devinfo_t *di)
+{
+	char name[SCHED_NAMELEN];
+	schedev_t *sd;
+	usblink_t *l;
+
+	sched_link_name(di, name, sizeof(name));
+
+	sd = calloc(1, sizeof(schedev_t));
+	if (sd == NULL)
+		return -1;
+
+	pthread_mutex_lock(&sched_lock);
+
+	for (l = sched_links; l; l = l->next)
+		if (!strcmp(l->name, name))
+			break;
+
+	if (l == NULL)
+	{
+		l = calloc(1, sizeof(usblink_t));
+		if (l == NULL)
+			goto fail;
+		strcpy(l->name, name);
+		pthread_mutex_init(&l->lock, NULL);
+		pthread_cond_init(&l->cond, NULL);
+		l->next = sched_links;
+		sched_links = l;
+	}
+
+	pthread_mutex_lock(&l->lock);
+	if (l->ndevs == SCHED_MAX_DEVS)
+	{
+		pthread_mutex_unlock(&l->lock);
+		goto fail;
+	}
+	l->devs[l->ndevs++] = sd;
+
+	/* Start over from letting all devices run */
+	l->limit = l->ndevs;
+	l->dir = -1;
+	l->rate = 0;
+	pthread_mutex_unlock(&l->lock);
+
+	pthread_mutex_unlock(&sched_lock);
+
+	sd->link = l;
+	di->sched = sd;
+	return 0;
+
+fail:
+	pthread_mutex_unlock(&sched_lock);
+	free(sd);
+	DBGE(di, "Can't schedule device on bus %s\n", name);
+	return -1;
+}
+
+/**
+ * Takes a device off its link and prints what it achieved
+ * @param di Device info struct, may be unscheduled
+ */
+void sched_detach(devinfo_t *di)
+{
+	schedev_t *sd = di->sched;
+	usblink_t *l, **pl;
+	int i;
+
+	if (sd == NULL)
+		return;
+
+	l = sd->link;
+	if (sd->bytes)
+		DBG(di, "- Bus %s: %.2f MB/s achieved, %.2f s waiting for "
+		    "the bus\n", l->name, sd->rate / (1024 * 1024),
+		    sd->waited);
+
+	pthread_mutex_lock(&sched_lock);
+	pthread_mutex_lock(&l->lock);
+
+	for (i = 0; l->devs[i] != sd; i++)
+		;
+	l->devs[i] = l->devs[--l->ndevs];
+	if (l->limit > l->ndevs)
+		l->limit = l->ndevs ? l->ndevs : 1;
+
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->lock);
+
+	if (l->ndevs == 0)
+	{
+		for (pl = &sched_links; *pl != l; pl = &(*pl)->next)
+			;
+		*pl = l->next;
+		pthread_mutex_destroy(&l->lock);
+		pthread_cond_destroy(&l->cond);
+		free(l);
+	}
+
+	pthread_mutex_unlock(&sched_lock);
+
+	free(sd);
+	di->sched = NULL;
+}
+
+/**
+ * Adds to or takes from the work queued for a device, to tell how long
+ * it's going to need the link
+ * Transactions take the bytes they move off it.
+ * @param di Device info struct, may be unscheduled
+ * @param bytes Bytes the work is expected to move over USB
+ */
+void sched_add_work(devinfo_t *di, int64_t bytes)
+{
+	schedev_t *sd = di->sched;
+
+	if (sd == NULL)
+		return;
+
+	pthread_mutex_lock(&sd->link->lock);
+	sd->pending += bytes;
+	pthread_mutex_unlock(&sd->link->lock);
+}
+
+/**
+ * Returns the number of bytes a device moved
+ * @param di Device info struct, may be unscheduled
+ * @returns Bytes moved
+ */
+uint64_t sched_bytes(devinfo_t *di)
+{
+	schedev_t *sd = di->sched;
+	uint64_t bytes;
+
+	if (sd == NULL)
+		return 0;
+
+	pthread_mutex_lock(&sd->link->lock);
+	bytes = sd->bytes;
+	pthread_mutex_unlock(&sd->link->lock);
+
+	return bytes;
+}
+
+/**
+ * Time a device still needs at its achieved rate, called with the link
+ * locked
+ * @param l The link
+ * @param sd The device
+ * @returns Time in seconds
+ */
+static double sched_time_left(usblink_t *l, schedev_t *sd)
+{
+	double rate = sd->rate;
+	int i, n = 0;
+
+	if (sd->pending <= 0)
+		return 0;
+
+	/* Not measured yet, guess from the others */
+	if (rate == 0)
+	{
+		for (i = 0; i < l->ndevs; i++)
+			if (l->devs[i]->rate > 0)
+			{
+				rate += l->devs[i]->rate;
+				n++;
+			}
+		rate = n ? rate / n : 1;
+	}
+
+	return sd->pending / rate;
+}
+
+/**
+ * Tells if a waiting device is the next to get the link, called with the
+ * link locked
+ * @param l The link
+ * @param sd The device
+ * @returns 1 if it is, 0 if not
+ */
+static int sched_is_next(usblink_t *l, schedev_t *sd)
+{
+	double left = sched_time_left(l, sd);
+	schedev_t *o;
+	int i;
+
+	if (sd->skipped >= SCHED_MAXSKIP)
+		return 1;
+
+	for (i = 0; i < l->ndevs; i++)
+	{
+		o = l->devs[i];
+		if ((o == sd) || !o->waiting)
+			continue;
+		if (o->skipped >= SCHED_MAXSKIP)
+			return 0;
+		if (sched_time_left(l, o) > left)
+			return 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Waits until a device may start a transaction on its link
+ * @param di Device info struct, may be unscheduled
+ */
+void sched_begin(devinfo_t *di)
+{
+	schedev_t *sd = di->sched;
+	usblink_t *l;
+	double t;
+	int i;
+
+	if (sd == NULL)
+		return;
+
+	l = sd->link;
+	pthread_mutex_lock(&l->lock);
+
+	if ((l->active >= l->limit) || l->nwaiting)
+	{
+		t = log_now();
+		sd->waiting = 1;
+		l->nwaiting++;
+		l->wfull = 1;
+
+		while ((l->active >= l->limit) || !sched_is_next(l, sd))
+			pthread_cond_wait(&l->cond, &l->lock);
+
+		sd->waiting = 0;
+		sd->skipped = 0;
+		l->nwaiting--;
+		for (i = 0; i < l->ndevs; i++)
+			if (l->devs[i]->waiting)
+				l->devs[i]->skipped++;
+		sd->waited += log_now() - t;
+	}
+
+	sd->start = log_now();
+	if (l->wstart == 0)
+		l->wstart = sd->start;
+	if (++l->active == l->limit)
+		l->wfull = 1;
+
+	/* Another waiter may fit as well */
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->lock);
+}
+
+/**
+ * Adjusts the number of transactions a link lets in flight after a
+ * measuring window, called with the link locked
+ * The limit starts at the number of devices and goes down by one as long
+ * as that doesn't cost throughput, so the turns matter once the bus is
+ * saturated anyway. Every SCHED_REPROBE windows it's tried higher again.
+ * Windows in which the link wasn't full don't tell anything about it.
+ * @param l The link
+ * @param now Current time
+ */
+static void sched_adjust(usblink_t *l, double now)
+{
+	double rate = l->wbytes / (now - l->wstart);
+	int lost;
+
+	if (l->wfull && (l->dir == 0) && (++l->settled > SCHED_REPROBE))
+	{
+		l->settled = 0;
+		l->dir = (l->limit < l->ndevs) ? 1 : -1;
+		l->rate = 0;
+	}
+
+	if (l->wfull && l->dir)
+	{
+		lost = (l->dir > 0) ? (rate < l->rate * SCHED_GAIN) :
+				      (rate * SCHED_GAIN < l->rate);
+
+		if (l->rate && lost)
+		{
+			/* Back to the last limit that was worth it */
+			l->limit -= l->dir;
+			l->dir = 0;
+		}
+		else if ((l->limit + l->dir >= 1) &&
+			 (l->limit + l->dir <= l->ndevs))
+		{
+			l->rate = rate;
+			l->limit += l->dir;
+		}
+		else
+			l->dir = 0;
+	}
+
+	l->wstart = now;
+	l->wbytes = 0;
+	l->wfull = 0;
+}
+
+/**
+ * Ends a transaction started with sched_begin()
+ * @param di Device info struct, may be unscheduled
+ * @param bytes Bytes the transaction moved
+ */
+void sched_end(devinfo_t *di, uint32_t bytes)
+{
+	schedev_t *sd = di->sched;
+	usblink_t *l;
+	double now, secs;
+
+	if (sd == NULL)
+		return;
+
+	l = sd->link;
+	now = log_now();
+	secs = now - sd->start;
+	pthread_mutex_lock(&l->lock);
+
+	sd->bytes += bytes;
+	sd->pending -= bytes;
+	if (bytes && (secs > 0))
+		sd->rate = sd->rate ? sd->rate * (1 - SCHED_RATE_WEIGHT) +
+				      bytes / secs * SCHED_RATE_WEIGHT :
+				      bytes / secs;
+
+	l->active--;
+	l->wbytes += bytes;
+	if (now - l->wstart >= SCHED_WINDOW)
+		sched_adjust(l, now);
+
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->lock);
+}
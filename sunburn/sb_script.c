@@ -0,0 +1,291 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+#define SCRIPT_MAXLINE		1024
+#define SCRIPT_MAXARGS		4
+
+typedef struct
+{
+	char *name;		/**< Command name in the script */
+	int nargs;		/**< Number of arguments */
+	char *usage;		/**< Arguments description */
+	int (*run)(devinfo_t *di, char **argv);
+} script_cmd_t;
+
+/**
+ * Parses a number argument, in decimal or 0x hex format
+ * @param di Context errors are reported to
+ * @param str The argument
+ * @param val Returns the value
+ * @returns 0 if OK, <0 on error
+ */
+static int script_num(devinfo_t *di, char *str, unsigned int *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoul(str, &end, 0);
+	if (errno || (end == str) || *end)
+	{
+		DBGE(di, "Invalid number: %s\n", str);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Command handlers, argv holds the arguments following the command name
+ * and they return 0 if OK, <0 on error
+ */
+
+static int script_romboot(devinfo_t *di, char **argv)
+{
+	return file_ram_dump(di, ROMBOOT_LOCATION, ROMBOOT_LENGTH, argv[0]);
+}
+
+static int script_ramread(devinfo_t *di, char **argv)
+{
+	unsigned int addr, len;
+
+	if (script_num(di, argv[0], &addr) || script_num(di, argv[1], &len))
+		return -1;
+
+	return file_ram_dump(di, addr, len, argv[2]);
+}
+
+static int script_flashread(devinfo_t *di, char **argv)
+{
+	unsigned int addr, len;
+
+	if (script_num(di, argv[0], &addr) || script_num(di, argv[1], &len))
+		return -1;
+
+	return file_flash_dump(di, addr, len, argv[2]);
+}
+
+static int script_ramsum(devinfo_t *di, char **argv)
+{
+	unsigned int addr, len;
+
+	if (script_num(di, argv[0], &addr) || script_num(di, argv[1], &len))
+		return -1;
+
+	return file_ram_checksum(di, addr, len);
+}
+
+static int script_flashsum(devinfo_t *di, char **argv)
+{
+	unsigned int addr, len;
+
+	if (script_num(di, argv[0], &addr) || script_num(di, argv[1], &len))
+		return -1;
+
+	return file_flash_checksum(di, addr, len);
+}
+
+static int script_flashwrite(devinfo_t *di, char **argv)
+{
+	unsigned int addr;
+
+	if (script_num(di, argv[0], &addr))
+		return -1;
+
+	return file_flash_write(di, addr, argv[1]);
+}
+
+static int script_ramwrite(devinfo_t *di, char **argv)
+{
+	unsigned int addr;
+
+	if (script_num(di, argv[0], &addr))
+		return -1;
+
+	return file_ram_write(di, addr, argv[1], 1);
+}
+
+static int script_execute(devinfo_t *di, char **argv)
+{
+	unsigned int addr;
+
+	if (script_num(di, argv[0], &addr))
+		return -1;
+
+	return cmd_execute(di, addr);
+}
+
+static int script_bootfile(devinfo_t *di, char **argv)
+{
+	unsigned int pataddr, dataddr;
+
+	if (script_num(di, argv[0], &pataddr) ||
+	    script_num(di, argv[1], &dataddr))
+		return -1;
+
+	return file_bootfile_write(di, BOOTFILE_DEFAULT_ID, pataddr / di->ps,
+				   dataddr / di->ps, argv[2]);
+}
+
+static int script_bootfiles(devinfo_t *di, char **argv)
+{
+	return file_bootfiles_dump(di, 0, PAT_SEARCH_RANGE_PAGES);
+}
+
+static int script_pats(devinfo_t *di, char **argv)
+{
+	return image_show_pats_usb(di, 0, PAT_SEARCH_RANGE_PAGES);
+}
+
+static const script_cmd_t script_cmds[] =
+{
+	{ "romboot",	1, "<file>",			script_romboot },
+	{ "ramread",	3, "<addr> <len> <file>",	script_ramread },
+	{ "flashread",	3, "<addr> <len> <file>",	script_flashread },
+	{ "ramsum",	2, "<addr> <len>",		script_ramsum },
+	{ "flashsum",	2, "<addr> <len>",		script_flashsum },
+	{ "flashwrite",	2, "<addr> <file>",		script_flashwrite },
+	{ "ramwrite",	2, "<addr> <file>",		script_ramwrite },
+	{ "execute",	1, "<addr>",			script_execute },
+	{ "bootfile",	3, "<pataddr> <dataaddr> <file>", script_bootfile },
+	{ "bootfiles",	0, "",				script_bootfiles },
+	{ "pats",	0, "",				script_pats },
+	{ NULL,		0, NULL,			NULL }
+};
+
+/**
+ * Prints the commands understood in scripts
+ */
+void script_usage(void)
+{
+	const script_cmd_t *c;
+
+	DBG(NULL, "Script commands, one per line, # starts a comment:\n");
+	for (c = script_cmds; c->name; c++)
+		DBG(NULL, " %-11s%s\n", c->name, c->usage);
+}
+
+/**
+ * Runs a script of operations on an opened and inited device, stopping at
+ * the first failing step
+ * Numbers can be given in decimal or 0x hex format.
+ * @param di Device info struct of opened and inited device
+ * @param fname Script file, "-" for stdin
+ * @returns 0 if OK, <0 on error
+ */
+int script_run(devinfo_t *di, char *fname)
+{
+	FILE *f;
+	char line[SCRIPT_MAXLINE];
+	char *argv[SCRIPT_MAXARGS + 1];
+	char *tok, *save;
+	const script_cmd_t *c;
+	int lineno = 0, step = 0, argc, ret = 0;
+	double start, t;
+
+	if (!strcmp(fname, "-"))
+		f = stdin;
+	else
+		f = fopen(fname, "r");
+	if (f == NULL)
+	{
+		DBGE(di, "Can't open script: %s\n", strerror(errno));
+		return -1;
+	}
+
+	start = log_now();
+
+	while (fgets(line, sizeof(line), f))
+	{
+		lineno++;
+
+		tok = strchr(line, '#');
+		if (tok)
+			*tok = 0;
+
+		argc = 0;
+		for (tok = strtok_r(line, " \t\r\n", &save); tok;
+		     tok = strtok_r(NULL, " \t\r\n", &save))
+		{
+			if (argc > SCRIPT_MAXARGS)
+				break;
+			argv[argc++] = tok;
+		}
+
+		if (argc == 0)
+			continue;
+
+		for (c = script_cmds; c->name; c++)
+			if (!strcmp(c->name, argv[0]))
+				break;
+
+		if (c->name == NULL)
+		{
+			DBGE(di, "Line %d: unknown command %s\n", lineno, argv[0]);
+			ret = -1;
+			break;
+		}
+
+		if (argc - 1 != c->nargs)
+		{
+			DBGE(di, "Line %d: usage: %s %s\n", lineno, c->name,
+			     c->usage);
+			ret = -1;
+			break;
+		}
+
+		step++;
+		DBG(di, "- Step %d, line %d: %s\n", step, lineno, c->name);
+
+		t = log_now();
+		ret = c->run(di, argv + 1);
+		t = log_now() - t;
+
+		if (ret)
+		{
+			DBGE(di, "Step %d failed after %.3f s, stopping\n", step, t);
+			ret = -1;
+			break;
+		}
+
+		DBG(di, "- Step %d done in %.3f s\n", step, t);
+	}
+
+	if (!ret && ferror(f))
+	{
+		DBGE(di, "Can't read script\n");
+		ret = -1;
+	}
+
+	DBG(di, "- %d step(s) in %.3f s\n", step, log_now() - start);
+
+	if (f != stdin)
+		fclose(f);
+	return ret;
+}
@@ -0,0 +1,580 @@
+/*
+ * Sunburn - Firmware flashing tool for Sunplus SPMP8000 SoC
+ * 
+ * Copyright (C) 2011  Zoltan Devai <zdevai@gmail.com>
+ * Credits to Alemaxx and openschemes.com
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ * 
+ * This program is distributed in the hope that it will be useful, 
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <usb.h>
+
+#include "sb.h"
+
+/*
+ * Backup store, a directory shared by all backed up units:
+ *	chunks/<xx>/<sha256>	Erase block sized chunks, named by the SHA-256
+ *				of their content, <xx> being its first byte
+ *	units/<romboot id>.idx	Index of the last backup of a unit
+ * An index is a text file with a header line giving the block size and the
+ * number of blocks, followed by one "<crc32c> <sha256>" line per block,
+ * starting at block 0. Identical blocks, of the same or of other units, are
+ * stored only once. A unit index also tells what the unit holds after a
+ * restore, blocks left in an unknown state by a failed restore get the
+ * STORE_UNKNOWN name.
+ */
+#define STORE_INDEX_MAGIC	"# sunburn backup index 1"
+#define STORE_PATHLEN		4096
+#define STORE_UNKNOWN		"0000000000000000000000000000000000000000000000000000000000000000"
+
+/** One block in an index */
+typedef struct
+{
+	uint32_t crc;		/**< CRC32C of the block */
+	char sha[65];		/**< SHA-256 of the block as hex, the chunk name */
+} store_entry_t;
+
+/** Index of a backup */
+typedef struct
+{
+	unsigned int bs;	/**< Block size */
+	unsigned int nb;	/**< Number of blocks */
+	store_entry_t *e;	/**< One entry per block */
+} store_index_t;
+
+/**
+ * Creates a directory unless it exists
+ * @param di Context errors are reported to
+ * @param path Path of the directory
+ * @returns 0 if OK, <0 on error
+ */
+static int store_mkdir(devinfo_t *di, char *path)
+{
+	if (mkdir(path, 0755) && (errno != EEXIST))
+	{
+		DBGE(di, "Can't create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Builds the index path of the opened unit from its ROMBOOT ID
+ * @param di Device info struct of opened and inited device
+ * @param store Store directory
+ * @param path Returns the path, STORE_PATHLEN long
+ * @returns 0 if OK, <0 on error
+ */
+static int store_unit_path(devinfo_t *di, char *store, char *path)
+{
+	unsigned char devid[DEVICE_ID_LENGTH];
+	char hex[2 * DEVICE_ID_LENGTH + 1];
+	int i;
+
+	if (cmd_read_devid(di, (char *)devid))
+	{
+		DBGE(di, "Can't read device ID\n");
+		return -1;
+	}
+
+	for (i = 0; i < DEVICE_ID_LENGTH; i++)
+		sprintf(hex + 2 * i, "%02x", devid[i]);
+
+	snprintf(path, STORE_PATHLEN, "%s/units/%s.idx", store, hex);
+	return 0;
+}
+
+/**
+ * Builds the path of a chunk
+ * @param store Store directory
+ * @param sha SHA-256 of the chunk as hex
+ * @param path Returns the path, STORE_PATHLEN long
+ */
+static void store_chunk_path(char *store, char *sha, char *path)
+{
+	snprintf(path, STORE_PATHLEN, "%s/chunks/%.2s/%s", store, sha, sha);
+}
+
+/**
+ * Reads an index
+ * @param di Context errors are reported to
+ * @param fname Index file
+ * @param idx Index to fill, free e with free()
+ * @returns 0 if OK, 1 if the file doesn't exist, <0 on error
+ */
+static int store_index_read(devinfo_t *di, char *fname, store_index_t *idx)
+{
+	FILE *f;
+	char line[128];
+	unsigned int i;
+
+	idx->e = NULL;
+
+	f = fopen(fname, "r");
+	if (f == NULL)
+	{
+		if (errno == ENOENT)
+			return 1;
+		DBGE(di, "Can't open index %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	if (!fgets(line, sizeof(line), f) ||
+	    strncmp(line, STORE_INDEX_MAGIC, strlen(STORE_INDEX_MAGIC)) ||
+	    !fgets(line, sizeof(line), f) ||
+	    (sscanf(line, "bs %u blocks %u", &idx->bs, &idx->nb) != 2) ||
+	    (idx->bs == 0) || (idx->nb == 0))
+		goto invalid;
+
+	idx->e = calloc(idx->nb, sizeof(store_entry_t));
+	if (idx->e == NULL)
+	{
+		DBGE(di, "Can't allocate index\n");
+		goto fail;
+	}
+
+	for (i = 0; i < idx->nb; i++)
+		if (!fgets(line, sizeof(line), f) ||
+		    (sscanf(line, "%8x %64[0-9a-f]", &idx->e[i].crc,
+			    idx->e[i].sha) != 2) ||
+		    (strlen(idx->e[i].sha) != 64))
+			goto invalid;
+
+	fclose(f);
+	return 0;
+
+invalid:
+	DBGE(di, "Invalid index %s\n", fname);
+fail:
+	free(idx->e);
+	idx->e = NULL;
+	fclose(f);
+	return -1;
+}
+
+/**
+ * Writes an index, replacing the previous one atomically
+ * @param di Context errors are reported to
+ * @param fname Index file
+ * @param idx The index
+ * @returns 0 if OK, <0 on error
+ */
+static int store_index_write(devinfo_t *di, char *fname, store_index_t *idx)
+{
+	char tmp[STORE_PATHLEN + 8];
+	FILE *f;
+	unsigned int i;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	f = fopen(tmp, "w");
+	if (f == NULL)
+	{
+		DBGE(di, "Can't create index %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	fprintf(f, STORE_INDEX_MAGIC "\nbs %u blocks %u\n", idx->bs, idx->nb);
+	for (i = 0; i < idx->nb; i++)
+		fprintf(f, "%08x %s\n", idx->e[i].crc, idx->e[i].sha);
+
+	if (fflush(f) || fsync(fileno(f)))
+	{
+		DBGE(di, "Can't write index %s: %s\n", tmp, strerror(errno));
+		fclose(f);
+		unlink(tmp);
+		return -1;
+	}
+	fclose(f);
+
+	if (rename(tmp, fname))
+	{
+		DBGE(di, "Can't rename index %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stores a chunk unless the store already has it
+ * @param di Context errors are reported to
+ * @param store Store directory
+ * @param sha SHA-256 of the chunk as hex
+ * @param data Content of the chunk
+ * @param len Length of the chunk
+ * @returns 0 if it was already stored, 1 if stored now, <0 on error
+ */
+static int store_chunk_put(devinfo_t *di, char *store, char *sha, char *data,
+			   int len)
+{
+	char path[STORE_PATHLEN], tmp[STORE_PATHLEN + 32];
+	int fd, ret;
+
+	store_chunk_path(store, sha, path);
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s/chunks/%.2s", store, sha);
+	if (store_mkdir(di, tmp))
+		return -1;
+
+	/* Written under a temporary name, so only complete chunks exist */
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+	{
+		DBGE(di, "Can't create chunk %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+
+	/* On disk before the rename, like the index that will point to it */
+	ret = write(fd, data, len);
+	if ((ret != len) || fsync(fd))
+	{
+		DBGE(di, "Can't write chunk %s\n", tmp);
+		goto fail;
+	}
+	close(fd);
+
+	if (rename(tmp, path))
+	{
+		DBGE(di, "Can't rename chunk %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return -1;
+	}
+
+	return 1;
+
+fail:
+	close(fd);
+	unlink(tmp);
+	return -1;
+}
+
+/**
+ * Reads a chunk and checks its content against its name
+ * @param di Context errors are reported to
+ * @param store Store directory
+ * @param sha SHA-256 of the chunk as hex
+ * @param data Buffer to fill
+ * @param len Length of the chunk
+ * @returns 0 if OK, <0 on error
+ */
+static int store_chunk_get(devinfo_t *di, char *store, char *sha, char *data,
+			   int len)
+{
+	char path[STORE_PATHLEN], hex[65];
+	hash_t hs;
+	int fd, ret;
+
+	store_chunk_path(store, sha, path);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		DBGE(di, "Can't open chunk %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	ret = read(fd, data, len);
+	close(fd);
+	if (ret != len)
+	{
+		DBGE(di, "Can't read chunk %s\n", path);
+		return -1;
+	}
+
+	hash_init(&hs, HASH_SHA256);
+	hash_update(&hs, data, len);
+	hash_final(&hs);
+	hash_hex(&hs, HASH_SHA256, hex);
+	if (strcmp(hex, sha))
+	{
+		DBGE(di, "Chunk %s is corrupted\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Gets the CRC32C of every block from the checksum helper
+ * @param di Device info struct of opened and inited device
+ * @param nb Number of blocks from block 0
+ * @returns The CRCs, NULL if there's no helper or it failed
+ */
+static uint32_t *store_device_crcs(devinfo_t *di, unsigned int nb)
+{
+	uint32_t *crcs;
+
+	if (di->helper == NULL)
+		return NULL;
+
+	crcs = malloc(nb * sizeof(uint32_t));
+	if (crcs == NULL)
+		return NULL;
+
+	if (helper_crc_pages(di, 0, nb * di->ppb, di->ppb, crcs))
+	{
+		DBG(di, "- Checksum helper failed, reading all blocks\n");
+		helper_free(di);
+		free(crcs);
+		return NULL;
+	}
+
+	return crcs;
+}
+
+/**
+ * Backs up the whole flash of the device into a store
+ * Every block is read, checksummed and stored as a chunk unless the store
+ * already has one with the same content. With a checksum helper, blocks
+ * whose CRC32C on the device matches the previous backup of the unit are
+ * not even read.
+ * @param di Device info struct of opened and inited device
+ * @param store Store directory, created if needed
+ * @returns 0 if OK, <0 on error
+ */
+int store_backup(devinfo_t *di, char *store)
+{
+	char path[STORE_PATHLEN];
+	store_index_t idx, old;
+	uint32_t *crcs = NULL;
+	char *buf = NULL;
+	hash_t hs;
+	unsigned int i;
+	int ret, stored = 0, dups = 0, same = 0;
+
+	snprintf(path, sizeof(path), "%s/units", store);
+	if (store_mkdir(di, store) || store_mkdir(di, path))
+		return -1;
+	snprintf(path, sizeof(path), "%s/chunks", store);
+	if (store_mkdir(di, path) || store_unit_path(di, store, path))
+		return -1;
+
+	old.e = NULL;
+	idx.bs = di->bs;
+	idx.nb = di->tb;
+	idx.e = calloc(idx.nb, sizeof(store_entry_t));
+	buf = malloc(di->bs);
+	if ((idx.e == NULL) || (buf == NULL))
+	{
+		DBGE(di, "Can't allocate backup buffers\n");
+		goto fail;
+	}
+
+	/* The previous backup only helps if it has the same geometry */
+	ret = store_index_read(di, path, &old);
+	if (ret < 0)
+		goto fail;
+	if (!ret && ((old.bs != idx.bs) || (old.nb != idx.nb)))
+	{
+		free(old.e);
+		old.e = NULL;
+	}
+	if (old.e)
+		crcs = store_device_crcs(di, idx.nb);
+
+	DBG(di, "- Backing up %u blocks to %s\n", idx.nb, path);
+	progress_expect(di->prog, (uint64_t)idx.nb * di->bs);
+
+	for (i = 0; i < idx.nb; i++)
+	{
+		if (crcs && (crcs[i] == old.e[i].crc) &&
+		    strcmp(old.e[i].sha, STORE_UNKNOWN))
+		{
+			idx.e[i] = old.e[i];
+			same++;
+			continue;
+		}
+
+		if (cmd_read_flash_pages(di, i * di->ppb, di->ppb, buf))
+		{
+			DBGE(di, "Can't read block %u\n", i);
+			goto fail;
+		}
+
+		hash_init(&hs, HASH_CRC32C | HASH_SHA256);
+		hash_update(&hs, buf, di->bs);
+		hash_final(&hs);
+		idx.e[i].crc = hs.crc32c;
+		hash_hex(&hs, HASH_SHA256, idx.e[i].sha);
+
+		ret = store_chunk_put(di, store, idx.e[i].sha, buf, di->bs);
+		if (ret < 0)
+			goto fail;
+		if (ret)
+			stored++;
+		else
+			dups++;
+	}
+
+	if (store_index_write(di, path, &idx))
+		goto fail;
+
+	DBG(di, "- %d new chunks, %d already stored, %d unchanged blocks "
+	    "not read\n", stored, dups, same);
+
+	free(crcs);
+	free(old.e);
+	free(idx.e);
+	free(buf);
+	return 0;
+
+fail:
+	free(crcs);
+	free(old.e);
+	free(idx.e);
+	free(buf);
+	return -1;
+}
+
+/**
+ * Restores a backup from a store to the flash of the device
+ * Blocks are skipped if they already hold the right content: with a
+ * checksum helper this is checked on the device, otherwise the block is
+ * read back and compared. The unit index isn't trusted for this, the flash
+ * may have been written since. It describes the restored content
+ * afterwards.
+ * @param di Device info struct of opened and inited device
+ * @param store Store directory
+ * @param fname Index to restore, NULL for the last backup of the unit
+ * @returns 0 if OK, <0 on error
+ */
+int store_restore(devinfo_t *di, char *store, char *fname)
+{
+	char path[STORE_PATHLEN];
+	store_index_t idx, cur;
+	uint32_t *crcs = NULL;
+	char *buf = NULL, *old;
+	unsigned int i;
+	int ret, written = 0;
+
+	cur.e = NULL;
+
+	if (store_unit_path(di, store, path))
+		return -1;
+
+	ret = store_index_read(di, fname ? fname : path, &idx);
+	if (ret)
+	{
+		if (ret > 0)
+			DBGE(di, "No backup of this unit in %s\n", store);
+		return -1;
+	}
+
+	if ((idx.bs != di->bs) || (idx.nb > di->tb))
+	{
+		DBGE(di, "Backup doesn't fit the flash geometry\n");
+		goto fail;
+	}
+
+	/* What the device holds now, according to the helper */
+	crcs = store_device_crcs(di, idx.nb);
+	if ((crcs == NULL) && fname)
+	{
+		ret = store_index_read(di, path, &cur);
+		if (ret < 0)
+			goto fail;
+		if (!ret && (cur.nb != idx.nb))
+		{
+			free(cur.e);
+			cur.e = NULL;
+		}
+	}
+
+	buf = malloc(2 * di->bs + di->ps);
+	if (buf == NULL)
+	{
+		DBGE(di, "Can't allocate restore buffer\n");
+		goto fail;
+	}
+	old = buf + di->bs + di->ps;
+
+	DBG(di, "- Restoring %u blocks\n", idx.nb);
+
+	for (i = 0; i < idx.nb; i++)
+	{
+		if (crcs && (crcs[i] == idx.e[i].crc))
+			continue;
+
+		ret = store_chunk_get(di, store, idx.e[i].sha, buf, di->bs);
+
+		/* Without the helper only the block itself tells */
+		if (!ret && (crcs == NULL))
+		{
+			progress_expect(di->prog, di->bs);
+			ret = cmd_read_flash_pages(di, i * di->ppb, di->ppb, old);
+			if (!ret && !memcmp(buf, old, di->bs))
+			{
+				if (cur.e)
+					cur.e[i] = idx.e[i];
+				continue;
+			}
+		}
+
+		if (!ret)
+		{
+			progress_expect(di->prog,
+					(di->helper ? 1ULL : 2ULL) * di->bs);
+			ret = image_write_blocks_usb(di, i * di->ppb, 1, buf,
+						     buf + di->bs);
+		}
+		if (ret)
+		{
+			DBGE(di, "Can't restore block %u\n", i);
+			if (cur.e)
+			{
+				cur.e[i].crc = 0;
+				strcpy(cur.e[i].sha, STORE_UNKNOWN);
+				store_index_write(di, path, &cur);
+			}
+			goto fail;
+		}
+		if (cur.e)
+			cur.e[i] = idx.e[i];
+		written++;
+	}
+
+	if (fname && store_index_write(di, path, &idx))
+		goto fail;
+
+	DBG(di, "- %d blocks written, %u unchanged\n", written,
+	    idx.nb - written);
+
+	free(crcs);
+	free(cur.e);
+	free(idx.e);
+	free(buf);
+	return 0;
+
+fail:
+	free(crcs);
+	free(cur.e);
+	free(idx.e);
+	free(buf);
+	return -1;
+}
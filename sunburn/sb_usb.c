@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <pthread.h>
 
 #include <usb.h>
 
@@ -63,9 +64,10 @@ typedef struct {
  * Find and open a usb device with libusb based on its VID and PID
  * @param vid Vendor ID of device
  * @param pid Product ID of device
+ * @param index Which one of the matching devices to open, 0 for the first
  * @returns NULL if not found, usb_dev_handle if OK
  */
-static usb_dev_handle *usb_open_device(uint16_t vid, uint16_t pid)
+static usb_dev_handle *usb_open_device(uint16_t vid, uint16_t pid, int index)
 {
 	struct usb_bus *pbus;
 	struct usb_device *pdev;
@@ -76,7 +78,8 @@ static usb_dev_handle *usb_open_device(uint16_t vid, uint16_t pid)
 	for(pbus = usb_get_busses(); pbus; pbus = pbus->next) {
 		for(pdev = pbus->devices; pdev; pdev = pdev->next) {
 			if ((pdev->descriptor.idVendor == vid)
-				&& (pdev->descriptor.idProduct == pid)) {
+				&& (pdev->descriptor.idProduct == pid)
+				&& (index-- == 0)) {
 				return usb_open(pdev);
 			}
 		}
@@ -85,49 +88,56 @@ static usb_dev_handle *usb_open_device(uint16_t vid, uint16_t pid)
 	return NULL;
 }
 
+/** libusb-0.1 keeps the bus list in globals */
+static pthread_mutex_t usb_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * Finds and configures an attached SPMP8000 device in ISP mode
- * @param usbdev Pointer to usb_dev_handle pointer for future reference
- * @returns 0 if OK, <0 on error
+ * Finds and configures one of the attached SPMP8000 devices in ISP mode
+ * @param di Device info struct to store the usb_dev_handle in
+ * @param index Which device to open, 0 for the first one found
+ * @returns 0 if OK, 1 if there's no such device, <0 on error
  */
-int usb_spmp8000_init(usb_dev_handle **usbdev)
+int usb_spmp8000_open(devinfo_t *di, int index)
 {
 	int ret;
-
-	/* libusb init */
-	usb_init();
+	usb_dev_handle *ud;
 
 	/* Configure device */
-	DBG1("Looking for SPMP8000 device with VID: 0x%04X, PID: 0x%04X\n",
-		SPMP8000_VENDORID, SPMP8000_PRODUCTID);
-	*usbdev = usb_open_device(SPMP8000_VENDORID, SPMP8000_PRODUCTID);
-	if (*usbdev == NULL) {
-		DBGE("Could not find SPMP8000 device\n");
-		return -1;
-	}
+	DBG1(di, "Looking for SPMP8000 device #%d with VID: 0x%04X, PID: 0x%04X\n",
+		index, SPMP8000_VENDORID, SPMP8000_PRODUCTID);
 
-	usb_reset(*usbdev);
+	pthread_mutex_lock(&usb_lock);
+	usb_init();
+	ud = usb_open_device(SPMP8000_VENDORID, SPMP8000_PRODUCTID, index);
+	pthread_mutex_unlock(&usb_lock);
+	if (ud == NULL)
+		return 1;
+
+	usb_reset(ud);
 
 	/* Detach the mass storage driver */
-	ret = usb_detach_kernel_driver_np(*usbdev, 0);
+	ret = usb_detach_kernel_driver_np(ud, 0);
 	if (ret)
-		DBG1("Detached kernel driver from device\n");
+		DBG1(di, "Detached kernel driver from device\n");
 
-	ret = usb_set_configuration(*usbdev, SPMP8000_USB_CONFIG);
+	ret = usb_set_configuration(ud, SPMP8000_USB_CONFIG);
 	if (ret < 0) {
-		DBGE("Could not select configuration #%d. "
+		DBGE(di, "Could not select configuration #%d. "
 			"Try with root user\n", SPMP8000_USB_CONFIG);
+		usb_close(ud);
 		return -1;
 	}
 
-	ret = usb_claim_interface(*usbdev, SPMP8000_USB_IF);
+	ret = usb_claim_interface(ud, SPMP8000_USB_IF);
 	if (ret < 0) {
-		DBGE("Could not claim interface #%d. "
+		DBGE(di, "Could not claim interface #%d. "
 			"Try with root user\n", SPMP8000_USB_IF);
+		usb_close(ud);
 		return -1;
 	}
 
-	DBG1("SPMP8000 USB device initialized\n");
+	di->ud = ud;
+	DBG1(di, "SPMP8000 USB device initialized\n");
 
 	return 0;
 }
@@ -154,39 +164,29 @@ static void fill_cbw(cbw_t *cbw, uint32_t cmd, uint32_t addr, uint32_t len, uint
 }
 
 /**
- * Perform a USB transaction.
- * Transactions can be:
- * 	write command: wdata and rdata NULL
- * 	write command + write data: rdata NULL
- * 	write command + read data : wdata NULL
- * 	write command + write data + read data: not valid, don't use
+ * Runs the CBW, data and CSW stages of a USB transaction
  * @param di Device info struct of opened and inited device
  * @param cmd Command to be sent
  * @param addr Address to be sent
- * @param wlen Length of data to be written in a write+write txn
- * @param wdata Pointer to data to be written in a write+write txn, wlen size
- * @param rlen Length of data to be read in a write+read txn
- * @param rdata Pointer to data buf to fill in write+read txn, rlen size
- * @param flag Flaf to be sent in CBW
+ * @param len Length of data
+ * @param data Data to write or buffer to read to, NULL for none
+ * @param flag Flag to be sent in CBW
  * @returns 0 if OK, <0 on error
  */
-int usb_txn(devinfo_t *di, uint32_t cmd, uint32_t addr, uint32_t len,
-	    char *data, uint8_t flag)
+int usb_bulk_txn(devinfo_t *di, uint32_t cmd, uint32_t addr, uint32_t len,
+		 char *data, uint8_t flag)
 {
 	cbw_t cbw;
 	csw_t csw;
 	int ret;
 	usb_dev_handle *ud = di->ud;
 
-	DBG2("USB txn: Cmd:0x%08X, addr:0x%08X, len:0x%08X, data:%s\n",
-		cmd, addr, len, (data ? "yes" : "NULL"));
-
 	/* Transaction stage 1, Send CBW */
 	fill_cbw(&cbw, cmd, addr, len, flag);
 	ret = usb_bulk_write(ud, 0x02, (char*)&cbw, sizeof(cbw_t), USB_TIMEOUT);
 	if (ret < 0)
 	{
-		DBGE("USB I/O: Can't send CBW\n");
+		DBGE(di, "USB I/O: Can't send CBW\n");
 		return -1;
 	}
 
@@ -198,7 +198,7 @@ int usb_txn(devinfo_t *di, uint32_t cmd, uint32_t addr, uint32_t len,
 
 	if (ret < 0)
 	{
-		DBGE("USB I/O: Can't %s data: %d\n",
+		DBGE(di, "USB I/O: Can't %s data: %d\n",
 		     (flag == SCSI_FLAG_WRITE) ? "write" : "read", ret);
 		return -1;
 	}
@@ -206,9 +206,49 @@ int usb_txn(devinfo_t *di, uint32_t cmd, uint32_t addr, uint32_t len,
 	/* Transaction stage 3, Get CSW */
 	ret = usb_bulk_read(ud, 0x81, (char*)&csw, sizeof(csw_t), USB_TIMEOUT);
 	if ((ret < sizeof(csw_t)) || (csw.sig != le32toh(USB_CSW_SIG))) {
-		DBGE("USB I/O: CSW invalid\n");
+		DBGE(di, "USB I/O: CSW invalid\n");
 		return -1;
 	}
 
 	return 0;
 }
+
+/**
+ * Perform a USB transaction.
+ * Transactions can be:
+ * 	write command: wdata and rdata NULL
+ * 	write command + write data: rdata NULL
+ * 	write command + read data : wdata NULL
+ * 	write command + write data + read data: not valid, don't use
+ * @param di Device info struct of opened and inited device
+ * @param cmd Command to be sent
+ * @param addr Address to be sent
+ * @param wlen Length of data to be written in a write+write txn
+ * @param wdata Pointer to data to be written in a write+write txn, wlen size
+ * @param rlen Length of data to be read in a write+read txn
+ * @param rdata Pointer to data buf to fill in write+read txn, rlen size
+ * @param flag Flaf to be sent in CBW
+ * @returns 0 if OK, <0 on error
+ */
+int usb_txn(devinfo_t *di, uint32_t cmd, uint32_t addr, uint32_t len,
+	    char *data, uint8_t flag)
+{
+	int ret;
+
+	/* Logged as a binary record, formatting is left to the flusher */
+	if (di->dl > 1)
+		log_txn(di, 2, cmd, addr, len, flag, data != NULL);
+
+	if (di->plan)
+		plan_txn(di->plan, cmd, addr, len, data != NULL);
+
+	/* Devices sharing a bus take turns */
+	sched_begin(di);
+	if (di->fake)
+		ret = fake_txn(di->fake, cmd, addr, len, data, flag);
+	else
+		ret = usb_bulk_txn(di, cmd, addr, len, data, flag);
+	sched_end(di, data ? len : 0);
+
+	return ret;
+}